@@ -1,38 +1,173 @@
 /* Author: Brad Powell
  * Date: 6/3/09
- * Keygen - Use: "keygen keylength"
- * Generates a string of random uppercase characters and spaces to be used as a one-time pad.
+ * Keygen - Use: "keygen [-t threads] [-a alphabet] keylength"
+ * Generates a string of random uppercase characters and spaces to be used as a one-time pad, or
+ * of the symbols of another alphabet of otp_codec.h with -a (raw bytes, without the newline, for
+ * -a bytes). Randomness comes from the kernel CSPRNG (getrandom) in bulk. Random bytes are mapped
+ * onto the symbols round robin, keeping only those below the largest multiple of the alphabet size
+ * (243 = 9 * 27 for letters), so every symbol is equally likely; the rest are thrown away. The key
+ * is written to stdout in 1 MiB blocks, so any length works, and -t splits the generation over
+ * several threads that take turns filling blocks.
  */
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <time.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/random.h>
+#include "otp_codec.h"
+
+#define BLOCK_SIZE	(1 << 20)	// Bytes of key per output block
+#define RANDOM_SIZE	(64 << 10)	// Bytes fetched from getrandom per call
+
+static unsigned char symbolOf[256];	// Random byte -> symbol
+static int keepBelow;			// Random bytes from here up are thrown away
+
+// One generator thread: fills blocks threadIndex, threadIndex + numThreads, ... into its two slots
+struct generator {
+	pthread_t tid;
+	unsigned long long firstBlock;
+	char *slot[2];			// Double buffer: one being written out while the other fills
+	size_t slotLen[2];
+	int slotReady[2];
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static unsigned long long keylength, numBlocks;
+static int numThreads = 1;
+
+void error(const char *msg) { perror(msg); exit(1); }	// Error function for reporting issues
+
+// Fill 'buf' with 'len' unbiased random symbols
+static void fillKey(char *buf, size_t len, unsigned char *rnd) {
+	size_t have = 0, used = 0;
+	ssize_t n;
+	unsigned char r;
+
+	while (len > 0) {
+		if (used == have) {
+			n = getrandom(rnd, RANDOM_SIZE, 0);
+			if (n < 0) {
+				if (errno == EINTR) continue;
+				error("ERROR reading random bytes");
+			}
+			have = n;
+			used = 0;
+		}
+		r = rnd[used++];
+		if (r >= keepBelow) continue;
+		*buf++ = symbolOf[r];
+		len--;
+	}
+}
+
+static size_t blockLen(unsigned long long block) {
+	if (block == numBlocks - 1 && keylength % BLOCK_SIZE != 0) return keylength % BLOCK_SIZE;
+	return BLOCK_SIZE;
+}
+
+static void *generate(void *arg) {
+	struct generator *g = arg;
+	unsigned char *rnd = malloc(RANDOM_SIZE);
+	unsigned long long block, round;
+	int s;
+
+	if (rnd == NULL) error("ERROR out of memory");
+	for (block = g->firstBlock, round = 0; block < numBlocks; block += numThreads, round++) {
+		s = round % 2;
+		// Wait for the writer to empty this slot
+		pthread_mutex_lock(&g->lock);
+		while (g->slotReady[s]) pthread_cond_wait(&g->cond, &g->lock);
+		pthread_mutex_unlock(&g->lock);
+
+		g->slotLen[s] = blockLen(block);
+		fillKey(g->slot[s], g->slotLen[s], rnd);
+
+		pthread_mutex_lock(&g->lock);
+		g->slotReady[s] = 1;
+		pthread_cond_broadcast(&g->cond);
+		pthread_mutex_unlock(&g->lock);
+	}
+	free(rnd);
+	return NULL;
+}
+
+static void writeAll(const char *buf, size_t len) {
+	ssize_t n;
+	while (len > 0) {
+		n = write(STDOUT_FILENO, buf, len);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			error("ERROR writing key");
+		}
+		buf += n;
+		len -= n;
+	}
+}
 
 int main (int argc, char *argv[]) {
-	srand(time(0));		// Randomize seed
-	int	keylength, i,	// Length of key and loop counter
-		ascii;		// Holder for randomized ASCII character
-	char key[70500];	// Buffer for generated key
-	memset(key, '\0', sizeof(key));
-	
-	// Verify use as "keygen keylength"
-	if (argc != 2) {
-		fprintf(stderr, "USAGE: %s keylength\n", argv[0]);
+	struct generator *gens;
+	const struct otpCodec *codec = otpCodecFor(OTP_ALPHA_LETTERS);
+	unsigned long long block;
+	char *end;
+	int i, opt, s;
+
+	// Verify use as "keygen [-t threads] [-a alphabet] keylength"
+	while ((opt = getopt(argc, argv, "t:a:")) != -1) {
+		if (opt == 't' && (numThreads = atoi(optarg)) >= 1) continue;
+		if (opt == 'a' && (codec = otpCodecByName(optarg)) != NULL) continue;
+		fprintf(stderr, "USAGE: %s [-t threads] [-a alphabet] keylength\n", argv[0]);
+		exit(1);
+	}
+	if (argc - optind != 1) {
+		fprintf(stderr, "USAGE: %s [-t threads] [-a alphabet] keylength\n", argv[0]);
+		exit(1);
+	}
+	keylength = strtoull(argv[optind], &end, 10);	// Convert string of keylength to a number
+	if (*end != '\0' || argv[optind][0] == '-') {
+		fprintf(stderr, "USAGE: %s [-t threads] [-a alphabet] keylength\n", argv[0]);
 		exit(1);
 	}
 
-	keylength = atoi(argv[1]);	// Convert string of keylength to int
-	for (i = 0; i < keylength; i++) {
-		ascii = 65 + (rand() % 27);	// Set ascii to 65-91, which is A-[
-		if (ascii == 91) { ascii = 32; } // Convert [ to space
-		key[i] = ascii;			// Append character to the key
+	// Bytes below keepBelow map to the symbols, the same number of bytes per symbol
+	keepBelow = 256 - 256 % codec->size;
+	for (i = 0; i < keepBelow; i++)
+		symbolOf[i] = codec->symbols ? codec->symbols[i % codec->size] : i;
+
+	numBlocks = (keylength + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	if (numBlocks < (unsigned long long)numThreads) numThreads = numBlocks ? numBlocks : 1;
+	gens = calloc(numThreads, sizeof(*gens));
+	if (gens == NULL) error("ERROR out of memory");
+	for (i = 0; i < numThreads; i++) {
+		gens[i].firstBlock = i;
+		gens[i].slot[0] = malloc(BLOCK_SIZE);
+		gens[i].slot[1] = malloc(BLOCK_SIZE);
+		if (gens[i].slot[0] == NULL || gens[i].slot[1] == NULL) error("ERROR out of memory");
+		pthread_mutex_init(&gens[i].lock, NULL);
+		pthread_cond_init(&gens[i].cond, NULL);
+		if (pthread_create(&gens[i].tid, NULL, generate, &gens[i]) != 0) error("ERROR creating thread");
 	}
 
-	key[i] = '\n';	// Add newline
+	// Write the blocks out in order as their generators finish them
+	for (block = 0; block < numBlocks; block++) {
+		struct generator *g = &gens[block % numThreads];
+		s = (block / numThreads) % 2;
+		pthread_mutex_lock(&g->lock);
+		while (!g->slotReady[s]) pthread_cond_wait(&g->cond, &g->lock);
+		pthread_mutex_unlock(&g->lock);
+
+		writeAll(g->slot[s], g->slotLen[s]);
 
-	// Print key to stdout
-	fprintf(stdout, "%s", key);
+		pthread_mutex_lock(&g->lock);
+		g->slotReady[s] = 0;
+		pthread_cond_broadcast(&g->cond);
+		pthread_mutex_unlock(&g->lock);
+	}
+	if (codec->lines) writeAll("\n", 1);	// Add newline
 
+	for (i = 0; i < numThreads; i++) pthread_join(gens[i].tid, NULL);
 	return 0;
 }
@@ -0,0 +1,185 @@
+/* Author: Brad Powell
+ * Date: 6/29/2019
+ * otp_async: Client library for programs that encode and decode in process
+ * See otp_async.h for the interface.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "otp_proto.h"
+#include "otp_codec.h"
+#include "otp_async.h"
+
+#define GROUP_JOBS	16		// Requests sent per round trip, as in otp_batch ...
+#define GROUP_BYTES	(8 << 20)	// ... or fewer, once their text adds up to this much
+
+struct otpAsync {
+	struct otpEndpoints *eps;
+	uint32_t features;		// OTP_FEAT_* asked of every connection
+	struct otpRequest *head, *tail;	// Queued, not yet taken by a thread
+	unsigned long pending;		// Submitted and not yet done
+	int stopping;
+	int numThreads;
+	pthread_t *threads;
+	pthread_mutex_t lock;
+	pthread_cond_t work;		// Something was queued, or the threads should stop
+	pthread_cond_t idle;		// A group was done
+};
+
+// Take the next group off the queue: requests for the same operation, oldest first. Called with
+// the lock held. Returns how many.
+static int takeGroup(struct otpAsync *a, struct otpRequest **group) {
+	size_t bytes = 0;
+	int n = 0;
+
+	while (a->head != NULL && n < GROUP_JOBS && bytes < GROUP_BYTES &&
+			(n == 0 || a->head->opcode == group[0]->opcode)) {
+		group[n++] = a->head;
+		bytes += a->head->job.len;
+		a->head = a->head->next;
+	}
+	if (a->head == NULL) a->tail = NULL;
+	return n;
+}
+
+// Send a group as one pipeline (over several daemons, one each) and hand out the answers. The
+// requests are done with once 'done' has been called, so nothing touches them after that.
+static void runGroup(struct otpAsync *a, struct otpRequest **group, int n) {
+	struct otpJob jobs[GROUP_JOBS];
+	int err = 0, i;
+
+	for (i = 0; i < n; i++) {
+		jobs[i] = group[i]->job;
+		jobs[i].status = -1;
+		jobs[i].wire = NULL;
+	}
+	errno = 0;	// So a failure that sets none isn't blamed on an earlier one
+	if (otpRoute(a->eps, group[0]->opcode, jobs, n, a->features) < 0) err = errno ? errno : EPIPE;
+	for (i = 0; i < n; i++) {
+		free(jobs[i].wire);	// Packed by the route
+		jobs[i].wire = NULL;
+		group[i]->job = jobs[i];
+		group[i]->err = jobs[i].status < 0 ? err : 0;
+		if (group[i]->done != NULL) group[i]->done(group[i]);
+	}
+}
+
+// A group is done: count it off, and wake otpAsyncWait if that was the last. Called with the lock held.
+static void finishGroup(struct otpAsync *a, int n) {
+	a->pending -= n;
+	if (a->pending == 0) pthread_cond_broadcast(&a->idle);
+}
+
+static void *asyncThread(void *arg) {
+	struct otpAsync *a = arg;
+	struct otpRequest *group[GROUP_JOBS];
+	int n;
+
+	pthread_mutex_lock(&a->lock);
+	while (1) {
+		while (a->head == NULL && !a->stopping) pthread_cond_wait(&a->work, &a->lock);
+		if (a->head == NULL) break;
+		n = takeGroup(a, group);
+		pthread_mutex_unlock(&a->lock);
+		runGroup(a, group, n);
+		pthread_mutex_lock(&a->lock);
+		finishGroup(a, n);
+	}
+	pthread_mutex_unlock(&a->lock);
+	return NULL;
+}
+
+// Serve requests to 'eps' with 'threads' threads of its own (0 for none: see otpAsyncWait),
+// asking each connection for 'features' (OTP_FEAT_*). 'eps' must outlive it. Returns NULL, with
+// errno set, if it couldn't be started.
+struct otpAsync *otpAsyncNew(struct otpEndpoints *eps, int threads, uint32_t features) {
+	struct otpAsync *a = calloc(1, sizeof(*a));
+
+	if (a == NULL) return NULL;
+	if (threads > 0 && (a->threads = malloc(threads * sizeof(*a->threads))) == NULL) {
+		free(a);
+		return NULL;
+	}
+	a->eps = eps;
+	a->features = features;
+	pthread_mutex_init(&a->lock, NULL);
+	pthread_cond_init(&a->work, NULL);
+	pthread_cond_init(&a->idle, NULL);
+	for (a->numThreads = 0; a->numThreads < threads; a->numThreads++) {
+		if ((errno = pthread_create(&a->threads[a->numThreads], NULL, asyncThread, a)) != 0) {
+			otpAsyncFree(a);
+			return NULL;
+		}
+	}
+	return a;
+}
+
+// Queue 'req'. It belongs to the library until its 'done' is called, which for text or key outside
+// the alphabet is before this returns. Returns 0, or -1 with errno EINVAL if it isn't a request
+// the daemons could take.
+int otpAsyncSubmit(struct otpAsync *a, struct otpRequest *req) {
+	const struct otpCodec *codec = otpCodecFor(req->job.alphabet);
+
+	if ((req->opcode != OTP_OP_ENCODE && req->opcode != OTP_OP_DECODE) || codec == NULL || req->job.wire != NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	req->job.status = -1;
+	req->err = 0;
+	req->next = NULL;
+	// The daemons transform whatever they are sent, so this is the only check the characters get
+	if (!codec->validate(req->job.text, req->job.len) ||
+			(req->job.key != NULL && !codec->validate(req->job.key, req->job.len))) {
+		req->job.status = OTP_ST_BAD_CHAR;
+		if (req->done != NULL) req->done(req);
+		return 0;
+	}
+	pthread_mutex_lock(&a->lock);
+	if (a->tail != NULL) a->tail->next = req;
+	else a->head = req;
+	a->tail = req;
+	a->pending++;
+	pthread_cond_signal(&a->work);
+	pthread_mutex_unlock(&a->lock);
+	return 0;
+}
+
+// Return once no request is pending, sending queued ones from this thread in the meantime
+void otpAsyncWait(struct otpAsync *a) {
+	struct otpRequest *group[GROUP_JOBS];
+	int n;
+
+	pthread_mutex_lock(&a->lock);
+	while (a->pending > 0) {
+		if (a->head == NULL) {
+			otpPhase(OTP_CPHASE_PARALLEL);
+			pthread_cond_wait(&a->idle, &a->lock);
+			continue;
+		}
+		n = takeGroup(a, group);
+		pthread_mutex_unlock(&a->lock);
+		runGroup(a, group, n);
+		pthread_mutex_lock(&a->lock);
+		finishGroup(a, n);
+	}
+	pthread_mutex_unlock(&a->lock);
+}
+
+// Finish every pending request, then stop the threads. The endpoints' connections stay open.
+void otpAsyncFree(struct otpAsync *a) {
+	int i;
+
+	otpAsyncWait(a);
+	pthread_mutex_lock(&a->lock);
+	a->stopping = 1;
+	pthread_cond_broadcast(&a->work);
+	pthread_mutex_unlock(&a->lock);
+	for (i = 0; i < a->numThreads; i++) pthread_join(a->threads[i], NULL);
+	pthread_cond_destroy(&a->work);
+	pthread_cond_destroy(&a->idle);
+	pthread_mutex_destroy(&a->lock);
+	free(a->threads);
+	free(a);
+}
@@ -0,0 +1,54 @@
+/* Author: Brad Powell
+ * Date: 6/29/2019
+ * otp_async: Client library for programs that encode and decode in process
+ * Rather than running otp_enc or otp_dec and reading what it prints, a program can link libotp.a
+ * (built by compileall) and hand its requests over in memory. Open the daemons with
+ * otpEndpointsNew (otp_client.h), then an otpAsync on them, and submit otpRequests: a job, whose
+ * text and key are buffers of the caller's, and a function to call when it is answered.
+ *
+ * otpAsyncSubmit only queues the request and returns. The otpAsync's threads, each working one
+ * connection at a time, take queued requests a group at a time, pipeline them to the daemons by
+ * the route (otp_route.c, so failover, busy retries and connections kept for reuse come with it)
+ * and call each request's 'done' from that thread once its status is in. Requests may be submitted
+ * from any thread, 'done' included. otpAsyncWait returns once nothing is pending, working the
+ * queue itself meanwhile rather than only sleeping, so an otpAsync with no threads runs every
+ * request in otpAsyncWait, on the caller's thread. otp_enc and otp_dec use it that way.
+ *
+ *	struct otpEndpoints *eps = otpEndpointsNew("7000,7001", OTP_ROUTE_LEAST);
+ *	struct otpAsync *a = otpAsyncNew(eps, 4, 0);
+ *	req.opcode = OTP_OP_ENCODE;
+ *	req.job.text = text; req.job.key = key; req.job.len = len; req.job.out = out;
+ *	req.done = answered;
+ *	otpAsyncSubmit(a, &req);
+ *	...
+ *	otpAsyncFree(a);	// After otpAsyncWait
+ *	otpEndpointsFree(eps);
+ *
+ * Text and key are checked against the alphabet as they are submitted: a request with a character
+ * outside it isn't sent, and its 'done' is called from otpAsyncSubmit with OTP_ST_BAD_CHAR.
+ */
+
+#ifndef OTP_ASYNC_H
+#define OTP_ASYNC_H
+
+#include "otp_client.h"
+
+struct otpRequest {
+	struct otpJob job;	// Text, key (or pad), length, output and alphabet; wire must be NULL.
+				// job.status is OTP_ST_* once answered, or -1 or OTP_JOB_CUT if the
+				// daemons couldn't be reached or dropped it, with 'err' saying why
+	int opcode;		// OTP_OP_ENCODE or OTP_OP_DECODE
+	void (*done)(struct otpRequest *req);	// Called once the status is in, or NULL
+	void *arg;		// The caller's
+	int err;		// errno, for a status below 0
+	struct otpRequest *next;	// The library's while the request is pending
+};
+
+struct otpAsync;
+
+struct otpAsync *otpAsyncNew(struct otpEndpoints *eps, int threads, uint32_t features);
+int otpAsyncSubmit(struct otpAsync *a, struct otpRequest *req);
+void otpAsyncWait(struct otpAsync *a);
+void otpAsyncFree(struct otpAsync *a);
+
+#endif
@@ -0,0 +1,280 @@
+/* Author: Brad Powell
+ * Date: 6/19/2019
+ * otp_batch: Batch mode of otp_enc/otp_dec
+ * Use: client -b manifest|directory [-k key -o outdir] [-c connections] [-a alphabet] port|socket[,...]
+ * A manifest lists one "input key output" triple per line (blank lines and lines starting with
+ * '#' are skipped); a key may also be a pad reference, @id:offset. Given a directory instead,
+ * every regular file in it is an input, all of them use the key named by -k, and each result goes
+ * to the file of the same name in -o. The files are shared out over a pool of connections, one
+ * thread each, that pull small groups of files at a time and pipeline them. A bad file only fails
+ * itself; totals and throughput go to stderr. With several daemons listed, each group is shared
+ * out between them by the route (otp_route.c), which keeps the connections open between groups.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "otp_proto.h"
+#include "otp_codec.h"
+#include "otp_client.h"
+#include "otp_keystore.h"
+
+#define GROUP_JOBS	16		// Files a connection takes per round trip ...
+#define GROUP_BYTES	(8 << 20)	// ... or fewer, once their text adds up to this much
+
+struct batchEntry {
+	char *input, *key, *output;
+};
+
+struct batch {
+	const struct otpClientMode *mode;
+	int alphabet;			// -a, for every file
+	struct otpEndpoints *eps;
+	struct batchEntry *entries;
+	int numEntries, next;		// 'next' is the first entry no connection has taken yet
+	int failed;
+	unsigned long long bytes;	// Text moved by successful jobs
+	pthread_mutex_t lock;
+};
+
+static void batchFail(struct batch *b, const char *path, const char *why) {
+	pthread_mutex_lock(&b->lock);
+	fprintf(stderr, "%s: %s\n", path, why);
+	b->failed++;
+	pthread_mutex_unlock(&b->lock);
+}
+
+static int addEntry(struct batchEntry **entries, int *num, int *cap, const char *input, const char *key,
+		const char *output) {
+	struct batchEntry *e;
+	if (*num == *cap) {
+		*cap = *cap ? *cap * 2 : 64;
+		e = realloc(*entries, *cap * sizeof(*e));
+		if (e == NULL) return -1;
+		*entries = e;
+	}
+	e = &(*entries)[(*num)++];
+	e->input = strdup(input);
+	e->key = strdup(key);
+	e->output = strdup(output);
+	return (e->input && e->key && e->output) ? 0 : -1;
+}
+
+static int readManifest(const char *path, struct batchEntry **entries, int *num) {
+	char *line = NULL, input[4096], key[4096], output[4096];
+	size_t size = 0;
+	int cap = 0, lineNo = 0, rc = 0;
+	FILE *fp = fopen(path, "r");
+
+	if (fp == NULL) return -1;
+	while (getline(&line, &size, fp) > 0) {
+		lineNo++;
+		if (sscanf(line, " %4095s", input) != 1 || input[0] == '#') continue;
+		if (sscanf(line, " %4095s %4095s %4095s", input, key, output) != 3) {
+			fprintf(stderr, "%s:%d: expected \"input key output\"\n", path, lineNo);
+			errno = EINVAL;
+			rc = -1;
+			break;
+		}
+		if ((rc = addEntry(entries, num, &cap, input, key, output)) < 0) break;
+	}
+	if (ferror(fp)) rc = -1;
+	free(line);
+	fclose(fp);
+	return rc;
+}
+
+static int readDirectory(const char *dir, const char *key, const char *outDir, struct batchEntry **entries,
+		int *num) {
+	char input[4096], output[4096];
+	struct dirent *d;
+	struct stat st;
+	int cap = 0;
+	DIR *dp = opendir(dir);
+
+	if (dp == NULL) return -1;
+	while ((d = readdir(dp)) != NULL) {
+		snprintf(input, sizeof(input), "%s/%s", dir, d->d_name);
+		if (stat(input, &st) < 0 || !S_ISREG(st.st_mode)) continue;
+		snprintf(output, sizeof(output), "%s/%s", outDir, d->d_name);
+		if (addEntry(entries, num, &cap, input, key, output) < 0) {
+			closedir(dp);
+			return -1;
+		}
+	}
+	closedir(dp);
+	return 0;
+}
+
+// Load one entry into 'job', keeping the files in 'text' and 'key'. Returns 0, or -1 after
+// recording why the entry failed.
+static int loadJob(struct batch *b, struct batchEntry *e, struct otpJob *job, struct otpInput *text,
+		struct otpInput *key) {
+	int status;
+
+	memset(key, 0, sizeof(*key));
+	status = otpLoadInput(e->input, b->alphabet, text);
+	if (status != OTP_ST_OK) {
+		batchFail(b, e->input, status < 0 ? strerror(errno) : otpStatusString(OTP_ST_BAD_CHAR));
+		otpFreeInput(text);
+		return -1;
+	}
+	job->text = text->data;
+	job->len = text->len;
+	job->out = text->data;	// Results overwrite the text once it has been sent
+	job->status = -1;
+	job->alphabet = b->alphabet;
+	job->wire = NULL;
+	job->routeKey = otpRouteKey(e->input);
+	if (otpParsePadRef(e->key, job) == 0) {
+		if (job->padOffset % OTP_KEY_BLOCK == 0) return 0;
+		batchFail(b, e->input, otpStatusString(OTP_ST_BAD_REQUEST));	// Pad ranges start on a block
+		otpFreeInput(text);
+		return -1;
+	}
+
+	status = otpLoadInput(e->key, b->alphabet, key);
+	if (status != OTP_ST_OK || key->len < text->len) {
+		batchFail(b, e->input, status < 0 ? strerror(errno) :
+				otpStatusString(status != OTP_ST_OK ? status : OTP_ST_SHORT_KEY));
+		otpFreeInput(text);
+		otpFreeInput(key);
+		return -1;
+	}
+	job->key = key->data;
+	return 0;
+}
+
+static int writeResult(const char *path, const struct otpJob *job) {
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) return -1;
+	if (otpWriteResult(fd, job->out, job->len, otpCodecFor(job->alphabet)->lines) < 0) {
+		close(fd);
+		return -1;
+	}
+	return close(fd);
+}
+
+// One connection of the pool: take a group of entries, send them as one pipeline, store the results
+static void *batchWorker(void *arg) {
+	struct batch *b = arg;
+	struct otpJob jobs[GROUP_JOBS];
+	struct otpInput texts[GROUP_JOBS], keys[GROUP_JOBS];
+	struct batchEntry *group[GROUP_JOBS];
+	int numJobs, i, more = 1;
+	size_t groupBytes;
+
+	while (more) {
+		// Claim entries one at a time so a group of big files doesn't hold back the others
+		numJobs = 0;
+		groupBytes = 0;
+		while (numJobs < GROUP_JOBS && groupBytes < GROUP_BYTES) {
+			pthread_mutex_lock(&b->lock);
+			i = b->next < b->numEntries ? b->next++ : -1;
+			pthread_mutex_unlock(&b->lock);
+			if (i < 0) {
+				more = 0;
+				break;
+			}
+			if (loadJob(b, &b->entries[i], &jobs[numJobs], &texts[numJobs], &keys[numJobs]) < 0) continue;
+			groupBytes += jobs[numJobs].len;
+			group[numJobs++] = &b->entries[i];
+		}
+		if (numJobs == 0) continue;
+
+		if (otpRoute(b->eps, b->mode->opcode, jobs, numJobs, 0) < 0) {
+			for (i = 0; i < numJobs; i++) {
+				if (jobs[i].status < 0) batchFail(b, group[i]->input, strerror(errno ? errno : EPIPE));
+			}
+		}
+		for (i = 0; i < numJobs; i++) {
+			if (jobs[i].status == OTP_ST_OK) {
+				if (writeResult(group[i]->output, &jobs[i]) < 0) {
+					batchFail(b, group[i]->output, strerror(errno));
+				} else {
+					pthread_mutex_lock(&b->lock);
+					b->bytes += jobs[i].len;
+					pthread_mutex_unlock(&b->lock);
+				}
+			} else if (jobs[i].status > 0) {
+				batchFail(b, group[i]->input, otpStatusString(jobs[i].status));
+			}
+			otpFreeInput(&texts[i]);
+			otpFreeInput(&keys[i]);
+		}
+	}
+	return NULL;
+}
+
+int otpBatch(const struct otpClientMode *mode, int alphabet, const char *source, const char *key, const char *outDir,
+		int connections, struct otpEndpoints *eps) {
+	struct batch b;
+	struct stat st;
+	struct timespec start, end;
+	pthread_t *threads;
+	double secs;
+	int i, rc;
+
+	memset(&b, 0, sizeof(b));
+	b.mode = mode;
+	b.alphabet = alphabet;
+	b.eps = eps;
+	pthread_mutex_init(&b.lock, NULL);
+
+	errno = 0;
+	if (stat(source, &st) == 0 && S_ISDIR(st.st_mode)) {
+		if (key == NULL || outDir == NULL) {
+			fprintf(stderr, "ERROR batch directory %s needs -k key and -o outdir\n", source);
+			return 1;
+		}
+		rc = readDirectory(source, key, outDir, &b.entries, &b.numEntries);
+	} else {
+		rc = readManifest(source, &b.entries, &b.numEntries);
+	}
+	if (rc < 0) {
+		perror("ERROR reading batch");
+		return 1;
+	}
+
+	if (connections > b.numEntries) connections = b.numEntries ? b.numEntries : 1;
+	threads = malloc(connections * sizeof(*threads));
+	if (threads == NULL) {
+		perror("ERROR out of memory");
+		return 1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < connections; i++) {
+		if (pthread_create(&threads[i], NULL, batchWorker, &b) != 0) {
+			perror("ERROR creating thread");
+			return 1;
+		}
+	}
+	otpPhase(OTP_CPHASE_PARALLEL);
+	for (i = 0; i < connections; i++) pthread_join(threads[i], NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	otpTimingsCount("batch", b.numEntries, b.bytes);
+	otpPhase(OTP_CPHASE_WRITE);
+
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	if (secs <= 0) secs = 1e-9;
+	fprintf(stderr, "batch: %d files, %d failed, %llu bytes in %.3f s over %d connections "
+			"(%.1f MB/s, %.0f files/s)\n", b.numEntries, b.failed, b.bytes, secs, connections,
+			b.bytes / secs / 1e6, (b.numEntries - b.failed) / secs);
+
+	for (i = 0; i < b.numEntries; i++) {
+		free(b.entries[i].input);
+		free(b.entries[i].key);
+		free(b.entries[i].output);
+	}
+	free(b.entries);
+	free(threads);
+	return b.failed != 0;
+}
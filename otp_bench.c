@@ -0,0 +1,284 @@
+/* Author: Brad Powell
+ * Date: 6/22/2019
+ * otp_bench: Load generator and latency benchmark for the daemons
+ * Use: otp_bench [-e engine] [-w workers] [-c connections] [-n requests] [-s size,size,...]
+ *                [-m encode_percent] [-r] [-p port]
+ * Starts otp_enc_d on 'port' and otp_dec_d on 'port'+1 (from the directory otp_bench lives in)
+ * with the given engine and worker count. Then 'connections' threads, one connection each, send
+ * 'requests' requests between them. Each thread waits for one answer before sending the next
+ * request, so latency is the full round trip. Sizes are picked round robin from the -s list
+ * (suffixes k and m allowed), and -m sets the share of encodes; the rest are decodes. With -r
+ * every request opens a fresh connection, which exercises the accept path instead of the
+ * receive path. The results are printed to stdout as one JSON object: throughput, error count,
+ * and p50/p99/p999 latency in microseconds, overall and per size.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/random.h>
+#include "otp_proto.h"
+#include "otp_codec.h"
+#include "otp_client.h"
+
+#define MAX_SIZES	16
+
+struct sample {
+	int size;		// Index into sizes[]
+	double usec;
+};
+
+struct benchThread {
+	pthread_t tid;
+	int first, count;	// Requests first .. first+count-1 of the run
+	struct sample *samples;
+	int numSamples, errors;
+};
+
+static const char *engine = "prefork";
+static const char *workers = NULL;
+static int connections = 8, numRequests = 10000, encodePercent = 50, reconnect = 0, port;
+static size_t sizes[MAX_SIZES] = { 20, 1024, 65536, 1 << 20 };
+static int numSizes = 4;
+static char *text, *key;	// Random symbols, as long as the largest size
+static size_t maxSize;
+
+static void error(const char *msg) { perror(msg); exit(1); }	// Error function for reporting issues
+
+static void usage(const char *prog) {
+	fprintf(stderr, "USAGE: %s [-e engine] [-w workers] [-c connections] [-n requests] "
+			"[-s size,size,...] [-m encode_percent] [-r] [-p port]\n", prog);
+	exit(1);
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// "20,1k,4m" -> sizes[]
+static void parseSizes(char *list, const char *prog) {
+	char *tok, *end;
+	numSizes = 0;
+	for (tok = strtok(list, ","); tok != NULL; tok = strtok(NULL, ",")) {
+		if (numSizes == MAX_SIZES) usage(prog);
+		sizes[numSizes] = strtoul(tok, &end, 10);
+		if (*end == 'k' || *end == 'K') sizes[numSizes] <<= 10, end++;
+		else if (*end == 'm' || *end == 'M') sizes[numSizes] <<= 20, end++;
+		if (*end != '\0' || sizes[numSizes] == 0) usage(prog);
+		numSizes++;
+	}
+	if (numSizes == 0) usage(prog);
+}
+
+// Fill 'buf' with random letters
+static void randomSymbols(char *buf, size_t len) {
+	const struct otpCodec *letters = otpCodecFor(OTP_ALPHA_LETTERS);
+	size_t i;
+	if (getrandom(buf, len, 0) < (ssize_t)len) error("ERROR reading random bytes");
+	for (i = 0; i < len; i++) buf[i] = letters->symbols[(unsigned char)buf[i] % letters->size];
+}
+
+/************** Daemons ************************/
+
+static pid_t startDaemon(const char *dir, const char *name, int daemonPort) {
+	char path[4096], portArg[16];
+	const char *args[8];
+	int n = 0, fd, tries;
+	pid_t pid;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	snprintf(portArg, sizeof(portArg), "%d", daemonPort);
+	args[n++] = path;
+	args[n++] = "-e";
+	args[n++] = engine;
+	if (workers != NULL) {
+		args[n++] = "-w";
+		args[n++] = workers;
+	}
+	args[n++] = portArg;
+	args[n] = NULL;
+
+	pid = fork();
+	if (pid < 0) error("ERROR fork failed");
+	if (pid == 0) {
+		execv(path, (char **)args);
+		perror(path);
+		_exit(1);
+	}
+
+	// Wait for it to listen
+	for (tries = 0; tries < 200; tries++) {
+		if ((fd = otpConnect(daemonPort)) >= 0) {
+			close(fd);
+			return pid;
+		}
+		usleep(10000);
+	}
+	fprintf(stderr, "ERROR %s did not start on port %d\n", name, daemonPort);
+	kill(pid, SIGTERM);
+	exit(1);
+}
+
+/************** Load ************************/
+
+static void *benchWorker(void *arg) {
+	struct benchThread *t = arg;
+	struct otpJob job;
+	char *out = malloc(maxSize);
+	int encFD = -1, decFD = -1, *fd, i, encode;
+	double start;
+
+	if (out == NULL) error("ERROR out of memory");
+	t->samples = malloc(t->count * sizeof(*t->samples));
+	if (t->samples == NULL) error("ERROR out of memory");
+
+	for (i = t->first; i < t->first + t->count; i++) {
+		memset(&job, 0, sizeof(job));
+		job.text = text;
+		job.key = key;
+		job.len = sizes[i % numSizes];
+		job.out = out;
+		encode = (i * 37 % 100) < encodePercent;	// Spread encodes evenly over the run
+		fd = encode ? &encFD : &decFD;
+
+		start = now();
+		if (*fd < 0) *fd = otpConnect(encode ? port : port + 1);
+		if (*fd < 0 || otpPipeline(*fd, encode ? OTP_OP_ENCODE : OTP_OP_DECODE, &job, 1) < 0 ||
+				job.status != OTP_ST_OK) {
+			t->errors++;
+			if (*fd >= 0) close(*fd);
+			*fd = -1;
+			continue;
+		}
+		if (reconnect) {
+			close(*fd);
+			*fd = -1;
+		}
+		t->samples[t->numSamples].size = i % numSizes;
+		t->samples[t->numSamples].usec = now() - start;
+		t->numSamples++;
+	}
+	if (encFD >= 0) close(encFD);
+	if (decFD >= 0) close(decFD);
+	free(out);
+	return NULL;
+}
+
+static int byLatency(const void *a, const void *b) {
+	double x = ((const struct sample *)a)->usec, y = ((const struct sample *)b)->usec;
+	return (x > y) - (x < y);
+}
+
+// Latency at quantile 'q' of sorted samples
+static double quantile(const struct sample *s, int n, double q) {
+	int i = (int)(q * n);
+	if (n == 0) return 0;
+	return s[i < n ? i : n - 1].usec;
+}
+
+static void printLatency(const struct sample *s, int n) {
+	printf("{\"count\": %d, \"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f}",
+			n, quantile(s, n, 0.5), quantile(s, n, 0.99), quantile(s, n, 0.999), n ? s[n-1].usec : 0.0);
+}
+
+int main(int argc, char *argv[]) {
+	struct benchThread *threads;
+	struct sample *all, *bySize;
+	char dir[4096], *slash;
+	unsigned long long bytes = 0;
+	pid_t encPid, decPid;
+	double start, secs;
+	int opt, i, j, n, errors = 0, total = 0;
+
+	port = 10000 + getpid() % 20000 * 2;	// Below the ephemeral range, so clients never hold it
+	while ((opt = getopt(argc, argv, "e:w:c:n:s:m:rp:")) != -1) {
+		switch (opt) {
+			case 'e': engine = optarg; break;
+			case 'w': workers = optarg; break;
+			case 'c': if ((connections = atoi(optarg)) < 1) usage(argv[0]); break;
+			case 'n': if ((numRequests = atoi(optarg)) < 1) usage(argv[0]); break;
+			case 's': parseSizes(optarg, argv[0]); break;
+			case 'm':
+				encodePercent = atoi(optarg);
+				if (encodePercent < 0 || encodePercent > 100) usage(argv[0]);
+				break;
+			case 'r': reconnect = 1; break;
+			case 'p': if ((port = atoi(optarg)) < 1) usage(argv[0]); break;
+			default: usage(argv[0]);
+		}
+	}
+	if (optind != argc) usage(argv[0]);
+	if (connections > numRequests) connections = numRequests;
+
+	// Random text and key, shared read-only by every thread
+	for (i = 0; i < numSizes; i++) if (sizes[i] > maxSize) maxSize = sizes[i];
+	text = malloc(maxSize);
+	key = malloc(maxSize);
+	if (text == NULL || key == NULL) error("ERROR out of memory");
+	randomSymbols(text, maxSize);
+	randomSymbols(key, maxSize);
+
+	// The daemons live next to this program
+	snprintf(dir, sizeof(dir), "%s", argv[0]);
+	slash = strrchr(dir, '/');
+	if (slash != NULL) *slash = '\0';
+	else strcpy(dir, ".");
+	encPid = startDaemon(dir, "otp_enc_d", port);
+	decPid = startDaemon(dir, "otp_dec_d", port + 1);
+
+	threads = calloc(connections, sizeof(*threads));
+	if (threads == NULL) error("ERROR out of memory");
+	start = now();
+	for (i = 0, n = 0; i < connections; i++) {
+		threads[i].first = n;
+		threads[i].count = numRequests / connections + (i < numRequests % connections);
+		n += threads[i].count;
+		if (pthread_create(&threads[i].tid, NULL, benchWorker, &threads[i]) != 0)
+			error("ERROR creating thread");
+	}
+	for (i = 0; i < connections; i++) pthread_join(threads[i].tid, NULL);
+	secs = (now() - start) / 1e6;
+	kill(encPid, SIGTERM);
+	kill(decPid, SIGTERM);
+	waitpid(encPid, NULL, 0);
+	waitpid(decPid, NULL, 0);
+
+	// Gather every sample, then sort for the quantiles
+	all = malloc((numRequests + 1) * sizeof(*all));
+	bySize = malloc((numRequests + 1) * sizeof(*bySize));
+	if (all == NULL || bySize == NULL) error("ERROR out of memory");
+	for (i = 0; i < connections; i++) {
+		for (j = 0; j < threads[i].numSamples; j++) {
+			all[total++] = threads[i].samples[j];
+			bytes += sizes[threads[i].samples[j].size];
+		}
+		errors += threads[i].errors;
+	}
+	qsort(all, total, sizeof(*all), byLatency);
+
+	printf("{\"engine\": \"%s\", \"connections\": %d, \"reconnect\": %s, \"encode_percent\": %d, "
+			"\"requests\": %d, \"errors\": %d, \"seconds\": %.3f, \"requests_per_sec\": %.1f, "
+			"\"mb_per_sec\": %.2f, \"latency_us\": ", engine, connections, reconnect ? "true" : "false",
+			encodePercent, numRequests, errors, secs, total / secs, bytes / secs / 1e6);
+	printLatency(all, total);
+	printf(", \"by_size\": [");
+	for (i = 0; i < numSizes; i++) {
+		for (j = 0, n = 0; j < total; j++) {
+			if (all[j].size == i) bySize[n++] = all[j];	// Still sorted
+		}
+		printf("%s{\"size\": %zu, \"latency_us\": ", i ? ", " : "", sizes[i]);
+		printLatency(bySize, n);
+		printf("}");
+	}
+	printf("]}\n");
+	return errors != 0;
+}
@@ -0,0 +1,839 @@
+/* Author: Brad Powell
+ * Date: 6/12/2019
+ * otp_client: Client side shared by otp_enc and otp_dec
+ * See otp_client.h for the command line.
+ */
+
+#define _GNU_SOURCE	// memfd_create
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <getopt.h>
+#include "otp_proto.h"
+#include "otp_codec.h"
+#include "otp_client.h"
+#include "otp_async.h"
+#include "otp_keystore.h"
+
+static void error(const char *msg) { perror(msg); exit(1); } // Error function for reporting issues.
+
+static int timeoutMs = OTP_DEFAULT_TIMEOUT;
+
+/************** Phase timings ************************/
+
+static const char *phaseNames[OTP_CPHASES] = {
+	"load", "validate", "resolve", "connect", "handshake", "send", "wait", "receive", "write", "parallel"
+};
+static int timingsOn;
+static const char *timingsProg, *timingsMode = "none";
+static int timingsRequests;
+static uint64_t timingsBytes, timingsStart;
+// Per thread, so batch connections and route threads can't muddle the main thread's phases. The
+// report is the main thread's, with its waits on the others as OTP_CPHASE_PARALLEL.
+static __thread int phaseNow = -1;
+static __thread uint64_t phaseSince, phaseUsec[OTP_CPHASES];
+
+// Charge the time since the last switch to the phase that was running, and start 'phase' (-1 for
+// none). Does nothing unless timings are on.
+void otpPhase(int phase) {
+	uint64_t now;
+	if (!timingsOn) return;
+	now = otpNowUsec();
+	if (phaseNow >= 0) phaseUsec[phaseNow] += now - phaseSince;
+	phaseNow = phase;
+	phaseSince = now;
+}
+
+static void timingsReport(void) {
+	int i;
+	otpPhase(-1);
+	fprintf(stderr, "{\"prog\": \"%s\", \"mode\": \"%s\", \"requests\": %d, \"bytes\": %llu, \"total_us\": %llu",
+			timingsProg, timingsMode, timingsRequests, (unsigned long long)timingsBytes,
+			(unsigned long long)(otpNowUsec() - timingsStart));
+	for (i = 0; i < OTP_CPHASES; i++) fprintf(stderr, ", \"%s_us\": %llu", phaseNames[i], (unsigned long long)phaseUsec[i]);
+	fprintf(stderr, "}\n");
+}
+
+// Turn timings on for this run, reported at exit under 'prog'. Call from the main thread before
+// any others start. Until the first phase switch, time counts as loading.
+void otpTimingsEnable(const char *prog) {
+	timingsOn = 1;
+	timingsProg = prog;
+	timingsStart = otpNowUsec();
+	otpPhase(OTP_CPHASE_LOAD);
+	atexit(timingsReport);
+}
+
+// Name the mode, unless 'mode' is NULL, and add to the requests and bytes reported
+void otpTimingsCount(const char *mode, int requests, uint64_t bytes) {
+	if (mode != NULL) timingsMode = mode;
+	timingsRequests += requests;
+	timingsBytes += bytes;
+}
+
+/************** Connections ************************/
+
+// How long to wait for the daemon when it owes an answer, in ms; 0 waits forever. Applies to
+// connections made afterwards.
+void otpSetTimeout(int ms) {
+	timeoutMs = ms;
+}
+
+// The timeout as a poll argument: -1 for none
+int otpTimeout(void) {
+	return timeoutMs > 0 ? timeoutMs : -1;
+}
+
+// Blocking calls on 'fd' give up after the timeout (with EAGAIN)
+static int applyTimeout(int fd) {
+	struct timeval tv;
+	if (timeoutMs <= 0) return fd;
+	tv.tv_sec = timeoutMs / 1000;
+	tv.tv_usec = timeoutMs % 1000 * 1000;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	return fd;
+}
+
+// Connect to the daemon listening on 'portNumber' on this machine. Returns the socket or -1.
+int otpConnect(int portNumber) {
+	int socketFD, yes = 1;
+	struct sockaddr_in serverAddress;
+	struct hostent* serverHostInfo;
+
+	// Set up the server address struct
+	memset((char*)&serverAddress, '\0', sizeof(serverAddress));	// Clear address struct
+	serverAddress.sin_family = AF_INET;		// Create network-capable socket
+	serverAddress.sin_port = htons(portNumber);	// Store the port number
+	otpPhase(OTP_CPHASE_RESOLVE);
+	serverHostInfo = gethostbyname("localhost");	// Convert machine name to special form of address
+	if (serverHostInfo == NULL) return -1;
+	// Copy the host address
+	memcpy((char*)&serverAddress.sin_addr.s_addr, (char*)serverHostInfo->h_addr, serverHostInfo->h_length);
+
+	// Set up the socket and connect to server
+	otpPhase(OTP_CPHASE_CONNECT);
+	socketFD = socket(AF_INET, SOCK_STREAM, 0);
+	if (socketFD < 0) return -1;
+	if (connect(socketFD, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0) {
+		close(socketFD);
+		return -1;
+	}
+	// A pipeline writes each request as it goes; on a kept connection, past the quick ACKs of a new
+	// one, Nagle would hold each small one back until the daemon's delayed ACK of the last
+	setsockopt(socketFD, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+	return applyTimeout(socketFD);
+}
+
+// Connect to 'server': the path of a daemon's unix socket if it contains a '/', otherwise a port
+// on this machine. Returns the socket or -1.
+int otpConnectTo(const char *server) {
+	struct sockaddr_un unixAddress;
+	int socketFD;
+
+	if (strchr(server, '/') == NULL) return otpConnect(atoi(server));
+	memset(&unixAddress, 0, sizeof(unixAddress));
+	unixAddress.sun_family = AF_UNIX;
+	if (strlen(server) >= sizeof(unixAddress.sun_path)) return -1;
+	strcpy(unixAddress.sun_path, server);
+	otpPhase(OTP_CPHASE_CONNECT);
+	socketFD = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (socketFD < 0) return -1;
+	if (connect(socketFD, (struct sockaddr*)&unixAddress, sizeof(unixAddress)) < 0) {
+		close(socketFD);
+		return -1;
+	}
+	return applyTimeout(socketFD);
+}
+
+// Open a connection by asking for the OTP_FEAT_* in 'want'. Returns the ones the daemon granted,
+// 0 if it doesn't know the request, or -1 on socket errors.
+int otpHello(int fd, uint32_t want) {
+	struct otpHeader hdr;
+
+	otpPhase(OTP_CPHASE_HANDSHAKE);
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.opcode = OTP_OP_HELLO;
+	hdr.aux = want;
+	if (otpSendHeader(fd, &hdr) < 0 || otpRecvHeader(fd, &hdr) < 0) return -1;
+	if (hdr.opcode == OTP_OP_REJECT) return 0;
+	if (hdr.opcode != OTP_OP_RESULT || hdr.payloadLen > 0) return -1;
+	return hdr.aux & want;
+}
+
+// Pack a validated letters job for the wire (OTP_FEAT_PACKED): its text, then its key unless that
+// is a pad reference. Returns 0, or -1 if out of memory. The buffer is released with the job's
+// other inputs, by exiting or with free(job->wire).
+int otpPackJob(struct otpJob *job) {
+	size_t size = otpPackedSize(job->len);
+
+	if ((job->wire = malloc(job->key ? 2 * size + 1 : size + 1)) == NULL) return -1;
+	otpPack(job->wire, job->text, job->len);
+	if (job->key) otpPack(job->wire + size, job->key, job->len);
+	return 0;
+}
+
+// Send every job as one request and collect the answers, without waiting for one answer before
+// sending the next request. Sending and receiving are interleaved with poll, so neither side can
+// end up blocked on a full socket buffer while the other waits for it. Job i goes out with tag
+// i+1. A packed job's answer arrives packed in its wire buffer and is unpacked into its output.
+// A refusal can come back while its request is still going out; the rest is sent anyway, since
+// the daemon reads it to stay in step.
+// Returns 0 once every job has a status, -1 if the connection fails first or the daemon goes
+// quiet for longer than the timeout (errno ETIMEDOUT). A job whose answer was coming in by then is
+// left OTP_JOB_CUT, since its output (and its text, if they share a buffer) is part written.
+int otpPipeline(int fd, int opcode, struct otpJob *jobs, int numJobs) {
+	unsigned char hdrOut[OTP_HDR_SIZE], hdrIn[OTP_HDR_SIZE];
+	struct otpHeader hdr;
+	struct iovec iov[3];
+	struct msghdr msg;
+	struct pollfd pfd;
+	int sendJob = 0, recvJob = -1, answered = 0, started = 0, i, ret = -1;
+	int flags = fcntl(fd, F_GETFL);
+	size_t sendPos = 0, hdrUsed = 0, dataUsed = 0, dataLen = 0, skip, textLen, keyLen;
+	char *data = NULL;
+	ssize_t n;
+
+	for (i = 0; i < numJobs; i++) jobs[i].status = -1;
+	fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+
+	while (answered < numJobs || sendJob < numJobs) {
+		otpPhase(sendJob < numJobs ? OTP_CPHASE_SEND : started ? OTP_CPHASE_RECEIVE : OTP_CPHASE_WAIT);
+		pfd.fd = fd;
+		pfd.events = POLLIN | (sendJob < numJobs ? POLLOUT : 0);
+		if ((n = poll(&pfd, 1, otpTimeout())) <= 0) {
+			if (n < 0 && errno == EINTR) continue;
+			if (n == 0) errno = ETIMEDOUT;
+			goto done;
+		}
+
+		// Push out as much of the current request as the socket takes
+		if ((pfd.revents & POLLOUT) && sendJob < numJobs) {
+			textLen = jobs[sendJob].wire ? otpPackedSize(jobs[sendJob].len) : jobs[sendJob].len;
+			keyLen = jobs[sendJob].key ? textLen : 0;
+			if (sendPos == 0) {
+				memset(&hdr, 0, sizeof(hdr));
+				hdr.opcode = opcode;
+				hdr.alphabet = jobs[sendJob].alphabet;
+				hdr.tag = sendJob + 1;
+				hdr.payloadLen = jobs[sendJob].len;
+				hdr.keyLen = jobs[sendJob].len;
+				if (jobs[sendJob].key == NULL) {
+					hdr.flags = OTP_F_KEYREF;
+					hdr.aux = jobs[sendJob].padId;
+					hdr.keyLen = jobs[sendJob].padOffset;
+				}
+				if (jobs[sendJob].wire) hdr.flags |= OTP_F_PACKED;
+				otpPackHeader(&hdr, hdrOut);
+			}
+			iov[0].iov_base = hdrOut;
+			iov[0].iov_len = OTP_HDR_SIZE;
+			iov[1].iov_base = jobs[sendJob].wire ? (void *)jobs[sendJob].wire : (void *)jobs[sendJob].text;
+			iov[1].iov_len = textLen;
+			iov[2].iov_base = jobs[sendJob].wire ? (char *)iov[1].iov_base + textLen : (void *)jobs[sendJob].key;
+			iov[2].iov_len = keyLen;
+			for (i = 0, skip = sendPos; skip >= iov[i].iov_len; i++) skip -= iov[i].iov_len;
+			iov[i].iov_base = (char *)iov[i].iov_base + skip;
+			iov[i].iov_len -= skip;
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_iov = &iov[i];
+			msg.msg_iovlen = 3 - i;
+			n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+			if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) goto done;
+			if (n > 0) sendPos += n;
+			if (sendPos == OTP_HDR_SIZE + textLen + keyLen) {
+				sendJob++;
+				sendPos = 0;
+			}
+		}
+		if (!(pfd.revents & (POLLIN | POLLHUP | POLLERR))) continue;
+
+		// Read the next answer: its header, then its text straight into the job's output (or wire)
+		if (recvJob < 0) {
+			n = recv(fd, hdrIn + hdrUsed, OTP_HDR_SIZE - hdrUsed, 0);
+			if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) continue;
+			if (n == 0) errno = ECONNRESET;
+			if (n <= 0) goto done;
+			started = 1;
+			if ((hdrUsed += n) < OTP_HDR_SIZE) continue;
+			hdrUsed = 0;
+
+			// Tags must name a job whose header was sent and is still unanswered
+			if (otpUnpackHeader(hdrIn, &hdr) < 0 || hdr.tag < 1 ||
+					hdr.tag > (uint32_t)sendJob + (sendPos >= OTP_HDR_SIZE) ||
+					jobs[hdr.tag-1].status != -1) {
+				errno = EPROTO;
+				goto done;
+			}
+			i = hdr.tag - 1;
+			if (hdr.opcode == OTP_OP_REJECT) {
+				jobs[i].status = hdr.status ? hdr.status : OTP_ST_BAD_REQUEST;
+				jobs[i].retryAfter = hdr.aux;
+				answered++;
+				continue;
+			}
+			if (hdr.opcode != OTP_OP_RESULT || hdr.payloadLen != jobs[i].len ||
+					!(hdr.flags & OTP_F_PACKED) != !jobs[i].wire || i == sendJob) {
+				errno = EPROTO;
+				goto done;
+			}
+			recvJob = i;
+			data = jobs[i].wire ? (char *)jobs[i].wire : jobs[i].out;
+			dataLen = jobs[i].wire ? otpPackedSize(jobs[i].len) : jobs[i].len;
+			dataUsed = 0;
+		} else {
+			n = recv(fd, data + dataUsed, dataLen - dataUsed, 0);
+			if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) continue;
+			if (n == 0) errno = ECONNRESET;
+			if (n <= 0) goto done;
+			dataUsed += n;
+		}
+		if (recvJob >= 0 && dataUsed == dataLen) {
+			if (jobs[recvJob].wire)
+				otpUnpack(jobs[recvJob].out, jobs[recvJob].wire, jobs[recvJob].len);
+			jobs[recvJob].status = OTP_ST_OK;
+			answered++;
+			recvJob = -1;
+		}
+	}
+	ret = 0;
+done:
+	if (ret < 0 && recvJob >= 0) jobs[recvJob].status = OTP_JOB_CUT;
+	fcntl(fd, F_SETFL, flags);
+	return ret;
+}
+
+// Send the jobs the daemon refused as busy again on the same connection, after the longest wait
+// it suggested, doubled every round (but never past OTP_BUSY_MAX_WAIT), for up to 'rounds' rounds.
+// Jobs still busy after that keep the status. Returns 0, or -1 as otpPipeline.
+int otpRetryBusy(int fd, int opcode, struct otpJob *jobs, int numJobs, int rounds) {
+	struct otpJob *again = malloc(numJobs * sizeof(*again));
+	int *from = malloc(numJobs * sizeof(*from));
+	int round, n, i, ret = 0;
+	uint64_t wait;
+
+	if (again == NULL || from == NULL) ret = -1;
+	for (round = 0; round < rounds && ret == 0; round++) {
+		for (i = n = 0, wait = 0; i < numJobs; i++) {
+			if (jobs[i].status != OTP_ST_BUSY) continue;
+			if (jobs[i].retryAfter > wait) wait = jobs[i].retryAfter;
+			from[n] = i;
+			again[n++] = jobs[i];
+		}
+		if (n == 0) break;
+		otpPhase(OTP_CPHASE_WAIT);
+		wait <<= round < 16 ? round : 16;	// 'wait' is 32 bits from the daemon: this can't overflow
+		usleep((wait < OTP_BUSY_MAX_WAIT ? wait : OTP_BUSY_MAX_WAIT) * 1000);
+		ret = otpPipeline(fd, opcode, again, n);
+		for (i = 0; i < n; i++) jobs[from[i]] = again[i];
+	}
+	free(again);
+	free(from);
+	return ret;
+}
+
+// Hand one job to the daemon over a unix socket in a sealed memfd: text, then key. The daemon
+// transforms the text in place, so only the header and the descriptor cross the socket, and the
+// result is written to 'outFD' (with its newline, if the alphabet has lines) straight from the
+// shared pages.
+// Returns OTP_ST_OK, the daemon's OTP_ST_* refusal, or -1 on errors.
+int otpMemfdTransfer(int fd, int opcode, const struct otpJob *job, int outFD) {
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	unsigned char hdrOut[OTP_HDR_SIZE];
+	struct otpHeader hdr;
+	struct iovec iov;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	size_t keyLen = job->key ? job->len : 0;
+	size_t size = job->len + keyLen;
+	char *map = NULL;
+	int ret = -1;
+	int mfd = memfd_create("otp", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+
+	otpPhase(OTP_CPHASE_SEND);
+	if (mfd < 0) return -1;
+	if (ftruncate(mfd, size) < 0) goto done;
+	if (size > 0) {
+		map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, mfd, 0);
+		if (map == MAP_FAILED) {
+			map = NULL;
+			goto done;
+		}
+		memcpy(map, job->text, job->len);
+		memcpy(map + job->len, job->key, keyLen);
+	}
+	if (fcntl(mfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0) goto done;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.opcode = opcode;
+	hdr.flags = OTP_F_MEMFD;
+	hdr.alphabet = job->alphabet;
+	hdr.tag = 1;
+	hdr.payloadLen = job->len;
+	hdr.keyLen = keyLen;
+	if (job->key == NULL) {
+		hdr.flags |= OTP_F_KEYREF;
+		hdr.aux = job->padId;
+		hdr.keyLen = job->padOffset;
+	}
+	otpPackHeader(&hdr, hdrOut);
+
+	// The header and the descriptor go in one message, so the daemon has both when the header completes
+	iov.iov_base = hdrOut;
+	iov.iov_len = OTP_HDR_SIZE;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &mfd, sizeof(int));
+	if (sendmsg(fd, &msg, MSG_NOSIGNAL) != OTP_HDR_SIZE) goto done;
+
+	otpPhase(OTP_CPHASE_WAIT);
+	if (otpRecvHeader(fd, &hdr) < 0) goto done;
+	if (hdr.opcode == OTP_OP_REJECT) {
+		ret = hdr.status;
+		goto done;
+	}
+	if (hdr.opcode != OTP_OP_RESULT || !(hdr.flags & OTP_F_MEMFD)) goto done;
+	otpPhase(OTP_CPHASE_WRITE);
+	ret = otpWriteResult(outFD, map, job->len, otpCodecFor(job->alphabet)->lines) < 0 ? -1 : OTP_ST_OK;
+done:
+	if (map != NULL) munmap(map, size);
+	close(mfd);
+	return ret;
+}
+
+// Ask the daemon for its metrics (see otp_stats.h) and copy the text to 'out'.
+// Returns OTP_ST_OK, the daemon's OTP_ST_* refusal, or -1 on socket errors.
+int otpFetchStats(int fd, FILE *out) {
+	struct otpHeader hdr;
+	char *text;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.opcode = OTP_OP_STATS;
+	otpPhase(OTP_CPHASE_SEND);
+	if (otpSendHeader(fd, &hdr) < 0) return -1;
+	otpPhase(OTP_CPHASE_WAIT);
+	if (otpRecvHeader(fd, &hdr) < 0) return -1;
+	if (hdr.opcode == OTP_OP_REJECT) return hdr.status;
+	if (hdr.opcode != OTP_OP_RESULT || (text = malloc(hdr.payloadLen + 1)) == NULL) return -1;
+	otpPhase(OTP_CPHASE_RECEIVE);
+	if (hdr.payloadLen > 0 && recvAll(fd, text, hdr.payloadLen) <= 0) {
+		free(text);
+		return -1;
+	}
+	otpPhase(OTP_CPHASE_WRITE);
+	fwrite(text, 1, hdr.payloadLen, out);
+	free(text);
+	return OTP_ST_OK;
+}
+
+// Old sentinel protocol for one job on a fresh connection: token -> "confirm", text@@ ->
+// "confirm", key@@ -> result@@. Returns an OTP_ST_* status, or -1 on socket errors.
+static int legacyTransfer(int fd, const struct otpClientMode *mode, struct otpJob *job) {
+	char buffer[256];
+	char *result;
+	size_t resultLen;
+	struct pollfd pfd;
+
+	// Verify connection
+	otpPhase(OTP_CPHASE_HANDSHAKE);
+	send(fd, mode->legacyToken, strlen(mode->legacyToken), 0);
+	memset(buffer, '\0', sizeof(buffer));
+	if (recv(fd, buffer, sizeof(buffer)-1, 0) < 0) return -1;
+	if (strcmp(buffer, "confirm") != 0) return OTP_ST_WRONG_SERVER;
+
+	// Text and key, each with @@ as a terminator, with a confirm in between to stay in sync
+	otpPhase(OTP_CPHASE_SEND);
+	if (sendAll(fd, job->text, job->len) < 0 || sendAll(fd, "@@", 2) < 0) return -1;
+	otpPhase(OTP_CPHASE_HANDSHAKE);
+	if (recv(fd, buffer, sizeof(buffer)-1, 0) < 0) return -1;
+	otpPhase(OTP_CPHASE_SEND);
+	if (sendAll(fd, job->key, job->len) < 0 || sendAll(fd, "@@", 2) < 0) return -1;
+
+	// The answer's first bytes end the wait; the receive timeout still applies to each recv
+	otpPhase(OTP_CPHASE_WAIT);
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	while (poll(&pfd, 1, otpTimeout()) < 0 && errno == EINTR) continue;
+	otpPhase(OTP_CPHASE_RECEIVE);
+	result = otpRecvSentinel(fd, &resultLen);
+	if (result == NULL || resultLen != job->len) {
+		free(result);
+		return -1;
+	}
+	memcpy(job->out, result, resultLen);
+	free(result);
+	return OTP_ST_OK;
+}
+
+/************** Command line client ************************/
+
+static void usage(const char *prog, const struct otpClientMode *mode) {
+	fprintf(stderr, "USAGE: %s [-l | -s | -m | -p] [-a alphabet] [-t ms] [-R route] [-T] %s key [%s key ...] "
+			"port|socket[,...]\n"
+			"       %s -b manifest|directory [-k key -o outdir] [-c connections] [-a alphabet] [-t ms] "
+			"[-R route] [-T] port|socket[,...]\n"
+			"       %s -S [-t ms] [-T] port|socket[,...]\n",
+			prog, mode->textName, mode->textName, prog, prog);
+	exit(1);
+}
+
+// Say why a request failed. Returns 1 so callers can collect an exit status.
+static int report(const struct otpClientMode *mode, int status) {
+	if (status < 0 && errno == EAGAIN) errno = ETIMEDOUT;	// A blocking call ran into the timeout
+	if (status < 0) perror("ERROR talking to daemon");
+	else if (status == OTP_ST_WRONG_SERVER) fprintf(stderr, "ERROR connected to wrong server\n");
+	else if (status == OTP_ST_SHORT_KEY) fprintf(stderr, "ERROR: %s longer than key\n", mode->textName);
+	else fprintf(stderr, "ERROR: %s\n", otpStatusString(status));
+	return 1;
+}
+
+// Read everything left in 'fp' into a malloc'd buffer. Returns its length, or -1.
+static ssize_t readRest(FILE *fp, char **buf) {
+	size_t len = 0, cap = 0, n;
+	char *grown;
+
+	do {
+		if (len == cap) {
+			cap = cap ? cap * 2 : 65536;
+			if ((grown = realloc(*buf, cap)) == NULL) return -1;
+			*buf = grown;
+		}
+		n = fread(*buf + len, 1, cap - len, fp);
+		len += n;
+	} while (n > 0);
+	return ferror(fp) ? -1 : (ssize_t)len;
+}
+
+// Map the first line of 'path' (without its newline; the whole file for an alphabet without
+// lines) into 'in' and check it only holds symbols of the alphabet. The mapping is private and
+// writable so results can overwrite the text in place; only pages actually written get copied.
+// Files that can't be mapped (pipes, terminals) are read into the heap instead. Returns OTP_ST_OK,
+// OTP_ST_BAD_CHAR, or -1 if the file can't be read (errno says why). Release 'in' with
+// otpFreeInput whatever the result.
+int otpLoadInput(const char *path, int alphabet, struct otpInput *in) {
+	const struct otpCodec *codec = otpCodecFor(alphabet);
+	struct stat st;
+	size_t size = 0;
+	ssize_t n;
+	char *newline = NULL;
+	FILE *fp;
+	int fd = open(path, O_RDONLY);
+
+	memset(in, 0, sizeof(*in));
+	otpPhase(OTP_CPHASE_LOAD);
+	if (fd < 0) return -1;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+		if (st.st_size > 0) {
+			in->data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+			if (in->data == MAP_FAILED) {
+				in->data = NULL;
+				close(fd);
+				return -1;
+			}
+			in->mapLen = st.st_size;
+			madvise(in->data, in->mapLen, MADV_SEQUENTIAL);
+			if (codec->lines) newline = memchr(in->data, '\n', in->mapLen);
+			in->len = newline ? (size_t)(newline - in->data) : in->mapLen;
+		}
+		close(fd);
+	} else {
+		fp = fdopen(fd, "r");
+		if (fp == NULL) {
+			close(fd);
+			return -1;
+		}
+		n = codec->lines ? getline(&in->data, &size, fp) : readRest(fp, &in->data);
+		fclose(fp);
+		if (n > 0 && codec->lines && in->data[n-1] == '\n') n--;
+		if (n > 0) in->len = n;
+	}
+	otpPhase(OTP_CPHASE_VALIDATE);
+	return codec->validate(in->data, in->len) ? OTP_ST_OK : OTP_ST_BAD_CHAR;
+}
+
+void otpFreeInput(struct otpInput *in) {
+	if (in->mapLen > 0) munmap(in->data, in->mapLen);
+	else free(in->data);
+	memset(in, 0, sizeof(*in));
+}
+
+// Write a result and, if 'newline', its newline to 'fd' in one writev, straight from wherever the
+// result lives
+int otpWriteResult(int fd, const char *buf, size_t len, int newline) {
+	struct iovec iov[2];
+	int i = 0;
+	ssize_t n;
+
+	iov[0].iov_base = (void *)buf;
+	iov[0].iov_len = len;
+	iov[1].iov_base = "\n";
+	iov[1].iov_len = newline ? 1 : 0;
+	while (i < 2) {
+		n = writev(fd, &iov[i], 2 - i);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		for (; i < 2 && (size_t)n >= iov[i].iov_len; i++) n -= iov[i].iov_len;
+		if (i < 2) {
+			iov[i].iov_base = (char *)iov[i].iov_base + n;
+			iov[i].iov_len -= n;
+		}
+	}
+	return 0;
+}
+
+// Fill in 'job' from a key argument written as @id:offset. Returns 0, or -1 if 'arg' is not one.
+int otpParsePadRef(const char *arg, struct otpJob *job) {
+	unsigned long id;
+	unsigned long long offset;
+	int end = 0;
+
+	if (sscanf(arg, "@%lu:%llu%n", &id, &offset, &end) != 2 || arg[end] != '\0') return -1;
+	job->key = NULL;
+	job->padId = id;
+	job->padOffset = offset;
+	return 0;
+}
+
+// otpLoadInput for the command line: any problem ends the program
+static void readInput(const char *path, const char *what, int alphabet, struct otpInput *in) {
+	char msg[64];
+	int status = otpLoadInput(path, alphabet, in);
+
+	if (status < 0) snprintf(msg, sizeof(msg), "ERROR opening %s", what);
+	else snprintf(msg, sizeof(msg), "Bad character in %s", what);	// Check for bad characters
+	if (status != OTP_ST_OK) error(msg);
+}
+
+int otpClientMain(int argc, char *argv[], const struct otpClientMode *mode) {
+	struct otpJob *jobs;
+	struct otpInput text, key;
+	int socketFD, numJobs, status, failed = 0;
+	int i, opt, which;
+	uint64_t tried;
+	int legacy = 0;		// -l: use the old "secret"/"@@" sentinel protocol
+	int stream = 0;		// -s: send the files in chunks instead of reading them whole
+	int stats = 0;		// -S: print the daemon's metrics instead
+	int memfd = 0;		// -m: pass each job in a memfd (unix socket only)
+	int packed = 0;		// -p: pack letters five to three bytes, if the daemon agrees
+	const char *batch = NULL, *batchKey = NULL, *batchOut = NULL;	// -b, -k, -o
+	int connections = 4;	// -c
+	int timeout = OTP_DEFAULT_TIMEOUT;	// -t
+	int route = OTP_ROUTE_LEAST;		// -R
+	int timings = 0;			// -T: report where the time went, on stderr
+	struct otpEndpoints *eps;
+	struct otpAsync *async;
+	struct otpRequest *reqs;
+	const struct otpCodec *codec = otpCodecFor(OTP_ALPHA_LETTERS);		// -a
+	int alphabet = OTP_ALPHA_LETTERS;
+	const char *prog, *env;
+	static const struct option longOpts[] = {
+		{ "timings", no_argument, NULL, 'T' },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	while ((opt = getopt_long(argc, argv, "lsSmpb:k:o:c:a:t:R:T", longOpts, NULL)) != -1) {
+		switch (opt) {
+			case 'a':
+				if ((codec = otpCodecByName(optarg)) == NULL) usage(argv[0], mode);
+				alphabet = codec->alphabet;
+				break;
+			case 'l': legacy = 1; break;
+			case 's': stream = 1; break;
+			case 'S': stats = 1; break;
+			case 'm': memfd = 1; break;
+			case 'p': packed = 1; break;
+			case 'b': batch = optarg; break;
+			case 'k': batchKey = optarg; break;
+			case 'o': batchOut = optarg; break;
+			case 'c': if ((connections = atoi(optarg)) < 1) usage(argv[0], mode); break;
+			case 't': if ((timeout = atoi(optarg)) < 0) usage(argv[0], mode); break;
+			case 'R': if ((route = otpRouteByName(optarg)) < 0) usage(argv[0], mode); break;
+			case 'T': timings = 1; break;
+			default: usage(argv[0], mode);
+		}
+	}
+	if ((env = getenv("OTP_TIMINGS")) != NULL && *env != '\0' && strcmp(env, "0") != 0) timings = 1;
+	if (timings) otpTimingsEnable(argv[0]);
+	otpSetTimeout(timeout);
+	if (optind == argc || (eps = otpEndpointsNew(argv[argc-1], route)) == NULL) usage(argv[0], mode);
+	if (stats) {
+		// Every daemon's, each under a comment naming it if there are several
+		if (argc - optind != 1) usage(argv[0], mode);
+		otpTimingsCount("stats", otpEndpointsCount(eps), 0);
+		for (i = 0; i < otpEndpointsCount(eps); i++) {
+			if (otpEndpointsCount(eps) > 1) printf("# daemon %s\n", otpEndpointName(eps, i));
+			fflush(stdout);
+			socketFD = otpConnectTo(otpEndpointName(eps, i));
+			if (socketFD < 0) error("ERROR connecting");
+			status = otpFetchStats(socketFD, stdout);
+			close(socketFD);
+			if (status != OTP_ST_OK) return report(mode, status);
+		}
+		return 0;
+	}
+	if (batch != NULL) {
+		if (argc - optind != 1 || legacy || stream || memfd || packed) usage(argv[0], mode);
+		return otpBatch(mode, alphabet, batch, batchKey, batchOut, connections, eps);
+	}
+	// Check usage/args: one or more text/key pairs, then the port (or unix socket), or a list of them.
+	// Standard input can only be streamed, so "-" rules out the other modes as -s does.
+	for (i = optind; i + 1 < argc - 1; i += 2) {
+		if (strcmp(argv[i], "-") == 0) stream = 1;
+	}
+	if (argc - optind < 3 || (argc - optind) % 2 != 1 || legacy + stream + memfd + packed > 1) usage(argv[0], mode);
+	if ((legacy || packed) && alphabet != OTP_ALPHA_LETTERS) usage(argv[0], mode);	// Only letters go either way
+	numJobs = (argc - optind) / 2;
+	if (memfd && !otpEndpointsLocal(eps)) usage(argv[0], mode);	// Descriptors only pass over unix sockets
+	prog = argv[0];
+	argv += optind;		// argv[2*i] and argv[2*i+1] are now the text and key of job i
+
+/************** Streaming: text and key go out in chunks as they are read *******/
+	if (stream) {
+		for (i = 0; i < numJobs; i++) {
+			struct otpJob ref;
+			int whole = strcmp(argv[2*i], "-") == 0;	// Standard input, to its end
+			int textFD = whole ? STDIN_FILENO : open(argv[2*i], O_RDONLY);
+			FILE* keyFP;
+			if (otpParsePadRef(argv[2*i+1], &ref) == 0) usage(prog, mode);	// Streams carry their key
+			keyFP = fopen(argv[2*i+1], "r");
+			if (textFD < 0 || keyFP == NULL) error("ERROR opening input");
+			otpTimingsCount("stream", 1, 0);	// The stream counts its bytes as it goes
+			// Once text has gone out it can't be sent again, so only a failed connect moves on
+			tried = 0;
+			socketFD = otpEndpointConnect(eps, otpRouteKey(argv[2*i]), &tried, &which);
+			if (socketFD < 0) error("ERROR connecting");
+			status = otpStreamTransfer(socketFD, mode->opcode, alphabet, textFD, keyFP, STDOUT_FILENO, whole);
+			otpEndpointRelease(eps, which, socketFD, status == OTP_ST_OK);
+			if (!whole) close(textFD);
+			fclose(keyFP);
+			if (status != OTP_ST_OK) exit(report(mode, status));
+			if (!whole && codec->lines && write(STDOUT_FILENO, "\n", 1) < 0) error("ERROR writing result");
+		}
+		otpEndpointsFree(eps);
+		return 0;
+	}
+
+/************** String retrieval ************************/
+	jobs = calloc(numJobs, sizeof(*jobs));
+	if (jobs == NULL) error("ERROR out of memory");
+	for (i = 0; i < numJobs; i++) {
+		readInput(argv[2*i], mode->textName, alphabet, &text);
+		if (!legacy && !memfd && text.len > OTP_MAX_REQUEST) {
+			fprintf(stderr, "ERROR: %s larger than %llu bytes, send it with -s or -m\n",
+					mode->textName, OTP_MAX_REQUEST);	// The daemon would refuse it whole
+			exit(1);
+		}
+		jobs[i].alphabet = alphabet;
+		jobs[i].text = text.data;
+		jobs[i].len = text.len;
+		jobs[i].out = text.data;	// Answers overwrite the text, which has been sent by then
+		jobs[i].routeKey = otpRouteKey(argv[2*i]);
+		if (otpParsePadRef(argv[2*i+1], &jobs[i]) == 0) {
+			if (legacy || alphabet != OTP_ALPHA_LETTERS) usage(prog, mode);	// Pads are letters, and the old protocol can't name one
+			if (jobs[i].padOffset % OTP_KEY_BLOCK != 0) {
+				fprintf(stderr, "ERROR: pad offset %llu is not a multiple of %d\n",
+						(unsigned long long)jobs[i].padOffset, OTP_KEY_BLOCK);
+				exit(1);
+			}
+			continue;
+		}
+		readInput(argv[2*i+1], "key", alphabet, &key);
+		if (key.len < text.len) {
+			fprintf(stderr, "ERROR: %s longer than key\n", mode->textName);	// Verify longer key than text
+			exit(1);
+		}
+		jobs[i].key = key.data;
+	}
+	for (i = 0; i < numJobs; i++) otpTimingsCount(NULL, 1, jobs[i].len);
+
+/************** Network transfer ************************/
+	// A memfd or legacy job moves on to the next daemon when one can't be reached or refuses it as
+	// the wrong server (or, for memfd, as busy); nothing has been written out for it by then
+	if (memfd) {
+		otpTimingsCount("memfd", 0, 0);
+		for (i = 0; i < numJobs; i++) {
+			tried = 0;
+			status = -1;
+			while ((socketFD = otpEndpointConnect(eps, jobs[i].key ? jobs[i].routeKey : jobs[i].padId,
+					&tried, &which)) >= 0) {
+				status = otpMemfdTransfer(socketFD, mode->opcode, &jobs[i], STDOUT_FILENO);
+				otpEndpointRelease(eps, which, socketFD, status >= 0);
+				if (status != OTP_ST_WRONG_SERVER && status != OTP_ST_BUSY) break;
+			}
+			if (socketFD < 0 && status == -1) error("ERROR connecting");
+			if (status != OTP_ST_OK) exit(report(mode, status));
+		}
+		otpEndpointsFree(eps);
+		return 0;
+	}
+	if (legacy) {
+		otpTimingsCount("legacy", 0, 0);
+		for (i = 0; i < numJobs; i++) {
+			tried = 0;
+			jobs[i].status = -1;
+			while ((socketFD = otpEndpointConnect(eps, jobs[i].routeKey, &tried, &which)) >= 0) {
+				jobs[i].status = legacyTransfer(socketFD, mode, &jobs[i]);
+				otpEndpointRelease(eps, which, socketFD, 0);
+				if (jobs[i].status != OTP_ST_WRONG_SERVER) break;
+			}
+			if (socketFD < 0 && jobs[i].status == -1) error("ERROR connecting");
+		}
+	} else {
+		// Through the library, on this thread: see otp_async.h
+		otpTimingsCount(packed ? "packed" : "pipelined", 0, 0);
+		reqs = calloc(numJobs, sizeof(*reqs));
+		if (reqs == NULL || (async = otpAsyncNew(eps, 0, packed ? OTP_FEAT_PACKED : 0)) == NULL)
+			error("ERROR out of memory");
+		for (i = 0; i < numJobs; i++) {
+			reqs[i].job = jobs[i];
+			reqs[i].opcode = mode->opcode;
+			if (otpAsyncSubmit(async, &reqs[i]) < 0) error("ERROR submitting request");
+		}
+		otpAsyncFree(async);
+		for (i = 0; i < numJobs; i++) {
+			jobs[i] = reqs[i].job;
+			if (jobs[i].status >= 0) continue;
+			errno = reqs[i].err;
+			error("ERROR talking to daemon");
+		}
+		free(reqs);
+	}
+	otpEndpointsFree(eps);
+	otpPhase(OTP_CPHASE_WRITE);
+
+	// Print each result to stdout with its newline restored, in argument order
+	for (i = 0; i < numJobs; i++) {
+		if (jobs[i].status != OTP_ST_OK) {
+			failed = report(mode, jobs[i].status);
+			continue;
+		}
+		if (otpWriteResult(STDOUT_FILENO, jobs[i].out, jobs[i].len, codec->lines) < 0) error("ERROR writing result");
+	}
+	return failed;
+}
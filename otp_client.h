@@ -0,0 +1,138 @@
+/* Author: Brad Powell
+ * Date: 6/12/2019
+ * otp_client: Client side shared by otp_enc and otp_dec
+ * Use: client [-l | -s | -m | -p] [-a alphabet] [-t ms] [-R route] [-T] text key [text key ...]
+ *        port|socket[,...]
+ * Every text/key pair becomes one request. All of them travel over a single connection, sent
+ * back to back without waiting for answers (pipelined); each answer carries its request's tag,
+ * so they are matched up whatever order they arrive in. Results are printed in argument order.
+ * A key written as @id:offset is not read at all; the daemon takes it from its pad 'id' instead
+ * (see otp_keystore.h), starting 'offset' characters in. The offset must be a multiple of 64
+ * (OTP_KEY_BLOCK), and a pad range can be decoded with only after it has been encoded with.
+ * The pipelined and memfd modes support pad keys.
+ *   -l	old sentinel protocol, one connection per pair
+ *   -s	stream each pair in chunks instead of reading the files whole (see otp_stream.c)
+ *   -m	hand each pair to the daemon in a memfd (unix socket only, see otp_proto.h)
+ *   -p	pack letters five to three bytes on the wire, if the daemon agrees (see otp_proto.h)
+ *   -t	milliseconds to wait for the daemon before giving up (default 60000; 0 waits forever)
+ *   -T	(or --timings, or OTP_TIMINGS=1 in the environment) print where the time went; see below
+ *   -a	letters (the default), printable or bytes; see otp_codec.h. With bytes the text and key
+ *	are whole files of any bytes, and the result is written without a newline.
+ * A text of "-" is standard input, streamed to its end with its newlines kept, so the client can
+ * sit in the middle of a pipeline; its key may be any file, such as /dev/fd/3 for a descriptor.
+ * A server argument containing a '/' is the path of a daemon's unix socket (daemon -u). Several
+ * daemons may be listed, separated by commas; see otp_route.c for how requests are shared out
+ * between them (-R least, the default, or hash) and sent on to another when one fails. Streams and
+ * memfd requests each go to one daemon, and -S prints the metrics of every daemon listed.
+ * Requests the daemon refuses as busy are sent again on the same connection after the wait it
+ * suggests, doubled each time, up to OTP_BUSY_RETRIES times; no wait is longer than
+ * OTP_BUSY_MAX_WAIT, whatever the daemon says.
+ *
+ * Use: client -b manifest|directory [-k key -o outdir] [-c connections] [-a alphabet] [-t ms]
+ *        [-R route] [-T] port|socket[,...]
+ * Batch mode, see otp_batch.c: many files in one process, each result to its own output file.
+ *
+ * Use: client -S [-t ms] [-T] port|socket[,...]
+ * Print the daemon's metrics (otp_stats.h) in the Prometheus text format.
+ *
+ * With timings on, the client's wall clock time is split into the phases below as it goes, and on
+ * exit, whatever the outcome, one line of JSON goes to stderr: the program, mode, requests and
+ * text bytes, then total_us and <phase>_us for each phase, in microseconds. They add up to the
+ * total. Waiting in poll is charged to the phase being waited on.
+ */
+
+#ifndef OTP_CLIENT_H
+#define OTP_CLIENT_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define OTP_BUSY_RETRIES	3
+#define OTP_BUSY_MAX_WAIT	10000	// ms
+#define OTP_DEFAULT_TIMEOUT	60000	// ms
+#define OTP_MAX_ENDPOINTS	64	// Daemons in one server list
+
+// How requests are shared out over a list of daemons (otp_route.c)
+#define OTP_ROUTE_LEAST		0	// To the one with the fewest outstanding
+#define OTP_ROUTE_HASH		1	// To the one the request's key hashes to
+
+#define OTP_JOB_CUT		-2	// Job status: the connection failed part way through its answer
+
+// Phases of a client run, for -T
+#define OTP_CPHASE_LOAD		0	// Opening, mapping and reading the text and key
+#define OTP_CPHASE_VALIDATE	1	// Checking them for characters outside the alphabet
+#define OTP_CPHASE_RESOLVE	2	// Looking up the daemon's address
+#define OTP_CPHASE_CONNECT	3	// Connecting
+#define OTP_CPHASE_HANDSHAKE	4	// Legacy token and "confirm" round trips, or HELLO
+#define OTP_CPHASE_SEND		5	// Sending requests, until the last byte is out
+#define OTP_CPHASE_WAIT		6	// From then until answers start, and busy retry pauses
+#define OTP_CPHASE_RECEIVE	7	// Reading the answers
+#define OTP_CPHASE_WRITE	8	// Writing results out
+#define OTP_CPHASE_PARALLEL	9	// Waiting on threads: batch connections, or several daemons at once
+#define OTP_CPHASES		10
+
+// What a client program asks for: its opcode, legacy handshake token and name for its input
+struct otpClientMode {
+	int opcode;
+	const char *legacyToken;
+	const char *textName;
+};
+
+// One request of a pipeline
+struct otpJob {
+	const char *text;	// Input, without its newline
+	const char *key;	// At least 'len' characters of key, or NULL to use the daemon's pad:
+	uint32_t padId;		// ... this pad
+	uint64_t padOffset;	// ... from here
+	size_t len;
+	char *out;		// Receives 'len' bytes of result; may be the text buffer itself
+	int status;		// OTP_ST_* once answered; -1 or OTP_JOB_CUT if not
+	uint32_t retryAfter;	// ms, suggested with OTP_ST_BUSY
+	int alphabet;		// OTP_ALPHA_* of text and key
+	unsigned char *wire;	// Text and key packed by otpPackJob, or NULL to send them as they are
+	uint64_t routeKey;	// For OTP_ROUTE_HASH, unless it names a pad; see otpRouteKey
+};
+
+struct otpEndpoints;
+
+// One input file's first line (or all of it, see otpLoadInput), mapped (mapLen > 0) or on the heap
+struct otpInput {
+	char *data;
+	size_t len;		// Up to, not including, the newline
+	size_t mapLen;
+};
+
+void otpTimingsEnable(const char *prog);
+void otpTimingsCount(const char *mode, int requests, uint64_t bytes);
+void otpPhase(int phase);
+void otpSetTimeout(int ms);
+int otpTimeout(void);
+int otpConnect(int portNumber);
+int otpConnectTo(const char *server);
+int otpHello(int fd, uint32_t want);
+int otpPackJob(struct otpJob *job);
+int otpPipeline(int fd, int opcode, struct otpJob *jobs, int numJobs);
+int otpRetryBusy(int fd, int opcode, struct otpJob *jobs, int numJobs, int rounds);
+int otpStreamTransfer(int fd, int opcode, int alphabet, int textFD, FILE *key, int outFD, int whole);
+int otpMemfdTransfer(int fd, int opcode, const struct otpJob *job, int outFD);
+int otpFetchStats(int fd, FILE *out);
+int otpParsePadRef(const char *arg, struct otpJob *job);
+int otpLoadInput(const char *path, int alphabet, struct otpInput *in);
+void otpFreeInput(struct otpInput *in);
+int otpWriteResult(int fd, const char *buf, size_t len, int newline);
+int otpClientMain(int argc, char *argv[], const struct otpClientMode *mode);
+int otpBatch(const struct otpClientMode *mode, int alphabet, const char *source, const char *key, const char *outDir,
+		int connections, struct otpEndpoints *eps);
+uint64_t otpRouteKey(const char *s);
+int otpRouteByName(const char *name);
+struct otpEndpoints *otpEndpointsNew(const char *list, int route);
+void otpEndpointsFree(struct otpEndpoints *eps);
+int otpEndpointsCount(const struct otpEndpoints *eps);
+const char *otpEndpointName(const struct otpEndpoints *eps, int which);
+int otpEndpointsLocal(const struct otpEndpoints *eps);
+int otpEndpointConnect(struct otpEndpoints *eps, uint64_t key, uint64_t *tried, int *which);
+void otpEndpointRelease(struct otpEndpoints *eps, int which, int fd, int keep);
+int otpRoute(struct otpEndpoints *eps, int opcode, struct otpJob *jobs, int numJobs, uint32_t features);
+
+#endif
@@ -0,0 +1,457 @@
+/* Author: Brad Powell
+ * Date: 6/17/2019
+ * otp_codec: The one time pad transform and input check, shared by the daemons and clients
+ * Every kernel works on symbol indexes. Encode is idx(text) + idx(key), minus the alphabet size if
+ * that reached it; decode is idx(text) - idx(key), plus the size if that went negative. No
+ * division, and in the vector kernels no branches either. For A-Z and space the vector kernels
+ * compute idx = c - 'A', except space which is 26, instead of looking it up.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "otp_codec.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define OTP_HAVE_X86 1
+#endif
+
+#define NOT_SYMBOL	0x80	// indexOf entry for characters outside the alphabet; alphabets stay under 128
+
+// Lookup tables for one alphabet, built from its symbol list at startup
+struct table {
+	unsigned char indexOf[256];	// Character -> index, or NOT_SYMBOL
+	char symbolAt[256];		// Index -> character; only the first 'size' entries matter
+};
+
+static struct table letters, printable;
+
+static void buildTable(struct table *t, const char *symbols) {
+	int i;
+	memset(t->indexOf, NOT_SYMBOL, sizeof(t->indexOf));
+	memset(t->symbolAt, symbols[0], sizeof(t->symbolAt));
+	for (i = 0; symbols[i] != '\0'; i++) {
+		t->indexOf[(unsigned char)symbols[i]] = i;
+		t->symbolAt[i] = symbols[i];
+	}
+}
+
+/************** Table kernels ************************/
+
+// 'size' is a constant at every call, so each alphabet gets its own copy of the loop. Characters
+// outside the alphabet give garbage, but the mask keeps even those inside the table.
+static inline void encodeTable(const struct table *t, int size, char *text, const char *key, size_t len) {
+	size_t i;
+	int s;
+	for (i = 0; i < len; i++) {
+		s = t->indexOf[(unsigned char)text[i]] + t->indexOf[(unsigned char)key[i]];
+		if (s >= size) s -= size;
+		text[i] = t->symbolAt[s & 0xFF];
+	}
+}
+
+static inline void decodeTable(const struct table *t, int size, char *text, const char *key, size_t len) {
+	size_t i;
+	int d;
+	for (i = 0; i < len; i++) {
+		d = t->indexOf[(unsigned char)text[i]] - t->indexOf[(unsigned char)key[i]];
+		if (d < 0) d += size;
+		text[i] = t->symbolAt[d & 0xFF];
+	}
+}
+
+// One pass with no early exit: OR every lookup together and check for NOT_SYMBOL at the end
+static inline int validateTable(const struct table *t, const char *buf, size_t len) {
+	unsigned char seen = 0;
+	size_t i;
+	for (i = 0; i < len; i++) seen |= t->indexOf[(unsigned char)buf[i]];
+	return !(seen & NOT_SYMBOL);
+}
+
+static void encodeScalar(char *text, const char *key, size_t len) {
+	encodeTable(&letters, 27, text, key, len);
+}
+
+static void decodeScalar(char *text, const char *key, size_t len) {
+	decodeTable(&letters, 27, text, key, len);
+}
+
+static int validateScalar(const char *buf, size_t len) {
+	return validateTable(&letters, buf, len);
+}
+
+static void encodePrintable(char *text, const char *key, size_t len) {
+	encodeTable(&printable, 95, text, key, len);
+}
+
+static void decodePrintable(char *text, const char *key, size_t len) {
+	decodeTable(&printable, 95, text, key, len);
+}
+
+static int validatePrintable(const char *buf, size_t len) {
+	return validateTable(&printable, buf, len);
+}
+
+/************** Byte kernels ************************/
+
+// Eight bytes at a time; memcpy keeps unaligned input legal and compiles to plain loads
+static void xorScalar(char *text, const char *key, size_t len) {
+	uint64_t t, k;
+	size_t i;
+	for (i = 0; i + 8 <= len; i += 8) {
+		memcpy(&t, text + i, 8);
+		memcpy(&k, key + i, 8);
+		t ^= k;
+		memcpy(text + i, &t, 8);
+	}
+	for (; i < len; i++) text[i] ^= key[i];
+}
+
+static int validateBytes(const char *buf, size_t len) {
+	(void)buf;
+	(void)len;
+	return 1;
+}
+
+#ifdef OTP_HAVE_X86
+/************** SSE2 kernels, 16 characters per step ************************/
+
+// Characters to indexes: subtract 'A', then patch spaces to 26
+__attribute__((target("sse2")))
+static inline __m128i indexSSE2(__m128i c) {
+	__m128i space = _mm_cmpeq_epi8(c, _mm_set1_epi8(' '));
+	__m128i idx = _mm_sub_epi8(c, _mm_set1_epi8('A'));
+	return _mm_or_si128(_mm_andnot_si128(space, idx), _mm_and_si128(space, _mm_set1_epi8(26)));
+}
+
+// Indexes back to characters: add 'A', then patch 26 to space
+__attribute__((target("sse2")))
+static inline __m128i charSSE2(__m128i idx) {
+	__m128i space = _mm_cmpeq_epi8(idx, _mm_set1_epi8(26));
+	__m128i c = _mm_add_epi8(idx, _mm_set1_epi8('A'));
+	return _mm_or_si128(_mm_andnot_si128(space, c), _mm_and_si128(space, _mm_set1_epi8(' ')));
+}
+
+__attribute__((target("sse2")))
+static void encodeSSE2(char *text, const char *key, size_t len) {
+	size_t i;
+	__m128i s, wrap;
+	for (i = 0; i + 16 <= len; i += 16) {
+		s = _mm_add_epi8(indexSSE2(_mm_loadu_si128((const __m128i *)(text + i))),
+				indexSSE2(_mm_loadu_si128((const __m128i *)(key + i))));
+		wrap = _mm_cmpgt_epi8(s, _mm_set1_epi8(26));		// s is at most 52, so signed is fine
+		s = _mm_sub_epi8(s, _mm_and_si128(wrap, _mm_set1_epi8(27)));
+		_mm_storeu_si128((__m128i *)(text + i), charSSE2(s));
+	}
+	encodeScalar(text + i, key + i, len - i);
+}
+
+__attribute__((target("sse2")))
+static void decodeSSE2(char *text, const char *key, size_t len) {
+	size_t i;
+	__m128i d, wrap;
+	for (i = 0; i + 16 <= len; i += 16) {
+		d = _mm_sub_epi8(indexSSE2(_mm_loadu_si128((const __m128i *)(text + i))),
+				indexSSE2(_mm_loadu_si128((const __m128i *)(key + i))));
+		wrap = _mm_cmpgt_epi8(_mm_setzero_si128(), d);
+		d = _mm_add_epi8(d, _mm_and_si128(wrap, _mm_set1_epi8(27)));
+		_mm_storeu_si128((__m128i *)(text + i), charSSE2(d));
+	}
+	decodeScalar(text + i, key + i, len - i);
+}
+
+// A character is valid if c - 'A' is at most 25 unsigned, or it is a space
+__attribute__((target("sse2")))
+static int validateSSE2(const char *buf, size_t len) {
+	size_t i;
+	__m128i c, idx, ok;
+	for (i = 0; i + 16 <= len; i += 16) {
+		c = _mm_loadu_si128((const __m128i *)(buf + i));
+		idx = _mm_sub_epi8(c, _mm_set1_epi8('A'));
+		ok = _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(idx, _mm_set1_epi8(25)), idx),
+				_mm_cmpeq_epi8(c, _mm_set1_epi8(' ')));
+		if (_mm_movemask_epi8(ok) != 0xFFFF) return 0;
+	}
+	return validateScalar(buf + i, len - i);
+}
+
+__attribute__((target("sse2")))
+static void xorSSE2(char *text, const char *key, size_t len) {
+	size_t i;
+	for (i = 0; i + 16 <= len; i += 16) {
+		_mm_storeu_si128((__m128i *)(text + i), _mm_xor_si128(_mm_loadu_si128((const __m128i *)(text + i)),
+				_mm_loadu_si128((const __m128i *)(key + i))));
+	}
+	xorScalar(text + i, key + i, len - i);
+}
+
+/************** AVX2 kernels, 32 characters per step ************************/
+
+__attribute__((target("avx2")))
+static inline __m256i indexAVX2(__m256i c) {
+	__m256i space = _mm256_cmpeq_epi8(c, _mm256_set1_epi8(' '));
+	return _mm256_blendv_epi8(_mm256_sub_epi8(c, _mm256_set1_epi8('A')), _mm256_set1_epi8(26), space);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i charAVX2(__m256i idx) {
+	__m256i space = _mm256_cmpeq_epi8(idx, _mm256_set1_epi8(26));
+	return _mm256_blendv_epi8(_mm256_add_epi8(idx, _mm256_set1_epi8('A')), _mm256_set1_epi8(' '), space);
+}
+
+__attribute__((target("avx2")))
+static void encodeAVX2(char *text, const char *key, size_t len) {
+	size_t i;
+	__m256i s, wrap;
+	for (i = 0; i + 32 <= len; i += 32) {
+		s = _mm256_add_epi8(indexAVX2(_mm256_loadu_si256((const __m256i *)(text + i))),
+				indexAVX2(_mm256_loadu_si256((const __m256i *)(key + i))));
+		wrap = _mm256_cmpgt_epi8(s, _mm256_set1_epi8(26));
+		s = _mm256_sub_epi8(s, _mm256_and_si256(wrap, _mm256_set1_epi8(27)));
+		_mm256_storeu_si256((__m256i *)(text + i), charAVX2(s));
+	}
+	_mm256_zeroupper();	// See validateAVX2
+	encodeSSE2(text + i, key + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static void decodeAVX2(char *text, const char *key, size_t len) {
+	size_t i;
+	__m256i d, wrap;
+	for (i = 0; i + 32 <= len; i += 32) {
+		d = _mm256_sub_epi8(indexAVX2(_mm256_loadu_si256((const __m256i *)(text + i))),
+				indexAVX2(_mm256_loadu_si256((const __m256i *)(key + i))));
+		wrap = _mm256_cmpgt_epi8(_mm256_setzero_si256(), d);
+		d = _mm256_add_epi8(d, _mm256_and_si256(wrap, _mm256_set1_epi8(27)));
+		_mm256_storeu_si256((__m256i *)(text + i), charAVX2(d));
+	}
+	_mm256_zeroupper();
+	decodeSSE2(text + i, key + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static int validateAVX2(const char *buf, size_t len) {
+	size_t i;
+	__m256i c, idx, ok;
+	for (i = 0; i + 32 <= len; i += 32) {
+		c = _mm256_loadu_si256((const __m256i *)(buf + i));
+		idx = _mm256_sub_epi8(c, _mm256_set1_epi8('A'));
+		ok = _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(idx, _mm256_set1_epi8(25)), idx),
+				_mm256_cmpeq_epi8(c, _mm256_set1_epi8(' ')));
+		if (_mm256_movemask_epi8(ok) != -1) return 0;
+	}
+	// The tail goes to SSE2 code that doesn't use VEX encodings. GCC makes that call a jump without
+	// clearing the upper halves first, and the switch then costs hundreds of cycles per call.
+	_mm256_zeroupper();
+	return validateSSE2(buf + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static void xorAVX2(char *text, const char *key, size_t len) {
+	size_t i;
+	for (i = 0; i + 32 <= len; i += 32) {
+		_mm256_storeu_si256((__m256i *)(text + i), _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(text + i)),
+				_mm256_loadu_si256((const __m256i *)(key + i))));
+	}
+	_mm256_zeroupper();
+	xorSSE2(text + i, key + i, len - i);
+}
+#endif
+
+/************** Packed letters ************************/
+
+// A packed group splits into its low two digits (v % 729) and high three (v / 729), and each part
+// is looked up as that many byte lanes, digit j in byte j. Five digits then add or subtract as one
+// 64 bit word with no carries between lanes. A corrupt group can reach past 27^5; the high table
+// covers all of 2^24 so such input stays in bounds, only giving meaningless output.
+#define PACK_HIGH	((1 << 24) / 729 + 1)
+#define LANES_ALL	0x0101010101ULL
+
+static uint16_t lowLanes[729];
+static uint32_t highLanes[PACK_HIGH];
+
+static void buildPackTables(void) {
+	uint32_t v;
+	for (v = 0; v < 729; v++) lowLanes[v] = (v % 27) | (v / 27) << 8;
+	for (v = 0; v < PACK_HIGH; v++) highLanes[v] = (v % 27) | (v / 27 % 27) << 8 | (v / 729) << 16;
+}
+
+// Bytes needed for 'len' packed symbols
+size_t otpPackedSize(size_t len) {
+	return (len + OTP_PACK_SYMBOLS - 1) / OTP_PACK_SYMBOLS * OTP_PACK_BYTES;
+}
+
+static inline uint32_t get24(const unsigned char *p) {
+	return ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+}
+
+static inline void put24(unsigned char *p, uint32_t v) {
+	p[0] = v >> 16;
+	p[1] = v >> 8;
+	p[2] = v;
+}
+
+static inline uint64_t groupLanes(uint32_t v) {
+	return lowLanes[v % 729] | (uint64_t)highLanes[v / 729] << 16;
+}
+
+static inline uint32_t lanesGroup(uint64_t d) {
+	uint32_t v = d >> 32 & 0xFF;
+	v = v * 27 + (d >> 24 & 0xFF);
+	v = v * 27 + (d >> 16 & 0xFF);
+	v = v * 27 + (d >> 8 & 0xFF);
+	return v * 27 + (d & 0xFF);
+}
+
+// Up to five letters as lanes; missing ones are zero
+static inline uint64_t letterLanes(const char *text, size_t n) {
+	uint64_t d = 0;
+	while (n-- > 0) d = d << 8 | (letters.indexOf[(unsigned char)text[n]] & 0x1F);
+	return d;
+}
+
+void otpPack(unsigned char *out, const char *text, size_t len) {
+	const unsigned char *t = (const unsigned char *)text;
+	const unsigned char *index = letters.indexOf;
+	size_t i;
+	for (i = 0; i + OTP_PACK_SYMBOLS <= len; i += OTP_PACK_SYMBOLS) {
+		put24(out, (index[t[0]] & 0x1F) + 27 * ((index[t[1]] & 0x1F) + 27 * ((index[t[2]] & 0x1F) +
+				27 * ((index[t[3]] & 0x1F) + 27 * (index[t[4]] & 0x1F)))));
+		t += OTP_PACK_SYMBOLS;
+		out += OTP_PACK_BYTES;
+	}
+	if (i < len) put24(out, lanesGroup(letterLanes(text + i, len - i)));
+}
+
+void otpUnpack(char *out, const unsigned char *in, size_t len) {
+	size_t i, j;
+	uint64_t d;
+	for (i = 0; i < len; i += OTP_PACK_SYMBOLS, in += OTP_PACK_BYTES) {
+		d = groupLanes(get24(in));
+		for (j = 0; j < OTP_PACK_SYMBOLS && i + j < len; j++, d >>= 8)
+			out[i + j] = letters.symbolAt[d & 0xFF];
+	}
+}
+
+// One group of the transform: 'd' and 'k' are text and key lanes. Lanes hold at most 31, so a sum
+// stays under 64 and adding 101 sets a lane's top bit exactly where the sum reached 27.
+static inline uint64_t transformLanes(uint64_t d, uint64_t k, int decode) {
+	d = decode ? d + 27 * LANES_ALL - k : d + k;
+	return d - ((d + 101 * LANES_ALL) >> 7 & LANES_ALL) * 27;
+}
+
+// Transform 'len' packed symbols of 'text' in place. The key is packed too, or letters if not
+// 'keyPacked' (a pad from the key store).
+void otpPackedTransform(unsigned char *text, const void *key, int keyPacked, size_t len, int decode) {
+	const unsigned char *kp = key;
+	const char *kc = key;
+	uint64_t d, k;
+	size_t i, n;
+
+	for (i = 0; i + OTP_PACK_SYMBOLS <= len; i += OTP_PACK_SYMBOLS, text += OTP_PACK_BYTES) {
+		k = keyPacked ? groupLanes(get24(kp)) : letterLanes(kc + i, OTP_PACK_SYMBOLS);
+		kp += OTP_PACK_BYTES;
+		put24(text, lanesGroup(transformLanes(groupLanes(get24(text)), k, decode)));
+	}
+	if ((n = len - i) > 0) {
+		k = keyPacked ? groupLanes(get24(kp)) : letterLanes(kc + i, n);
+		d = transformLanes(groupLanes(get24(text)), k, decode);
+		put24(text, lanesGroup(d & ((1ULL << 8 * n) - 1)));	// Lanes past the text stay zero
+	}
+}
+
+/************** Kernel selection ************************/
+
+static struct otpCodec codecs[OTP_ALPHABETS] = {
+	{ OTP_ALPHA_LETTERS, "letters", "ABCDEFGHIJKLMNOPQRSTUVWXYZ ", 27, 1, encodeScalar, decodeScalar, validateScalar },
+	{ OTP_ALPHA_PRINTABLE, "printable", " !\"#$%&'()*+,-./0123456789:;<=>?@ABCDEFGHIJKLMNOPQRSTUVWXYZ[\\]^_`abcdefghijklmnopqrstuvwxyz{|}~",
+		95, 1, encodePrintable, decodePrintable, validatePrintable },
+	{ OTP_ALPHA_BYTES, "bytes", NULL, 256, 0, xorScalar, xorScalar, validateBytes },
+};
+static const char *codecName = "scalar";
+
+// Runs before main, so the daemons' worker threads never race on the tables or the choice
+__attribute__((constructor))
+static void codecSelect(void) {
+	struct otpCodec *l = &codecs[OTP_ALPHA_LETTERS], *b = &codecs[OTP_ALPHA_BYTES];
+	const char *force = getenv("OTP_CODEC");
+
+	buildTable(&letters, l->symbols);
+	buildTable(&printable, codecs[OTP_ALPHA_PRINTABLE].symbols);
+	buildPackTables();
+#ifdef OTP_HAVE_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2") && (force == NULL || strcmp(force, "avx2") == 0)) {
+		l->encode = encodeAVX2;
+		l->decode = decodeAVX2;
+		l->validate = validateAVX2;
+		b->encode = b->decode = xorAVX2;
+		codecName = "avx2";
+	} else if (__builtin_cpu_supports("sse2") && (force == NULL || strcmp(force, "sse2") == 0)) {
+		l->encode = encodeSSE2;
+		l->decode = decodeSSE2;
+		l->validate = validateSSE2;
+		b->encode = b->decode = xorSSE2;
+		codecName = "sse2";
+	}
+#endif
+	(void)force;
+	(void)b;
+}
+
+// Every kernel this CPU can run, whichever were picked, into 'list' (room for OTP_MAX_KERNELS).
+// Returns how many.
+int otpCodecKernels(struct otpKernel *list) {
+	static const struct otpKernel all[] = {
+		{ OTP_ALPHA_LETTERS, "scalar", encodeScalar, decodeScalar, validateScalar },
+		{ OTP_ALPHA_PRINTABLE, "scalar", encodePrintable, decodePrintable, validatePrintable },
+		{ OTP_ALPHA_BYTES, "scalar", xorScalar, xorScalar, validateBytes },
+#ifdef OTP_HAVE_X86
+		{ OTP_ALPHA_LETTERS, "sse2", encodeSSE2, decodeSSE2, validateSSE2 },
+		{ OTP_ALPHA_BYTES, "sse2", xorSSE2, xorSSE2, validateBytes },
+		{ OTP_ALPHA_LETTERS, "avx2", encodeAVX2, decodeAVX2, validateAVX2 },
+		{ OTP_ALPHA_BYTES, "avx2", xorAVX2, xorAVX2, validateBytes },
+#endif
+	};
+	int i, n = 0;
+
+	for (i = 0; i < (int)(sizeof(all) / sizeof(all[0])); i++) {
+#ifdef OTP_HAVE_X86
+		if (strcmp(all[i].name, "sse2") == 0 && !__builtin_cpu_supports("sse2")) continue;
+		if (strcmp(all[i].name, "avx2") == 0 && !__builtin_cpu_supports("avx2")) continue;
+#endif
+		list[n++] = all[i];
+	}
+	return n;
+}
+
+// The codec for wire alphabet number 'alphabet', or NULL if there is no such alphabet
+const struct otpCodec *otpCodecFor(int alphabet) {
+	if (alphabet < 0 || alphabet >= OTP_ALPHABETS) return NULL;
+	return &codecs[alphabet];
+}
+
+const struct otpCodec *otpCodecByName(const char *name) {
+	int i;
+	for (i = 0; i < OTP_ALPHABETS; i++) {
+		if (strcmp(codecs[i].name, name) == 0) return &codecs[i];
+	}
+	return NULL;
+}
+
+void otpEncode(char *text, const char *key, size_t len) {
+	codecs[OTP_ALPHA_LETTERS].encode(text, key, len);
+}
+
+void otpDecode(char *text, const char *key, size_t len) {
+	codecs[OTP_ALPHA_LETTERS].decode(text, key, len);
+}
+
+int otpValidate(const char *buf, size_t len) {
+	return codecs[OTP_ALPHA_LETTERS].validate(buf, len);
+}
+
+const char *otpCodecName(void) {
+	return codecName;
+}
@@ -0,0 +1,74 @@
+/* Author: Brad Powell
+ * Date: 6/17/2019
+ * otp_codec: The one time pad transform and input check, shared by the daemons and clients
+ * An alphabet lists its symbols in index order. Text and key characters are mapped to indexes,
+ * added (encode) or subtracted (decode) modulo the alphabet size, and mapped back. Every alphabet
+ * but one is driven by a pair of 256 entry lookup tables built from its symbol list, so checking
+ * and transforming are each one table pass. The exception is OTP_ALPHA_BYTES, where every byte is
+ * a symbol and encode and decode are both an XOR; it pads binary data at memory speed.
+ *
+ * The original A-Z and space alphabet also has AVX2 and SSE2 kernels doing 32 or 16 characters at
+ * a time, as does XOR. The kernel is picked once from CPUID at startup, with a scalar loop for the
+ * tail and for other CPUs. Setting OTP_CODEC=scalar|sse2|avx2 forces a kernel, for testing.
+ * Output is only defined for text and key made of the alphabet's symbols; a codec's validate
+ * checks that, returning nonzero if all 'len' characters qualify. otpEncode, otpDecode and
+ * otpValidate are the A-Z and space codec.
+ *
+ * Every kernel this CPU can run, not just the one picked, is listed by otpCodecKernels, so
+ * otp_codecbench can time them and check them against each other and the original loops.
+ *
+ * For the wire, letters can also be packed five to three bytes (see otp_proto.h). The daemon
+ * transforms packed text without unpacking it to characters: each group is split into its five
+ * digits, added or subtracted digit by digit and put back together.
+ */
+
+#ifndef OTP_CODEC_H
+#define OTP_CODEC_H
+
+#include <stddef.h>
+
+// Alphabets, numbered as on the wire (see otp_proto.h)
+#define OTP_ALPHA_LETTERS	0	// A-Z then space, 27 symbols: the original
+#define OTP_ALPHA_PRINTABLE	1	// Printable ASCII, space to '~', 95 symbols
+#define OTP_ALPHA_BYTES		2	// Any byte; XOR
+#define OTP_ALPHABETS		3
+
+typedef void (*otpCodecFn)(char *text, const char *key, size_t len);
+
+struct otpCodec {
+	int alphabet;		// OTP_ALPHA_*
+	const char *name;
+	const char *symbols;	// In index order; NULL for bytes, where symbol i is byte i
+	int size;		// Number of symbols
+	int lines;		// Text ends at its first newline, which is put back on output
+	otpCodecFn encode, decode;
+	int (*validate)(const char *buf, size_t len);
+};
+
+// One alphabet's kernels of one kind, for otp_codecbench
+struct otpKernel {
+	int alphabet;		// OTP_ALPHA_*
+	const char *name;	// "scalar" (the table loops, or XOR eight bytes at a time), "sse2" or "avx2"
+	otpCodecFn encode, decode;
+	int (*validate)(const char *buf, size_t len);
+};
+#define OTP_MAX_KERNELS		8
+
+// Packed letters: five symbols in three bytes, as the base 27 number with the first symbol in the
+// lowest digit (27^5 < 2^24). A short last group is filled with zero digits.
+#define OTP_PACK_SYMBOLS	5
+#define OTP_PACK_BYTES		3
+
+const struct otpCodec *otpCodecFor(int alphabet);
+const struct otpCodec *otpCodecByName(const char *name);
+void otpEncode(char *text, const char *key, size_t len);
+void otpDecode(char *text, const char *key, size_t len);
+int otpValidate(const char *buf, size_t len);
+const char *otpCodecName(void);
+int otpCodecKernels(struct otpKernel *list);
+size_t otpPackedSize(size_t len);
+void otpPack(unsigned char *out, const char *text, size_t len);
+void otpUnpack(char *out, const unsigned char *in, size_t len);
+void otpPackedTransform(unsigned char *text, const void *key, int keyPacked, size_t len, int decode);
+
+#endif
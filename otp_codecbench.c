@@ -0,0 +1,423 @@
+/* Author: Brad Powell
+ * Date: 6/28/2019
+ * otp_codecbench: Microbenchmark and differential fuzzer for the codec kernels
+ * Use: otp_codecbench [-s size,size,...] [-o offset,offset,...] [-t ms]
+ * Times encode, decode and validate of every kernel this CPU can run (otpCodecKernels), for each
+ * buffer size (suffixes k and m allowed) with text and key starting 'offset' bytes past a 64 byte
+ * boundary. Each case repeats for at least 'ms' milliseconds. Alongside the kernels it times
+ * "reference", the original character arithmetic loops of otp_enc_d.c/otp_dec_d.c and the checks
+ * of otp_enc.c/otp_dec.c, and for letters "packed", the transform of packed text (otp_codec.h)
+ * counted in characters. The results go to stdout as one JSON object, in GB/s.
+ *
+ * Use: otp_codecbench -f [-n cases] [-r seed] [-m maxlen]
+ * Fuzzes every kernel against the reference loops: random alphabets, lengths up to 'maxlen' and
+ * text and key offsets, checking that encode and decode give the reference's bytes and undo each
+ * other, that nothing outside the text is written and the key isn't touched, and that validate
+ * agrees on text with and without stray bytes. Packed letters are checked through otpPack and
+ * otpUnpack. The first mismatch is printed with the seed that reproduces it, and the exit status
+ * is 1.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/random.h>
+#include "otp_codec.h"
+
+#define MAX_SIZES	16
+#define ALIGN		64	// Buffers start on this boundary, before their offset
+#define GUARD		64	// Bytes either side of a fuzzed text that must stay untouched
+
+static void error(const char *msg) { perror(msg); exit(1); }	// Error function for reporting issues
+
+static void usage(const char *prog) {
+	fprintf(stderr, "USAGE: %s [-s size,size,...] [-o offset,offset,...] [-t ms]\n"
+			"       %s -f [-n cases] [-r seed] [-m maxlen]\n", prog, prog);
+	exit(1);
+}
+
+/************** Reference loops ************************/
+
+// As otp_enc_d.c had it: space moved to '[' (91) so A-Z and space are 65..91, then arithmetic
+// mod 27. The original also overwrote the key's spaces; here they are moved in a copy.
+static void refEncodeLetters(char *text, const char *key, size_t len) {
+	size_t i;
+	char k;
+	for (i = 0; i < len; i++) {
+		k = key[i];
+		if (text[i] == 32) text[i] = 91;
+		if (k == 32) k = 91;
+		text[i] = ((text[i]-65+k-65) % 27) + 65;
+		if (text[i] == 91) text[i] = 32;
+	}
+}
+
+// As otp_dec_d.c had it
+static void refDecodeLetters(char *text, const char *key, size_t len) {
+	size_t i;
+	char k;
+	for (i = 0; i < len; i++) {
+		k = key[i];
+		if (text[i] == 32) text[i] = 91;
+		if (k == 32) k = 91;
+		text[i] = ((text[i]-k+27) % 27) + 65;
+		if (text[i] == 91) text[i] = 32;
+	}
+}
+
+// As otp_enc.c and otp_dec.c had it
+static int refValidateLetters(const char *buf, size_t len) {
+	size_t i;
+	for (i = 0; i < len; i++) {
+		if ((buf[i] < 65 || buf[i] > 90) && buf[i] != 32) return 0;
+	}
+	return 1;
+}
+
+// The same arithmetic for printable ASCII, 32..126
+static void refEncodePrintable(char *text, const char *key, size_t len) {
+	size_t i;
+	for (i = 0; i < len; i++) text[i] = ((text[i]-32+key[i]-32) % 95) + 32;
+}
+
+static void refDecodePrintable(char *text, const char *key, size_t len) {
+	size_t i;
+	for (i = 0; i < len; i++) text[i] = ((text[i]-key[i]+95) % 95) + 32;
+}
+
+static int refValidatePrintable(const char *buf, size_t len) {
+	size_t i;
+	for (i = 0; i < len; i++) {
+		if (buf[i] < 32 || buf[i] > 126) return 0;
+	}
+	return 1;
+}
+
+static void refXor(char *text, const char *key, size_t len) {
+	size_t i;
+	for (i = 0; i < len; i++) text[i] ^= key[i];
+}
+
+static int refValidateBytes(const char *buf, size_t len) {
+	(void)buf;
+	(void)len;
+	return 1;
+}
+
+static const struct otpKernel references[OTP_ALPHABETS] = {
+	{ OTP_ALPHA_LETTERS, "reference", refEncodeLetters, refDecodeLetters, refValidateLetters },
+	{ OTP_ALPHA_PRINTABLE, "reference", refEncodePrintable, refDecodePrintable, refValidatePrintable },
+	{ OTP_ALPHA_BYTES, "reference", refXor, refXor, refValidateBytes },
+};
+
+/************** Shared helpers ************************/
+
+static uint64_t rngState;
+
+// xorshift64*: quick, and the same sequence from the same seed
+static uint64_t rnd(void) {
+	rngState ^= rngState >> 12;
+	rngState ^= rngState << 25;
+	rngState ^= rngState >> 27;
+	return rngState * 0x2545f4914f6cdd1dULL;
+}
+
+// Fill 'buf' with random symbols of 'codec'
+static void randomSymbols(const struct otpCodec *codec, char *buf, size_t len) {
+	size_t i;
+	for (i = 0; i < len; i++) {
+		buf[i] = codec->symbols ? codec->symbols[rnd() % codec->size] : (char)rnd();
+	}
+}
+
+static char *alignedAlloc(size_t len) {
+	void *p;
+	if (posix_memalign(&p, ALIGN, len) != 0) error("ERROR out of memory");
+	return p;
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// "16,4k,1m" -> list[]; returns how many
+static int parseList(char *arg, size_t *list, int allowZero, const char *prog) {
+	char *tok, *end;
+	int n = 0;
+	for (tok = strtok(arg, ","); tok != NULL; tok = strtok(NULL, ",")) {
+		if (n == MAX_SIZES) usage(prog);
+		list[n] = strtoul(tok, &end, 10);
+		if (*end == 'k' || *end == 'K') list[n] <<= 10, end++;
+		else if (*end == 'm' || *end == 'M') list[n] <<= 20, end++;
+		if (*end != '\0' || (list[n] == 0 && !allowZero)) usage(prog);
+		n++;
+	}
+	if (n == 0) usage(prog);
+	return n;
+}
+
+/************** Benchmark ************************/
+
+enum { OP_ENCODE, OP_DECODE, OP_VALIDATE, OP_PACKED_ENCODE, OP_PACKED_DECODE };
+static const char *opNames[] = { "encode", "decode", "validate", "encode", "decode" };
+
+static volatile int sink;	// Keeps validate calls from being thrown away
+
+// Run 'op' of 'k' on 'len' bytes until 'ms' have gone by, doubling the rounds each time. Returns
+// GB/s of text.
+static double timeCase(const struct otpKernel *k, int op, char *text, const char *key, size_t len, int ms) {
+	double start = now(), secs;
+	unsigned long long rounds = 0, batch = 1, i;
+
+	do {
+		for (i = 0; i < batch; i++) {
+			switch (op) {
+				case OP_ENCODE: k->encode(text, key, len); break;
+				case OP_DECODE: k->decode(text, key, len); break;
+				case OP_VALIDATE: sink += k->validate(text, len); break;
+				case OP_PACKED_ENCODE:
+				case OP_PACKED_DECODE:
+					otpPackedTransform((unsigned char *)text, key, 1, len, op == OP_PACKED_DECODE);
+					break;
+			}
+		}
+		rounds += batch;
+		batch *= 2;
+	} while ((secs = now() - start) * 1000 < ms);
+	return rounds * (double)len / secs / 1e9;
+}
+
+// Buffers for the benchmark, each with room for the largest size past the largest offset
+static char *benchText, *benchKey, *benchPackedText, *benchPackedKey;
+static int benchRows;
+
+// Time 'op' of 'k' on 'len' fresh random symbols at 'off' and print its row of the results
+static void benchCase(const struct otpKernel *k, int op, size_t len, size_t off, int ms) {
+	const struct otpCodec *codec = otpCodecFor(k->alphabet);
+	char *text = benchText + off, *key = benchKey + off;
+	double gbps;
+
+	// Fresh symbols each time, so a decode isn't timed on the output of an encode
+	randomSymbols(codec, text, len);
+	randomSymbols(codec, key, len);
+	if (op >= OP_PACKED_ENCODE) {
+		otpPack((unsigned char *)benchPackedText + off, text, len);
+		otpPack((unsigned char *)benchPackedKey + off, key, len);
+		text = benchPackedText + off;
+		key = benchPackedKey + off;
+	}
+	gbps = timeCase(k, op, text, key, len, ms);
+	printf("%s\n  {\"alphabet\": \"%s\", \"kernel\": \"%s\", \"op\": \"%s\", \"size\": %zu, "
+			"\"offset\": %zu, \"gb_per_sec\": %.3f}", benchRows++ ? "," : "", codec->name, k->name,
+			opNames[op], len, off, gbps);
+	fflush(stdout);
+}
+
+static void benchmark(size_t *sizes, int numSizes, size_t *offsets, int numOffsets, int ms) {
+	struct otpKernel kernels[OTP_MAX_KERNELS + OTP_ALPHABETS + 1];
+	size_t maxSize = 0, maxOffset = 0;
+	int numKernels, packed, first, last, i, a, s, o, op;
+
+	for (s = 0; s < numSizes; s++) if (sizes[s] > maxSize) maxSize = sizes[s];
+	for (o = 0; o < numOffsets; o++) if (offsets[o] > maxOffset) maxOffset = offsets[o];
+	benchText = alignedAlloc(maxSize + maxOffset);
+	benchKey = alignedAlloc(maxSize + maxOffset);
+	benchPackedText = alignedAlloc(otpPackedSize(maxSize) + maxOffset);
+	benchPackedKey = alignedAlloc(otpPackedSize(maxSize) + maxOffset);
+
+	// The reference loops, then the kernels, then the packed transform as a letters kernel
+	for (a = 0; a < OTP_ALPHABETS; a++) kernels[a] = references[a];
+	numKernels = OTP_ALPHABETS + otpCodecKernels(kernels + OTP_ALPHABETS);
+	kernels[numKernels].alphabet = OTP_ALPHA_LETTERS;
+	kernels[numKernels++].name = "packed";
+
+	printf("{\"selected\": \"%s\", \"ms_per_case\": %d, \"results\": [", otpCodecName(), ms);
+	for (a = 0; a < OTP_ALPHABETS; a++) {
+		for (i = 0; i < numKernels; i++) {
+			if (kernels[i].alphabet != a) continue;
+			packed = strcmp(kernels[i].name, "packed") == 0;
+			for (s = 0; s < numSizes; s++) {
+				for (o = 0; o < numOffsets; o++) {
+					first = packed ? OP_PACKED_ENCODE : OP_ENCODE;
+					last = packed ? OP_PACKED_DECODE : OP_VALIDATE;
+					for (op = first; op <= last; op++)
+						benchCase(&kernels[i], op, sizes[s], offsets[o], ms);
+				}
+			}
+		}
+	}
+	printf("\n]}\n");
+	free(benchText);
+	free(benchKey);
+	free(benchPackedText);
+	free(benchPackedKey);
+}
+
+/************** Differential fuzzer ************************/
+
+static unsigned long long seed;
+static long fuzzCase;
+
+static void mismatch(const char *alphabet, const char *kernel, const char *what, size_t len, size_t textOff,
+		size_t keyOff, const char *detail) {
+	fprintf(stderr, "MISMATCH case %ld (seed %llu): %s %s %s, length %zu, text offset %zu, key offset %zu: %s\n",
+			fuzzCase, seed, alphabet, kernel, what, len, textOff, keyOff, detail);
+	exit(1);
+}
+
+// Compare 'len' bytes; on a difference, describe the first one in 'detail'
+static int differs(const char *got, const char *want, size_t len, char *detail, size_t size) {
+	size_t i;
+	for (i = 0; i < len; i++) {
+		if (got[i] != want[i]) {
+			snprintf(detail, size, "byte %zu is 0x%02x, expected 0x%02x", i, (unsigned char)got[i],
+					(unsigned char)want[i]);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Nothing outside the 'len' bytes at 'off' of the GUARD padded buffer 'buf' was written
+static int guardBroken(const char *buf, size_t off, size_t len, size_t size) {
+	size_t i;
+	for (i = 0; i < size; i++) {
+		if ((i < GUARD + off || i >= GUARD + off + len) && buf[i] != (char)0xA5) return 1;
+	}
+	return 0;
+}
+
+static void fuzz(long cases, size_t maxLen) {
+	struct otpKernel kernels[OTP_MAX_KERNELS];
+	const struct otpCodec *codec;
+	const struct otpKernel *k;
+	size_t size = GUARD + ALIGN + maxLen + GUARD, len, textOff, keyOff, i;
+	char *text = alignedAlloc(size), *key = alignedAlloc(size), *keyCopy = alignedAlloc(size);
+	char *work = alignedAlloc(size), *encoded = alignedAlloc(maxLen + 1), *decoded = alignedAlloc(maxLen + 1);
+	unsigned char *packedText = malloc(otpPackedSize(maxLen) + 1), *packedKey = malloc(otpPackedSize(maxLen) + 1);
+	char detail[128];
+	const char *what;
+	int numKernels = otpCodecKernels(kernels), tested = 0, j, decode, keyPacked, valid;
+
+	if (packedText == NULL || packedKey == NULL) error("ERROR out of memory");
+	for (fuzzCase = 0; fuzzCase < cases; fuzzCase++) {
+		codec = otpCodecFor(rnd() % OTP_ALPHABETS);
+		// Mostly short lengths, where the vector kernels' tails are, and now and then a long one
+		len = rnd() % (rnd() % 4 == 0 ? maxLen + 1 : (maxLen < 100 ? maxLen + 1 : 100));
+		textOff = rnd() % ALIGN;
+		keyOff = rnd() % ALIGN;
+		memset(text, 0xA5, size);
+		memset(key, 0xA5, size);
+		randomSymbols(codec, text + GUARD + textOff, len);
+		randomSymbols(codec, key + GUARD + keyOff, len);
+		memcpy(keyCopy, key, size);
+
+		memcpy(encoded, text + GUARD + textOff, len);
+		references[codec->alphabet].encode(encoded, key + GUARD + keyOff, len);
+		memcpy(decoded, text + GUARD + textOff, len);
+		references[codec->alphabet].decode(decoded, key + GUARD + keyOff, len);
+
+		for (j = 0; j < numKernels; j++) {
+			k = &kernels[j];
+			if (k->alphabet != codec->alphabet) continue;
+			tested++;
+			for (decode = 0; decode <= 1; decode++) {
+				memcpy(work, text, size);
+				(decode ? k->decode : k->encode)(work + GUARD + textOff, key + GUARD + keyOff, len);
+				what = decode ? "decode" : "encode";
+				if (differs(work + GUARD + textOff, decode ? decoded : encoded, len, detail, sizeof(detail)))
+					mismatch(codec->name, k->name, what, len, textOff, keyOff, detail);
+				if (guardBroken(work, textOff, len, size))
+					mismatch(codec->name, k->name, what, len, textOff, keyOff, "wrote outside the text");
+				if (memcmp(key, keyCopy, size) != 0)
+					mismatch(codec->name, k->name, what, len, textOff, keyOff, "changed the key");
+				// And back again
+				(decode ? k->encode : k->decode)(work + GUARD + textOff, key + GUARD + keyOff, len);
+				if (differs(work + GUARD + textOff, text + GUARD + textOff, len, detail, sizeof(detail)))
+					mismatch(codec->name, k->name, decode ? "decode then encode" : "encode then decode",
+							len, textOff, keyOff, detail);
+			}
+		}
+
+		// Packed letters: the round trip through otpPack, and the packed transform both ways, with
+		// the key packed and as characters
+		if (codec->alphabet == OTP_ALPHA_LETTERS) {
+			otpPack(packedText, text + GUARD + textOff, len);
+			otpPack(packedKey, key + GUARD + keyOff, len);
+			otpUnpack(work, packedText, len);
+			if (differs(work, text + GUARD + textOff, len, detail, sizeof(detail)))
+				mismatch(codec->name, "packed", "pack then unpack", len, textOff, keyOff, detail);
+			for (i = 0; i < 4; i++) {
+				decode = i & 1;
+				keyPacked = i >> 1;
+				otpPack(packedText, text + GUARD + textOff, len);
+				otpPackedTransform(packedText, keyPacked ? (const void *)packedKey :
+						(const void *)(key + GUARD + keyOff), keyPacked, len, decode);
+				otpUnpack(work, packedText, len);
+				if (differs(work, decode ? decoded : encoded, len, detail, sizeof(detail)))
+					mismatch(codec->name, "packed", keyPacked ? (decode ? "decode, packed key" :
+							"encode, packed key") : (decode ? "decode" : "encode"),
+							len, textOff, keyOff, detail);
+			}
+		}
+
+		// Validate: the text as it is, then with a few random bytes dropped in
+		for (valid = 1; valid >= 0; valid--) {
+			if (!valid) {
+				for (i = rnd() % 3 + 1; i > 0 && len > 0; i--)
+					text[GUARD + textOff + rnd() % len] = (char)rnd();
+			}
+			for (j = 0; j < numKernels; j++) {
+				k = &kernels[j];
+				if (k->alphabet != codec->alphabet) continue;
+				if (!k->validate(text + GUARD + textOff, len) !=
+						!references[codec->alphabet].validate(text + GUARD + textOff, len)) {
+					snprintf(detail, sizeof(detail), "says %s",
+							k->validate(text + GUARD + textOff, len) ? "valid" : "invalid");
+					mismatch(codec->name, k->name, "validate", len, textOff, keyOff, detail);
+				}
+			}
+		}
+	}
+	printf("codec fuzz: %ld cases, %d kernel runs, seed %llu: all match the reference\n", cases, tested, seed);
+	free(text);
+	free(key);
+	free(keyCopy);
+	free(work);
+	free(encoded);
+	free(decoded);
+	free(packedText);
+	free(packedKey);
+}
+
+int main(int argc, char *argv[]) {
+	size_t sizes[MAX_SIZES] = { 16, 256, 4 << 10, 64 << 10, 1 << 20, 16 << 20 }, offsets[MAX_SIZES] = { 0, 1 };
+	int numSizes = 6, numOffsets = 2, ms = 50, fuzzing = 0, haveSeed = 0, opt;
+	long cases = 100000;
+	size_t maxLen = 4096;
+
+	while ((opt = getopt(argc, argv, "s:o:t:fn:r:m:")) != -1) {
+		switch (opt) {
+			case 's': numSizes = parseList(optarg, sizes, 0, argv[0]); break;
+			case 'o': numOffsets = parseList(optarg, offsets, 1, argv[0]); break;
+			case 't': if ((ms = atoi(optarg)) < 1) usage(argv[0]); break;
+			case 'f': fuzzing = 1; break;
+			case 'n': if ((cases = atol(optarg)) < 1) usage(argv[0]); break;
+			case 'r': seed = strtoull(optarg, NULL, 10); haveSeed = 1; break;
+			case 'm': if ((maxLen = strtoul(optarg, NULL, 10)) < 1) usage(argv[0]); break;
+			default: usage(argv[0]);
+		}
+	}
+	if (optind != argc) usage(argv[0]);
+	if (!haveSeed && getrandom(&seed, sizeof(seed), 0) < (ssize_t)sizeof(seed)) error("ERROR reading random bytes");
+	rngState = seed ? seed : 1;		// xorshift never leaves zero
+
+	if (fuzzing) fuzz(cases, maxLen);
+	else benchmark(sizes, numSizes, offsets, numOffsets, ms);
+	return 0;
+}
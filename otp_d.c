@@ -0,0 +1,21 @@
+/* Author: Brad Powell
+ * Date: 6/21/2019
+ * otp_d: One Time Pad Daemon, encode and decode
+ * Use: otp_d [-e fork|prefork|thread|epoll|uring] [-w workers] [-b backlog] [-k pad ...]
+ *        [-u socket] [-t threads] [-q requests] [-r retry_ms] [-i idle_ms] [-d deadline_ms]
+ *        [-s shards] [-c cpus] [-H handoff_socket] listening_port
+ * Serves otp_enc and otp_dec on one port. Every request names its operation (the opcode, or the
+ * "secret"/"message" token of the old protocol), so both directions share one pool of workers,
+ * one key store and one set of buffers. See otp_server.h for the engine options.
+ */
+
+#include "otp_server.h"
+
+int main (int argc, char *argv[]) {
+	static const struct otpOperation ops[] = {
+		{ OTP_OP_ENCODE, "secret", 0 },
+		{ OTP_OP_DECODE, "message", 1 },
+	};
+	static const struct otpService both = { ops, 2 };
+	return otpServerMain(argc, argv, &both);
+}
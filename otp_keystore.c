@@ -0,0 +1,111 @@
+/* Author: Brad Powell
+ * Date: 6/20/2019
+ * otp_keystore: Pads held by a daemon, so requests can name key material instead of sending it
+ * See otp_keystore.h for the ledger.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "otp_proto.h"
+#include "otp_codec.h"
+#include "otp_keystore.h"
+
+struct pad {
+	const char *data;
+	uint64_t len;
+	uint64_t *used;		// Ledger: bit b set once block b has been encoded with
+};
+
+static struct pad pads[OTP_MAX_PADS];
+static int numPads;
+
+// Map the pad at 'path' and its ledger. Returns the pad's ID, or -1 (errno says why).
+int otpKeyStoreAdd(const char *path) {
+	struct pad *p = &pads[numPads];
+	struct stat st;
+	char ledger[4096];
+	const char *newline;
+	size_t words;
+	int fd;
+
+	if (numPads == OTP_MAX_PADS) return -1;
+	if ((fd = open(path, O_RDONLY)) < 0) return -1;
+	if (fstat(fd, &st) < 0 || st.st_size == 0) {
+		close(fd);
+		return -1;
+	}
+	p->data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p->data == MAP_FAILED) return -1;
+	newline = memchr(p->data, '\n', st.st_size);
+	p->len = newline ? (uint64_t)(newline - p->data) : (uint64_t)st.st_size;
+	if (!otpValidate(p->data, p->len)) return -1;
+
+	// One bit per block, rounded up to whole words; an existing ledger keeps its bits
+	words = (p->len + 64 * OTP_KEY_BLOCK - 1) / (64 * OTP_KEY_BLOCK);
+	if (words == 0) words = 1;
+	snprintf(ledger, sizeof(ledger), "%s.used", path);
+	if ((fd = open(ledger, O_RDWR | O_CREAT, 0600)) < 0) return -1;
+	if (fstat(fd, &st) < 0 || ((size_t)st.st_size < words * 8 && ftruncate(fd, words * 8) < 0)) {
+		close(fd);
+		return -1;
+	}
+	p->used = mmap(NULL, words * 8, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p->used == MAP_FAILED) return -1;
+	return numPads++;
+}
+
+// Set the ledger bits of blocks first..last, all or nothing. Each word is claimed with one atomic
+// OR; if a bit turns out to be taken already, the bits set so far are given back. Two overlapping
+// claims racing can therefore both fail, but never both succeed.
+static int claimBlocks(struct pad *p, uint64_t first, uint64_t last) {
+	uint64_t w, mask, old, lo, hi;
+	for (w = first / 64; w <= last / 64; w++) {
+		lo = (w == first / 64) ? first % 64 : 0;
+		hi = (w == last / 64) ? last % 64 : 63;
+		mask = (hi == 63 ? ~0ULL : (1ULL << (hi + 1)) - 1) & ~((1ULL << lo) - 1);
+		old = __atomic_fetch_or(&p->used[w], mask, __ATOMIC_ACQ_REL);
+		if (old & mask) {
+			__atomic_fetch_and(&p->used[w], ~(mask & ~old), __ATOMIC_ACQ_REL);
+			while (w-- > first / 64) {
+				lo = (w == first / 64) ? first % 64 : 0;
+				__atomic_fetch_and(&p->used[w], ((1ULL << lo) - 1), __ATOMIC_ACQ_REL);
+			}
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// Whether blocks 'first' through 'last' are all claimed already
+static int testBlocks(struct pad *p, uint64_t first, uint64_t last) {
+	uint64_t b;
+	for (b = first; b <= last; b++)
+		if (!(__atomic_load_n(&p->used[b / 64], __ATOMIC_ACQUIRE) & (1ULL << (b % 64)))) return 0;
+	return 1;
+}
+
+// Look up 'len' bytes of pad 'id' from 'offset', consuming them if asked, or else only if an
+// encode consumed them already. Returns an OTP_ST_* status.
+int otpKeyStoreGet(uint32_t id, uint64_t offset, uint64_t len, int consume, const char **key) {
+	struct pad *p;
+	uint64_t first, last;
+	if (id >= (uint32_t)numPads) return OTP_ST_NO_KEY;
+	p = &pads[id];
+	if (offset % OTP_KEY_BLOCK != 0) return OTP_ST_BAD_REQUEST;	// Ranges start on a ledger block
+	if (offset > p->len || len > p->len - offset) return OTP_ST_NO_KEY;
+	if (len > 0) {
+		first = offset / OTP_KEY_BLOCK;
+		last = (offset + len - 1) / OTP_KEY_BLOCK;
+		if (consume && claimBlocks(p, first, last) < 0) return OTP_ST_KEY_USED;
+		if (!consume && !testBlocks(p, first, last)) return OTP_ST_NO_KEY;	// Nothing was encoded with it
+	}
+	*key = p->data + offset;
+	return OTP_ST_OK;
+}
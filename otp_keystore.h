@@ -0,0 +1,27 @@
+/* Author: Brad Powell
+ * Date: 6/20/2019
+ * otp_keystore: Pads held by a daemon, so requests can name key material instead of sending it
+ * Each -k file (keygen output) is mapped read-only at startup and numbered from 0 in command line
+ * order; the pad is everything before its first newline. Encoding from a pad consumes the range it
+ * used. Consumption is recorded in a ledger next to the pad, "<pad>.used", one bit per
+ * OTP_KEY_BLOCK bytes of pad. The ledger is mapped shared, so every worker process sees the same
+ * bits, and it outlives the daemon, so a range is never encoded with twice, even across restarts.
+ * A range must start on a multiple of OTP_KEY_BLOCK (anything else is a bad request), and it is
+ * claimed in whole blocks, so an encode uses up the rest of its last block too; the next range
+ * starts at the following block. Decoding reads a range without consuming it, since the receiving
+ * side has to decode with the very range the sender encoded with, but only a range that an encode
+ * has claimed already; decoding ahead of the encode is refused as no key.
+ */
+
+#ifndef OTP_KEYSTORE_H
+#define OTP_KEYSTORE_H
+
+#include <stdint.h>
+
+#define OTP_KEY_BLOCK	64	// Pad bytes per ledger bit
+#define OTP_MAX_PADS	64
+
+int otpKeyStoreAdd(const char *path);
+int otpKeyStoreGet(uint32_t id, uint64_t offset, uint64_t len, int consume, const char **key);
+
+#endif
@@ -0,0 +1,191 @@
+/* Author: Brad Powell
+ * Date: 6/24/2019
+ * otp_pool: Transform threads for large requests
+ * See otp_pool.h for how requests are split.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "otp_proto.h"
+#include "otp_pool.h"
+
+struct otpParallel {
+	otpBlockFn fn;
+	char *text;
+	const char *key;
+	size_t len;
+	unsigned numBlocks;
+	unsigned nextBlock;		// Next block to hand out; pool lock
+	unsigned done, prefix;		// Blocks finished, and how many of the first ones are; own lock
+	unsigned char *blockDone;
+	uint64_t started, finished;
+	struct otpParallel *next;	// Pool queue, while blocks are left to hand out
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	struct otpParallel *head;
+	pid_t pid;			// Process the threads were started in
+} pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, 0 };
+static int poolSize;
+
+// Hand out the next block of 'p', dropping it from the queue with its last one. Pool lock held.
+// Returns the block, or -1 if all of them are taken.
+static int claimLocked(struct otpParallel *p) {
+	struct otpParallel **q;
+	if (p->nextBlock == p->numBlocks) return -1;
+	if (p->nextBlock + 1 == p->numBlocks) {
+		for (q = &pool.head; *q != NULL; q = &(*q)->next) {
+			if (*q == p) {
+				*q = p->next;
+				break;
+			}
+		}
+	}
+	return p->nextBlock++;
+}
+
+static void runBlock(struct otpParallel *p, unsigned b) {
+	size_t off = (size_t)b * OTP_PARALLEL_BLOCK;
+	size_t len = p->len - off < OTP_PARALLEL_BLOCK ? p->len - off : OTP_PARALLEL_BLOCK;
+	p->fn(p->text + off, p->key + off, len);
+
+	pthread_mutex_lock(&p->lock);
+	p->blockDone[b] = 1;
+	while (p->prefix < p->numBlocks && p->blockDone[p->prefix]) p->prefix++;
+	if (++p->done == p->numBlocks) p->finished = otpNowUsec();
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+}
+
+static void *poolThread(void *unused) {
+	struct otpParallel *p;
+	int b;
+	(void)unused;
+	while (1) {
+		pthread_mutex_lock(&pool.lock);
+		while (pool.head == NULL) pthread_cond_wait(&pool.work, &pool.lock);
+		p = pool.head;
+		b = claimLocked(p);
+		pthread_mutex_unlock(&pool.lock);
+		if (b >= 0) runBlock(p, b);
+	}
+	return NULL;
+}
+
+// Set the number of pool threads per process; call before any workers start
+void otpPoolSetup(int threads) {
+	poolSize = threads;
+}
+
+int otpPoolThreads(void) {
+	return poolSize;
+}
+
+// Start the threads in this process if they aren't yet. A forked worker inherits the parent's
+// pool state but none of its threads, so it starts afresh.
+static int poolStart(void) {
+	pthread_t tid;
+	int i;
+	if (pool.pid == getpid()) return 0;
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.work, NULL);
+	pool.head = NULL;
+	pool.pid = getpid();
+	for (i = 0; i < poolSize; i++) {
+		if (pthread_create(&tid, NULL, poolThread, NULL) != 0) return i > 0 ? 0 : -1;
+		pthread_detach(tid);
+	}
+	return 0;
+}
+
+static pthread_mutex_t startLock = PTHREAD_MUTEX_INITIALIZER;	// The thread engine may start it from many threads
+
+// Start this process's threads now rather than on the first large request, so a daemon taking
+// over from another (otp_server.h -H) has them running before it is sent any traffic
+void otpPoolWarm(void) {
+	if (poolSize == 0) return;
+	pthread_mutex_lock(&startLock);
+	poolStart();
+	pthread_mutex_unlock(&startLock);
+}
+
+// Start transforming 'len' characters of 'text' in place with the pool. Returns NULL if the
+// request is too small to split or there is no pool, in which case the caller does it itself.
+struct otpParallel *otpParallelStart(otpBlockFn fn, char *text, const char *key, size_t len) {
+	struct otpParallel *p;
+	int failed;
+
+	if (poolSize == 0 || len < OTP_PARALLEL_MIN) return NULL;
+	pthread_mutex_lock(&startLock);
+	failed = poolStart();
+	pthread_mutex_unlock(&startLock);
+	if (failed || (p = calloc(1, sizeof(*p))) == NULL) return NULL;
+	p->numBlocks = (len + OTP_PARALLEL_BLOCK - 1) / OTP_PARALLEL_BLOCK;
+	if ((p->blockDone = calloc(p->numBlocks, 1)) == NULL) {
+		free(p);
+		return NULL;
+	}
+	p->fn = fn;
+	p->text = text;
+	p->key = key;
+	p->len = len;
+	p->started = otpNowUsec();
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->cond, NULL);
+
+	pthread_mutex_lock(&pool.lock);
+	p->next = pool.head;
+	pool.head = p;
+	pthread_cond_broadcast(&pool.work);
+	pthread_mutex_unlock(&pool.lock);
+	return p;
+}
+
+// Bytes from the start of the text that are transformed already
+size_t otpParallelReady(struct otpParallel *p) {
+	size_t ready;
+	pthread_mutex_lock(&p->lock);
+	ready = (size_t)p->prefix * OTP_PARALLEL_BLOCK;
+	pthread_mutex_unlock(&p->lock);
+	return ready < p->len ? ready : p->len;
+}
+
+// Make progress on 'p': transform one of its blocks if any are left, otherwise sleep until the
+// finished prefix grows
+void otpParallelWait(struct otpParallel *p) {
+	unsigned prefix;
+	int b;
+
+	pthread_mutex_lock(&pool.lock);
+	b = claimLocked(p);
+	pthread_mutex_unlock(&pool.lock);
+	if (b >= 0) {
+		runBlock(p, b);
+		return;
+	}
+	pthread_mutex_lock(&p->lock);
+	prefix = p->prefix;
+	while (p->prefix == prefix && p->done < p->numBlocks) pthread_cond_wait(&p->cond, &p->lock);
+	pthread_mutex_unlock(&p->lock);
+}
+
+// Wait for every block, then release 'p'. Returns how long the transform took, in microseconds.
+uint64_t otpParallelFree(struct otpParallel *p) {
+	uint64_t took;
+	while (otpParallelReady(p) < p->len) otpParallelWait(p);
+	pthread_mutex_lock(&p->lock);	// The last block's thread may still be on its way out
+	while (p->done < p->numBlocks) pthread_cond_wait(&p->cond, &p->lock);
+	pthread_mutex_unlock(&p->lock);
+	took = p->finished - p->started;
+	pthread_mutex_destroy(&p->lock);
+	pthread_cond_destroy(&p->cond);
+	free(p->blockDone);
+	free(p);
+	return took;
+}
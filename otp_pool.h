@@ -0,0 +1,33 @@
+/* Author: Brad Powell
+ * Date: 6/24/2019
+ * otp_pool: Transform threads for large requests
+ * A request of OTP_PARALLEL_MIN bytes or more is cut into OTP_PARALLEL_BLOCK sized blocks that the
+ * pool threads transform at the same time. Blocks are handed out in ascending order and the
+ * finished prefix is tracked, so the session can send the start of the result while the rest is
+ * still being worked on; a connection thread waiting for output helps with its own request's
+ * blocks instead of sleeping. The threads are started on first use in each process, so forked
+ * workers get their own. With 0 threads every request is transformed in one piece, as before.
+ */
+
+#ifndef OTP_POOL_H
+#define OTP_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define OTP_PARALLEL_MIN	(1 << 20)	// Smallest request worth splitting
+#define OTP_PARALLEL_BLOCK	(256 << 10)	// Fits in L2 with its key
+
+typedef void (*otpBlockFn)(char *text, const char *key, size_t len);
+
+struct otpParallel;
+
+void otpPoolSetup(int threads);
+int otpPoolThreads(void);
+void otpPoolWarm(void);
+struct otpParallel *otpParallelStart(otpBlockFn fn, char *text, const char *key, size_t len);
+size_t otpParallelReady(struct otpParallel *p);
+void otpParallelWait(struct otpParallel *p);
+uint64_t otpParallelFree(struct otpParallel *p);
+
+#endif
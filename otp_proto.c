@@ -0,0 +1,205 @@
+/* Author: Brad Powell
+ * Date: 6/10/2019
+ * otp_proto: Wire protocol shared by the OTP clients and daemons
+ * Header packing and the blocking send/receive helpers. See otp_proto.h for the header layout.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "otp_proto.h"
+
+static void put32(unsigned char *p, uint32_t v) {
+	p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+
+static void put64(unsigned char *p, uint64_t v) {
+	put32(p, v >> 32);
+	put32(p + 4, (uint32_t)v);
+}
+
+static uint32_t get32(const unsigned char *p) {
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static uint64_t get64(const unsigned char *p) {
+	return ((uint64_t)get32(p) << 32) | get32(p + 4);
+}
+
+void otpPackHeader(const struct otpHeader *hdr, unsigned char *out) {
+	memset(out, 0, OTP_HDR_SIZE);
+	out[0] = 'O'; out[1] = 'T'; out[2] = 'P'; out[3] = OTP_VERSION;
+	out[4] = hdr->opcode;
+	out[5] = hdr->flags;
+	out[6] = hdr->status;
+	out[7] = hdr->alphabet;
+	put32(out + 8, hdr->tag);
+	put32(out + 12, hdr->aux);
+	put64(out + 16, hdr->payloadLen);
+	put64(out + 24, hdr->keyLen);
+}
+
+// Returns 0 on success, -1 if the buffer is not a header of our version.
+int otpUnpackHeader(const unsigned char *in, struct otpHeader *hdr) {
+	if (!otpIsBinary(in, OTP_HDR_SIZE) || in[3] != OTP_VERSION) return -1;
+	hdr->opcode = in[4];
+	hdr->flags = in[5];
+	hdr->status = in[6];
+	hdr->alphabet = in[7];
+	hdr->tag = get32(in + 8);
+	hdr->aux = get32(in + 12);
+	hdr->payloadLen = get64(in + 16);
+	hdr->keyLen = get64(in + 24);
+	return 0;
+}
+
+// True if the first bytes of a connection look like a binary header rather than a legacy token.
+int otpIsBinary(const unsigned char *in, size_t len) {
+	return len >= 3 && in[0] == 'O' && in[1] == 'T' && in[2] == 'P';
+}
+
+const char *otpStatusString(int status) {
+	switch (status) {
+		case OTP_ST_OK:			return "ok";
+		case OTP_ST_WRONG_SERVER:	return "connected to wrong server";
+		case OTP_ST_BAD_REQUEST:	return "malformed request";
+		case OTP_ST_SHORT_KEY:		return "key shorter than text";
+		case OTP_ST_NO_MEMORY:		return "server out of memory";
+		case OTP_ST_BAD_CHAR:		return "bad character in input";
+		case OTP_ST_NO_KEY:		return "no such key range";
+		case OTP_ST_KEY_USED:		return "key range already used";
+		case OTP_ST_BUSY:		return "daemon busy";
+		case OTP_ST_TIMEOUT:		return "request timed out";
+		default:			return "unknown error";
+	}
+}
+
+// Keep calling send until every byte is written. MSG_NOSIGNAL so a vanished peer is an
+// error return instead of a SIGPIPE.
+ssize_t sendAll(int fd, const void *buf, size_t len) {
+	const char *p = buf;
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < len) {
+		n = send(fd, p + done, len - done, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		done += n;
+	}
+	return done;
+}
+
+// Keep calling recv until 'len' bytes have arrived. Returns 0 if the peer closed first.
+ssize_t recvAll(int fd, void *buf, size_t len) {
+	char *p = buf;
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < len) {
+		n = recv(fd, p + done, len - done, 0);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		if (n == 0) return 0;
+		done += n;
+	}
+	return done;
+}
+
+int otpSendHeader(int fd, const struct otpHeader *hdr) {
+	unsigned char raw[OTP_HDR_SIZE];
+	otpPackHeader(hdr, raw);
+	return sendAll(fd, raw, sizeof(raw)) < 0 ? -1 : 0;
+}
+
+// Returns 0 on success, -1 on error, EOF or a bad header.
+int otpRecvHeader(int fd, struct otpHeader *hdr) {
+	unsigned char raw[OTP_HDR_SIZE];
+	if (recvAll(fd, raw, sizeof(raw)) <= 0) return -1;
+	return otpUnpackHeader(raw, hdr);
+}
+
+// Send a header and up to two data sections with one sendmsg, so small frames go out as one
+// segment instead of a header packet waiting on Nagle. Returns 0 on success, -1 on error.
+int otpSendFrame(int fd, const struct otpHeader *hdr, const void *payload, size_t payloadLen,
+		const void *key, size_t keyLen) {
+	unsigned char raw[OTP_HDR_SIZE];
+	struct iovec iov[3];
+	struct msghdr msg;
+	int first = 0;
+	ssize_t n;
+
+	otpPackHeader(hdr, raw);
+	iov[0].iov_base = raw;
+	iov[0].iov_len = sizeof(raw);
+	iov[1].iov_base = (void *)payload;
+	iov[1].iov_len = payloadLen;
+	iov[2].iov_base = (void *)key;
+	iov[2].iov_len = keyLen;
+
+	while (first < 3) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov[first];
+		msg.msg_iovlen = 3 - first;
+		n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		// Step past whatever was fully written and trim the partially written entry
+		while (first < 3 && (size_t)n >= iov[first].iov_len) {
+			n -= iov[first].iov_len;
+			first++;
+		}
+		if (first < 3) {
+			iov[first].iov_base = (char *)iov[first].iov_base + n;
+			iov[first].iov_len -= n;
+		}
+	}
+	return 0;
+}
+
+// Legacy receive: read until the "@@" terminator into a growing heap buffer. Only the newly
+// arrived bytes (plus one for a split "@@") are scanned, so the cost is linear in the message.
+// Returns the text without the terminator, NUL terminated, and its length in *len.
+char *otpRecvSentinel(int fd, size_t *len) {
+	size_t cap = 4096, used = 0, scan = 0;
+	char *buf = malloc(cap), *grown;
+	ssize_t n;
+
+	if (buf == NULL) return NULL;
+	while (1) {
+		if (cap - used < 256) {
+			cap *= 2;
+			grown = realloc(buf, cap);
+			if (grown == NULL) { free(buf); return NULL; }
+			buf = grown;
+		}
+		n = recv(fd, buf + used, cap - used - 1, 0);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) { free(buf); return NULL; }
+		used += n;
+		for (; scan + 1 < used; scan++) {
+			if (buf[scan] == '@' && buf[scan+1] == '@') {
+				buf[scan] = '\0';
+				*len = scan;
+				return buf;
+			}
+		}
+	}
+}
+
+uint64_t otpNowUsec(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
@@ -0,0 +1,130 @@
+/* Author: Brad Powell
+ * Date: 6/10/2019
+ * otp_proto: Wire protocol shared by the OTP clients and daemons
+ * Every binary request and response starts with a fixed 32 byte header:
+ *
+ *   0   'O' 'T' 'P' version		magic and protocol version
+ *   4   opcode				OTP_OP_*
+ *   5   flags				OTP_F_*
+ *   6   status				OTP_ST_* (responses only)
+ *   7   alphabet			OTP_ALPHA_* of text and key (otp_codec.h), 0 for A-Z and space
+ *   8   tag				echoed back in the response
+ *   12  aux				opcode specific
+ *   16  payloadLen			bytes of text following the header
+ *   24  keyLen				bytes of key following the text
+ *
+ * A request with OTP_F_STREAM set carries no text of its own. It is followed by OTP_OP_CHUNK
+ * frames of at most OTP_MAX_CHUNK text bytes, each with the same number of key bytes. The daemon
+ * answers every chunk with a CHUNK frame of output as soon as it is transformed, and the chunk
+ * flagged OTP_F_END (which may be empty) closes the stream in both directions.
+ *
+ * A whole request buffers its text and key in the daemon, so each may be at most OTP_MAX_REQUEST
+ * bytes on the wire; a larger one is answered OTP_ST_NO_MEMORY and the connection closed. Longer
+ * texts go as a stream, or in a memfd, which the daemon maps rather than copies.
+ *
+ * A request with OTP_F_KEYREF set carries no key bytes either: the key is 'payloadLen' bytes of
+ * the daemon's pad number 'aux', starting at offset 'keyLen' (see otp_keystore.h).
+ *
+ * On a unix socket a request may set OTP_F_MEMFD instead and pass a memfd with SCM_RIGHTS along
+ * with its header: text at offset 0, then key (unless OTP_F_KEYREF), and nothing after the header.
+ * The memfd must be sealed against shrinking. The daemon transforms the text in place and answers
+ * with an empty RESULT flagged OTP_F_MEMFD; the client reads the result from its own mapping.
+ *
+ * A client may open a connection with OTP_OP_HELLO, listing in 'aux' the OTP_FEAT_* it would like
+ * to use. The daemon answers with a RESULT whose 'aux' holds the ones it grants for the rest of the
+ * connection; a daemon that predates HELLO rejects it, and the client carries on without them.
+ * With OTP_FEAT_PACKED granted, a whole request with alphabet 0 may set OTP_F_PACKED: its text and
+ * key are sent five symbols to three bytes (see otp_codec.h), and so is its RESULT. 'payloadLen'
+ * and 'keyLen' still count symbols; each part takes otpPackedSize() of them on the wire.
+ *
+ * The alphabet applies to the whole request, stream chunks included. Pads only hold A-Z and
+ * space, so OTP_F_KEYREF needs alphabet 0.
+ *
+ * A daemon with an admission limit (daemon -q) refuses requests beyond it straight away with
+ * OTP_ST_BUSY instead of letting them queue; the client may try again after 'aux' milliseconds, or
+ * go elsewhere.
+ *
+ * A connection may carry any number of requests, and a client may send them back to back without
+ * waiting (pipelining). Every response carries the tag of its request; clients match on the tag
+ * rather than relying on order.
+ *
+ * All integers are big-endian. The old "secret"/"message" handshake with "@@" sentinels is
+ * still understood by the daemons (see otpRecvSentinel) for clients run with -l.
+ */
+
+#ifndef OTP_PROTO_H
+#define OTP_PROTO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define OTP_VERSION	1
+#define OTP_HDR_SIZE	32
+
+// Opcodes
+#define OTP_OP_ENCODE	1	// Request: payload is plaintext, followed by key
+#define OTP_OP_DECODE	2	// Request: payload is ciphertext, followed by key
+#define OTP_OP_RESULT	3	// Response: payload is the transformed text
+#define OTP_OP_REJECT	4	// Response: request refused, see status
+#define OTP_OP_CHUNK	5	// One piece of a streamed request or response
+#define OTP_OP_STATS	6	// Request: no payload; answered with a RESULT of metrics text
+#define OTP_OP_HELLO	7	// Request: no payload; 'aux' features wanted, answered with those granted
+
+// Flags
+#define OTP_F_STREAM	0x01	// Request: text and key follow as CHUNK frames
+#define OTP_F_END	0x02	// Chunk: last one of the stream
+#define OTP_F_KEYREF	0x04	// Request: key is pad 'aux' from offset 'keyLen', held by the daemon
+#define OTP_F_MEMFD	0x08	// Request: text and key are in the memfd passed with the header
+#define OTP_F_PACKED	0x10	// Request and result: letters packed five to three bytes
+
+// Connection features, negotiated with OTP_OP_HELLO
+#define OTP_FEAT_PACKED	0x01	// OTP_F_PACKED requests
+
+#define OTP_MAX_CHUNK	65536	// Largest text accepted in one CHUNK frame
+#define OTP_MAX_REQUEST	(64ULL << 20)	// Largest text, or key, accepted in one whole request
+
+// Response status codes
+#define OTP_ST_OK		0
+#define OTP_ST_WRONG_SERVER	1	// Opcode not served by this daemon
+#define OTP_ST_BAD_REQUEST	2	// Malformed header
+#define OTP_ST_SHORT_KEY	3	// keyLen < payloadLen
+#define OTP_ST_NO_MEMORY	4	// Daemon could not allocate the request buffer
+#define OTP_ST_BAD_CHAR		5	// Text or key outside the alphabet
+#define OTP_ST_NO_KEY		6	// Pad reference names no pad, or runs past its end
+#define OTP_ST_KEY_USED		7	// Pad range was already consumed by an earlier encode
+#define OTP_ST_BUSY		8	// Daemon at its limit; 'aux' suggests a retry after that many ms
+#define OTP_ST_TIMEOUT		9	// Request not received in time (daemon -d); the connection closes
+
+struct otpHeader {
+	uint8_t opcode;
+	uint8_t flags;
+	uint8_t status;
+	uint8_t alphabet;
+	uint32_t tag;
+	uint32_t aux;
+	uint64_t payloadLen;
+	uint64_t keyLen;
+};
+
+// Header encoding
+void otpPackHeader(const struct otpHeader *hdr, unsigned char *out);
+int otpUnpackHeader(const unsigned char *in, struct otpHeader *hdr);
+int otpIsBinary(const unsigned char *in, size_t len);
+const char *otpStatusString(int status);
+
+// Blocking socket helpers. Return bytes moved, 0 on EOF (recv) or -1 on error.
+ssize_t sendAll(int fd, const void *buf, size_t len);
+ssize_t recvAll(int fd, void *buf, size_t len);
+int otpSendHeader(int fd, const struct otpHeader *hdr);
+int otpRecvHeader(int fd, struct otpHeader *hdr);
+int otpSendFrame(int fd, const struct otpHeader *hdr, const void *payload, size_t payloadLen,
+		const void *key, size_t keyLen);
+
+// Legacy sentinel protocol
+char *otpRecvSentinel(int fd, size_t *len);
+
+// Monotonic clock in microseconds, for timeouts and timings on either side
+uint64_t otpNowUsec(void);
+
+#endif
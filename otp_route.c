@@ -0,0 +1,398 @@
+/* Author: Brad Powell
+ * Date: 6/27/2019
+ * otp_route: Sharing requests between several daemons
+ * A server argument may list daemons separated by commas, ports and unix sockets mixed, such as
+ * "7000,7001,/run/otp.sock", so one client can spread its work over a daemon per core or NUMA
+ * node. Each request goes to one of them, picked by the route:
+ *   least	the daemon with the fewest requests outstanding from this process (the default)
+ *   hash	rendezvous hashing on the request's key: its pad for a pad reference, otherwise its
+ *		routeKey (the client uses the text's file name). Requests on a pad keep going to the
+ *		daemon that has its pages cached, and adding or removing a daemon only moves the
+ *		requests that hash to it.
+ * A request whose daemon can't be reached, drops the connection, or refuses it for a reason of its
+ * own (wrong server, out of memory, busy, timed out) is sent to the next daemon it hasn't tried,
+ * in the order the route would have picked them. Only on its last daemon does a busy request wait
+ * and retry (otpRetryBusy). A daemon that can't be reached is passed over by other requests for
+ * DOWN_USEC. Requests bound for the same daemon share one pipelined connection, the daemons are
+ * worked at the same time, one thread each, and connections are kept afterwards for reuse.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "otp_proto.h"
+#include "otp_codec.h"
+#include "otp_client.h"
+
+#define IDLE_CONNS	32		// Connections kept per daemon between uses
+#define DOWN_USEC	1000000		// How long an unreachable daemon is passed over
+
+struct endpoint {
+	char *name;		// Port or unix socket path, as for otpConnectTo
+	uint64_t seed;		// Hash of the name, for rendezvous hashing
+	unsigned outstanding;	// Requests sent to it and not yet answered
+	uint64_t downUntil;	// usec; passed over until then
+	int idle[IDLE_CONNS];
+	int numIdle;
+};
+
+struct otpEndpoints {
+	int route;		// OTP_ROUTE_*
+	int num;
+	struct endpoint ep[OTP_MAX_ENDPOINTS];
+	pthread_mutex_t lock;
+};
+
+// The requests of one round that go to one daemon
+struct group {
+	struct otpEndpoints *eps;
+	int which, opcode;
+	uint32_t features;
+	int last;		// No daemon left to fail over to: wait out busy refusals here
+	int *index;		// Into the caller's jobs
+	struct otpJob *jobs;	// Copies of them, sent as one pipeline
+	int num;
+	int err;		// errno, if the connection failed
+	pthread_t tid;
+};
+
+// Final mix of splitmix64: spreads every input bit over the whole word
+static uint64_t mix(uint64_t x) {
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+// Routing key of a string, such as a file name (FNV-1a)
+uint64_t otpRouteKey(const char *s) {
+	uint64_t h = 0xcbf29ce484222325ULL;
+	while (*s) h = (h ^ (unsigned char)*s++) * 0x100000001b3ULL;
+	return h;
+}
+
+int otpRouteByName(const char *name) {
+	if (strcmp(name, "least") == 0) return OTP_ROUTE_LEAST;
+	if (strcmp(name, "hash") == 0) return OTP_ROUTE_HASH;
+	return -1;
+}
+
+static uint64_t jobKey(const struct otpJob *job) {
+	return mix(job->key == NULL ? job->padId : job->routeKey);
+}
+
+// Parse a comma separated list of daemons. Returns NULL with errno EINVAL if an entry is empty or
+// there are more than OTP_MAX_ENDPOINTS, or ENOMEM.
+struct otpEndpoints *otpEndpointsNew(const char *list, int route) {
+	struct otpEndpoints *eps = calloc(1, sizeof(*eps));
+	const char *end;
+	size_t len;
+
+	if (eps == NULL) return NULL;
+	eps->route = route;
+	pthread_mutex_init(&eps->lock, NULL);
+	do {
+		end = strchr(list, ',');
+		len = end ? (size_t)(end - list) : strlen(list);
+		if (len == 0 || eps->num == OTP_MAX_ENDPOINTS) {
+			otpEndpointsFree(eps);
+			errno = EINVAL;
+			return NULL;
+		}
+		if ((eps->ep[eps->num].name = strndup(list, len)) == NULL) {
+			otpEndpointsFree(eps);
+			errno = ENOMEM;
+			return NULL;
+		}
+		eps->ep[eps->num].seed = otpRouteKey(eps->ep[eps->num].name);
+		eps->num++;
+		list = end + 1;
+	} while (end != NULL);
+	return eps;
+}
+
+// Close the kept connections and release the list
+void otpEndpointsFree(struct otpEndpoints *eps) {
+	int i, j;
+	for (i = 0; i < eps->num; i++) {
+		for (j = 0; j < eps->ep[i].numIdle; j++) close(eps->ep[i].idle[j]);
+		free(eps->ep[i].name);
+	}
+	pthread_mutex_destroy(&eps->lock);
+	free(eps);
+}
+
+int otpEndpointsCount(const struct otpEndpoints *eps) {
+	return eps->num;
+}
+
+const char *otpEndpointName(const struct otpEndpoints *eps, int which) {
+	return eps->ep[which].name;
+}
+
+// Nonzero if every daemon in the list is on a unix socket
+int otpEndpointsLocal(const struct otpEndpoints *eps) {
+	int i;
+	for (i = 0; i < eps->num; i++) {
+		if (strchr(eps->ep[i].name, '/') == NULL) return 0;
+	}
+	return 1;
+}
+
+// Pick the daemon for a request with routing key 'key' from those not in 'tried', passing over
+// the ones that are down while any other is left, and count the request against it. Lock held.
+// Returns its index, or -1 if every daemon has been tried.
+static int pick(struct otpEndpoints *eps, uint64_t key, uint64_t tried) {
+	uint64_t now = otpNowUsec(), score, bestScore = 0;
+	int i, best = -1, bestDown = 1, down;
+
+	for (i = 0; i < eps->num; i++) {
+		if (tried & (1ULL << i)) continue;
+		down = eps->ep[i].downUntil > now;
+		if (eps->route == OTP_ROUTE_HASH) score = mix(eps->ep[i].seed ^ key);
+		else score = ~(uint64_t)eps->ep[i].outstanding;
+		if (best < 0 || down < bestDown || (down == bestDown && score > bestScore)) {
+			best = i;
+			bestScore = score;
+			bestDown = down;
+		}
+	}
+	if (best >= 0) eps->ep[best].outstanding++;
+	return best;
+}
+
+// A kept connection to daemon 'which' if 'reuse', or a new one; '*reused' says which it was. A
+// kept connection the daemon has since closed (its idle timeout, or a restart) reads as ready, and
+// is dropped. Returns -1 if the daemon can't be reached, after marking it down.
+static int takeConn(struct otpEndpoints *eps, int which, int reuse, int *reused) {
+	struct endpoint *ep = &eps->ep[which];
+	struct pollfd pfd;
+	int fd;
+
+	pthread_mutex_lock(&eps->lock);
+	while (reuse && ep->numIdle > 0) {
+		pfd.fd = ep->idle[--ep->numIdle];
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, 0) == 0) {
+			pthread_mutex_unlock(&eps->lock);
+			*reused = 1;
+			return pfd.fd;
+		}
+		close(pfd.fd);
+	}
+	pthread_mutex_unlock(&eps->lock);
+	*reused = 0;
+
+	if ((fd = otpConnectTo(ep->name)) < 0) {
+		pthread_mutex_lock(&eps->lock);
+		ep->downUntil = otpNowUsec() + DOWN_USEC;
+		pthread_mutex_unlock(&eps->lock);
+	}
+	return fd;
+}
+
+// 'done' requests to daemon 'which' are over. 'fd' is kept for reuse if 'keep', or closed.
+static void giveConn(struct otpEndpoints *eps, int which, int fd, int keep, unsigned done) {
+	struct endpoint *ep = &eps->ep[which];
+
+	pthread_mutex_lock(&eps->lock);
+	ep->outstanding -= done;
+	if (fd >= 0 && keep && ep->numIdle < IDLE_CONNS) {
+		ep->idle[ep->numIdle++] = fd;
+		fd = -1;
+	}
+	pthread_mutex_unlock(&eps->lock);
+	if (fd >= 0) close(fd);
+}
+
+// Connect for one request with routing key 'key' to the daemon the route picks from those not in
+// '*tried', moving on to the next while they can't be reached. Each daemon tried is added to
+// '*tried', and the one connected to is left in '*which'; hand the connection back with
+// otpEndpointRelease. Returns the socket, or -1 once every daemon has been tried.
+int otpEndpointConnect(struct otpEndpoints *eps, uint64_t key, uint64_t *tried, int *which) {
+	int fd = -1, err = ECONNREFUSED, reused;
+
+	key = mix(key);
+	while (fd < 0) {
+		pthread_mutex_lock(&eps->lock);
+		*which = pick(eps, key, *tried);
+		pthread_mutex_unlock(&eps->lock);
+		if (*which < 0) {
+			errno = err;
+			return -1;
+		}
+		*tried |= 1ULL << *which;
+		if ((fd = takeConn(eps, *which, 1, &reused)) < 0) {
+			err = errno;
+			giveConn(eps, *which, -1, 0, 1);
+		}
+	}
+	return fd;
+}
+
+// The request on 'fd', from otpEndpointConnect, is over. The connection is kept for another if
+// 'keep' (it is in step with the daemon), otherwise closed.
+void otpEndpointRelease(struct otpEndpoints *eps, int which, int fd, int keep) {
+	giveConn(eps, which, fd, keep, 1);
+}
+
+// Worth another daemon: it failed to answer, or refused for a reason that is its own and not the
+// request's
+static int failover(int status) {
+	return status == -1 || status == OTP_ST_WRONG_SERVER || status == OTP_ST_NO_MEMORY ||
+			status == OTP_ST_BUSY || status == OTP_ST_TIMEOUT;
+}
+
+// Send the group's first 'num' jobs as a pipeline over 'fd', packing them if the daemon agrees to.
+// Returns 1 if the connection is left in step with the daemon, or 0 with g->err set.
+static int sendGroup(struct group *g, int fd, int num) {
+	int granted = 0, i;
+
+	if (g->features && (granted = otpHello(fd, g->features)) < 0) {
+		g->err = errno;
+		return 0;
+	}
+	for (i = 0; i < num; i++) {
+		if (!(granted & OTP_FEAT_PACKED) || g->jobs[i].alphabet != OTP_ALPHA_LETTERS) {
+			free(g->jobs[i].wire);	// Packed for a daemon that agreed, and this one doesn't
+			g->jobs[i].wire = NULL;
+		} else if (g->jobs[i].wire == NULL && otpPackJob(&g->jobs[i]) < 0) {
+			g->jobs[i].wire = NULL;	// Out of memory: send it as it is
+		}
+	}
+	if (otpPipeline(fd, g->opcode, g->jobs, num) == 0 &&
+			(!g->last || otpRetryBusy(fd, g->opcode, g->jobs, num, OTP_BUSY_RETRIES) == 0))
+		return 1;
+	g->err = errno ? errno : EPIPE;
+	return 0;
+}
+
+// Move the group's jobs the daemon never answered to the front, their indexes with them. Returns
+// how many there are.
+static int unanswered(struct group *g) {
+	struct otpJob job;
+	int n = 0, i, index;
+
+	for (i = 0; i < g->num; i++) {
+		if (g->jobs[i].status != -1) continue;
+		job = g->jobs[n];
+		g->jobs[n] = g->jobs[i];
+		g->jobs[i] = job;
+		index = g->index[n];
+		g->index[n++] = g->index[i];
+		g->index[i] = index;
+	}
+	return n;
+}
+
+// Send one group over a connection to its daemon. A kept connection may have been closed by the
+// daemon as it was reused, between requests (its idle timeout, or a drain for a restart: see
+// otp_server.h), so the jobs it never answered get one more try on a new connection.
+static void *runGroup(void *arg) {
+	struct group *g = arg;
+	int fd, reused, ok, num, i;
+
+	for (i = 0; i < g->num; i++) g->jobs[i].status = -1;
+	if ((fd = takeConn(g->eps, g->which, 1, &reused)) < 0) {
+		g->err = errno;
+		giveConn(g->eps, g->which, -1, 0, g->num);
+		return NULL;
+	}
+	ok = sendGroup(g, fd, g->num);
+	if (!ok && reused && (num = unanswered(g)) > 0) {
+		close(fd);
+		if ((fd = takeConn(g->eps, g->which, 0, &reused)) >= 0) {
+			g->err = 0;
+			ok = sendGroup(g, fd, num);
+		}
+	}
+	giveConn(g->eps, g->which, fd, ok, g->num);
+	return NULL;
+}
+
+// otpPipeline over a list of daemons: share 'jobs' out between them by the route, and send each
+// job the daemons it couldn't get an answer from on to another (see above). With 'features', ask
+// every connection for those OTP_FEAT_*; a daemon granting OTP_FEAT_PACKED gets its letters jobs
+// packed. Returns 0 once every job has a status, or -1 with errno if any was left without one.
+int otpRoute(struct otpEndpoints *eps, int opcode, struct otpJob *jobs, int numJobs, uint32_t features) {
+	struct group groups[OTP_MAX_ENDPOINTS];
+	struct otpJob *copies = malloc(numJobs * sizeof(*copies));
+	uint64_t *tried = calloc(numJobs, sizeof(*tried));
+	int *index = malloc(numJobs * sizeof(*index));
+	int *which = malloc(numJobs * sizeof(*which));
+	int round, threads, pending, i, e, n, err = 0, ret = 0;
+	struct group *g;
+
+	if (copies == NULL || tried == NULL || index == NULL || which == NULL) {
+		err = ENOMEM;
+		numJobs = 0;
+		ret = -1;
+	}
+	for (i = 0; i < numJobs; i++) jobs[i].status = -1;
+
+	// Each round tries every job still in want of an answer on one more daemon
+	for (round = 0; round < eps->num; round++) {
+		memset(groups, 0, sizeof(groups));
+		pthread_mutex_lock(&eps->lock);
+		for (i = pending = 0; i < numJobs; i++) {
+			which[i] = -1;
+			if (!failover(jobs[i].status)) continue;
+			which[i] = pick(eps, jobKey(&jobs[i]), tried[i]);
+			tried[i] |= 1ULL << which[i];
+			groups[which[i]].num++;
+			pending++;
+		}
+		pthread_mutex_unlock(&eps->lock);
+		if (pending == 0) break;
+
+		for (e = n = threads = 0; e < eps->num; e++) {
+			g = &groups[e];
+			g->eps = eps;
+			g->which = e;
+			g->opcode = opcode;
+			g->features = features;
+			g->last = round == eps->num - 1;
+			g->index = index + n;
+			g->jobs = copies + n;
+			n += g->num;
+			threads += g->num > 0;
+			g->num = 0;
+		}
+		for (i = 0; i < numJobs; i++) {
+			if (which[i] < 0) continue;
+			g = &groups[which[i]];
+			g->index[g->num] = i;
+			g->jobs[g->num++] = jobs[i];
+		}
+		// One daemon is served from this thread; several at once, a thread each
+		for (e = 0; e < eps->num; e++) {
+			g = &groups[e];
+			if (g->num == 0) continue;
+			if (threads == 1 || pthread_create(&g->tid, NULL, runGroup, g) != 0) {
+				runGroup(g);
+				g->num = -g->num;	// Done already
+			}
+		}
+		if (threads > 1) otpPhase(OTP_CPHASE_PARALLEL);
+		for (e = 0; e < eps->num; e++) {
+			g = &groups[e];
+			if (g->num > 0) pthread_join(g->tid, NULL);
+			if (g->num < 0) g->num = -g->num;
+			for (i = 0; i < g->num; i++) jobs[g->index[i]] = g->jobs[i];
+			if (g->err) err = g->err;
+		}
+	}
+	for (i = 0; i < numJobs; i++) {
+		if (jobs[i].status < 0) ret = -1;
+	}
+	free(copies);
+	free(tried);
+	free(index);
+	free(which);
+	errno = err;
+	return ret;
+}
@@ -0,0 +1,1125 @@
+/* Author: Brad Powell
+ * Date: 6/14/2019
+ * otp_server: Listening socket and serving engines shared by otp_d, otp_enc_d and otp_dec_d
+ * Every engine drives the same otpSession state machine; they only differ in how connections are
+ * spread over processes and threads. See otp_server.h for the options.
+ */
+
+#define _GNU_SOURCE	// accept4, sched_setaffinity
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "otp_keystore.h"
+#include "otp_stats.h"
+#include "otp_uring.h"
+#include "otp_server.h"
+
+static const struct otpService *service;	// What this daemon serves
+static int listenFDs[2];			// TCP port, then the unix socket if -u was given
+static int numListeners;
+static int shedding;				// -q on a blocking engine: see shedPoll
+static int saturatedFD = -1;			// Written by the worker that takes the last free slot
+static int drainFD = -1;			// -H: readable once a successor has taken over (see Handoff)
+static int warmFD = -1;				// -H: a taking over worker writes a byte here once it is ready
+static int controlFD = -1;			// -H: where successors connect, in the first process only
+static int handoffConn = -1;			// -H: connection to a successor or the predecessor, likewise
+
+static void usage(const char *prog) {
+	fprintf(stderr, "USAGE: %s [-e fork|prefork|thread|epoll|uring] [-w workers] [-b backlog] [-k pad ...] "
+			"[-u socket] [-t threads]\n       [-q requests] [-r retry_ms] [-i idle_ms] [-d deadline_ms] "
+			"[-s shards] [-c cpus]\n       [-H handoff_socket] port\n", prog);
+	exit(1);
+}
+
+static void error(const char *msg) { perror(msg); exit(1); }	// Error function for reporting issues
+
+// The daemon has handed over to a successor (-H): take no more connections
+static int drained(void) {
+	struct pollfd pfd = { drainFD, POLLIN, 0 };
+	return drainFD >= 0 && poll(&pfd, 1, 0) > 0;
+}
+
+// Milliseconds a drained process may still wait on its connections: OTP_DRAIN_MAX_MS from its
+// first call, which is made as the drain is seen
+static int drainLeftMs(void) {
+	static uint64_t until;
+	uint64_t now = otpNowUsec();
+
+	if (until == 0) until = now + OTP_DRAIN_MAX_MS * 1000ULL;
+	return now >= until ? 0 : (int)((until - now + 999) / 1000);
+}
+
+// Reap a child, blocking. With -H it returns 0 after OTP_DRAIN_SWEEP_MS, or at once once drained,
+// so the caller sees the drain even while every child is busy.
+static pid_t waitChild(void) {
+	struct pollfd pfd = { drainFD, POLLIN, 0 };
+	pid_t pid;
+
+	if (drainFD < 0) return waitpid(-1, NULL, 0);
+	if ((pid = waitpid(-1, NULL, WNOHANG)) == 0) poll(&pfd, 1, OTP_DRAIN_SWEEP_MS);
+	return pid;
+}
+
+// Once drained, wait for this process's children to finish, up to the drain limit. Any still
+// running then die with it (PR_SET_PDEATHSIG).
+static void drainChildren(void) {
+	pid_t pid;
+
+	while (drainLeftMs() > 0) {
+		if ((pid = waitpid(-1, NULL, WNOHANG)) < 0 && errno != EINTR) return;	// None left
+		if (pid <= 0) usleep(10 * 1000);
+	}
+}
+
+// A worker of a daemon taking over (-H) is ready for traffic: its transform pool is started, and
+// the successor is told it may go ahead once every worker has said so. Each thread counts once,
+// however many engines it runs (uring falling back to epoll).
+static void warmed(void) {
+	static __thread int done;
+
+	if (warmFD < 0 || done) return;
+	done = 1;
+	otpPoolWarm();
+	if (write(warmFD, "", 1) < 0) return;	// Non-blocking; extra bytes from replaced workers don't matter
+}
+
+// A forked worker or shard doesn't answer successors, nor hold their connections open: each end
+// of one watches for the other's EOF
+static void handoffChild(void) {
+	if (controlFD >= 0) close(controlFD);
+	if (handoffConn >= 0) close(handoffConn);
+	controlFD = handoffConn = -1;
+}
+
+/************** Blocking engines ************************/
+
+// recv that also takes a descriptor passed along with the data (SCM_RIGHTS, unix socket only)
+// and hands it to the session, for memfd requests
+static ssize_t recvWithFD(int fd, char *buf, size_t len, struct otpSession *s, int flags) {
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	struct iovec iov;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	int passed;
+	ssize_t n;
+
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC | flags);
+	cmsg = (n >= 0) ? CMSG_FIRSTHDR(&msg) : NULL;
+	if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+		memcpy(&passed, CMSG_DATA(cmsg), sizeof(passed));
+		sessionReceivedFD(s, passed);
+	}
+	return n;
+}
+
+// With timeouts set, or a drain to watch for (-H), wait for the socket in poll for no longer than
+// the session allows, and tell the session if that runs out or the drain starts. Returns 1 once
+// 'fd' is ready (or there is nothing to watch, and the call may block), 0 if the session expired
+// or is draining instead, and should be looked at again.
+static int waitConn(int fd, short events, struct otpSession *s) {
+	struct pollfd pfd[2] = { { fd, events, 0 }, { drainFD, POLLIN, 0 } };
+	int watchDrain = drainFD >= 0 && !s->draining;
+	int ms, n;
+
+	while ((ms = sessionTimeout(s, otpNowUsec())) != 0) {
+		if (ms < 0 && !watchDrain) return 1;
+		n = poll(pfd, watchDrain ? 2 : 1, ms);
+		if (n > 0 && watchDrain && pfd[1].revents) {
+			sessionDrain(s);
+			return 0;
+		}
+		if (n > 0 || (n < 0 && errno != EINTR)) return 1;	// An error shows up in the call itself
+	}
+	sessionExpired(s);
+	return 0;
+}
+
+// Run one connection to completion with blocking I/O, then close it. With timeouts the socket is
+// only used once poll says it is ready, and without blocking, so a stalled client can't hold the
+// worker past its time.
+static void serveConnection(int fd) {
+	struct otpSession s;
+	struct iovec iov[2];
+	struct msghdr msg;
+	char *buf;
+	size_t space;
+	ssize_t n;
+	int dontWait = sessionSweepMs() >= 0 ? MSG_DONTWAIT : 0;
+
+	if (otpStatsConnOpen() && saturatedFD >= 0) eventfd_write(saturatedFD, 1);	// Wake the shedder
+	sessionInit(&s, service);
+	while (!sessionDone(&s)) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		if ((msg.msg_iovlen = sessionOutput(&s, iov)) > 0) {
+			if (!waitConn(fd, POLLOUT, &s)) continue;
+			n = sendmsg(fd, &msg, MSG_NOSIGNAL | dontWait);
+			if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) continue;
+			if (n < 0) break;
+			sessionSent(&s, n);
+			continue;
+		}
+		if ((space = sessionReadSpace(&s, &buf)) == 0) {
+			sessionWait(&s);
+			continue;
+		}
+		if (!waitConn(fd, POLLIN, &s)) continue;
+		n = recvWithFD(fd, buf, space, &s, dontWait);
+		if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) continue;
+		if (n < 0) break;
+		if (n == 0) sessionEOF(&s);
+		else sessionReceived(&s, n);
+	}
+	sessionFree(&s);
+	close(fd);
+	otpStatsConnClose();
+}
+
+// Take the next connection. With one listener that is a plain blocking accept; with two, or when
+// the shedder or a successor (-H) may take connections too, wait in poll. The listeners are
+// non-blocking then, so a worker that loses the race for a connection just goes back to waiting.
+// Returns the socket, or -1 with errno set: ESHUTDOWN once drained.
+static int acceptNext(void) {
+	struct pollfd pfd[3];
+	int i, fd;
+
+	if (numListeners == 1 && !shedding && drainFD < 0) return accept(listenFDs[0], NULL, NULL);
+	for (i = 0; i < numListeners; i++) {
+		pfd[i].fd = listenFDs[i];
+		pfd[i].events = POLLIN;
+	}
+	pfd[i].fd = drainFD;	// Ignored if -1
+	pfd[i].events = POLLIN;
+	if (poll(pfd, numListeners + 1, -1) < 0) return -1;
+	if (pfd[numListeners].revents) {
+		errno = ESHUTDOWN;
+		return -1;
+	}
+	for (i = 0; i < numListeners; i++) {
+		if (!(pfd[i].revents & POLLIN)) continue;
+		if ((fd = accept(listenFDs[i], NULL, NULL)) >= 0) return fd;
+		if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+	}
+	errno = EAGAIN;
+	return -1;
+}
+
+// Body of a prefork or thread worker: take connections off the shared accept queue until drained
+static void acceptLoop(void) {
+	int estConnFD;
+	warmed();
+	while (1) {
+		estConnFD = acceptNext();
+		if (estConnFD < 0) {
+			if (errno == ESHUTDOWN) return;
+			if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) {
+				fprintf(stderr, "ERROR on accept\n");
+				OTP_STAT_ADD(acceptErrors, 1);
+			}
+			continue;
+		}
+		OTP_STAT_ADD(accepted, 1);
+		serveConnection(estConnFD);
+	}
+}
+
+static void *threadWorker(void *unused) {
+	(void)unused;
+	acceptLoop();
+	return NULL;
+}
+
+static void shedInit(void);
+static void shedChild(void);
+static int shedPoll(int accepting, int saturated);
+static void drainWait(void);
+
+// One child per connection. When every slot is busy the parent blocks in waitpid until a child
+// finishes, rather than polling; when shedding, it waits in shedPoll instead, which turns away
+// what arrives meanwhile and wakes up as soon as a child exits.
+static void runFork(int workers) {
+	int estConnFD, numChild = 0, i;
+	pid_t spawnid;
+
+	warmed();
+	while (!drained()) {
+		while (numChild > 0 && waitpid(-1, NULL, WNOHANG) > 0) numChild--;
+		if (shedding) {
+			if ((estConnFD = shedPoll(1, numChild >= workers)) < 0) continue;
+		} else {
+			if (numChild >= workers && waitChild() > 0) numChild--;
+			if (numChild >= workers) continue;
+			estConnFD = acceptNext();
+		}
+		if (estConnFD < 0) {
+			if (errno != EINTR && errno != ESHUTDOWN && errno != EAGAIN && errno != EWOULDBLOCK) {
+				fprintf(stderr, "ERROR on accept\n");
+				OTP_STAT_ADD(acceptErrors, 1);
+			}
+			continue;
+		}
+		OTP_STAT_ADD(accepted, 1);
+		spawnid = fork();
+		switch (spawnid) {
+			case -1:
+				fprintf(stderr, "ERROR fork failed\n");
+				OTP_STAT_ADD(forkErrors, 1);
+				break;
+			case 0:		// Child (serving) process
+				for (i = 0; i < numListeners; i++) close(listenFDs[i]);
+				shedChild();
+				handoffChild();
+				if (drainFD >= 0) prctl(PR_SET_PDEATHSIG, SIGTERM);	// Bounded by the drain limit
+				serveConnection(estConnFD);
+				exit(0);
+			default:	// Parent (listening) process
+				numChild++;
+		}
+		close(estConnFD);	// Child has its own copy
+	}
+	drainChildren();
+}
+
+static pid_t spawnWorker(void) {
+	pid_t parent = getpid();
+	pid_t pid = fork();
+	if (pid == 0) {
+		// Go down with the parent, so stopping the daemon stops the whole pool
+		prctl(PR_SET_PDEATHSIG, SIGTERM);
+		if (getppid() != parent) exit(0);
+		shedChild();
+		handoffChild();
+		acceptLoop();
+		exit(0);
+	}
+	if (pid < 0) fprintf(stderr, "ERROR fork failed\n");
+	return pid;
+}
+
+// 'workers' processes share the listening socket; the kernel hands each connection to one of
+// the processes blocked in accept. The parent only replaces workers that die, and sheds load
+// while they are all busy. Once drained it waits for them to finish.
+static void runPrefork(int workers) {
+	int running = 0;
+	while (!drained()) {
+		while (running < workers) {
+			if (spawnWorker() < 0) { sleep(1); break; }
+			running++;
+		}
+		if (shedding) {
+			shedPoll(0, otpStatsSaturated());
+			while (running > 0 && waitpid(-1, NULL, WNOHANG) > 0) running--;
+		} else if (waitChild() > 0) {
+			running--;
+		}
+	}
+	drainChildren();
+}
+
+// 'workers' threads share the listening socket, the calling thread being one of them, or the
+// shedder if there is one
+static void runThreads(int workers) {
+	pthread_t tid;
+	int i;
+	for (i = shedding ? 0 : 1; i < workers; i++) {
+		if (pthread_create(&tid, NULL, threadWorker, NULL) != 0) error("ERROR creating thread");
+		pthread_detach(tid);
+	}
+	if (!shedding) acceptLoop();
+	while (!drained()) shedPoll(0, otpStatsSaturated());
+	drainWait();	// The other workers are threads of this process
+}
+
+/************** Event loop engine ************************/
+
+struct eventConn {
+	int fd;
+	uint32_t events;	// Currently registered interest
+	int shed;		// Taken in past the worker limit; not counted as open
+	struct eventConn *prev, *next;	// Every connection of this loop, for the timeout sweep
+	struct otpSession s;
+};
+
+static struct eventConn *eventConns;
+
+static void closeEventConn(struct eventConn *c) {
+	close(c->fd);	// Also drops it from the epoll set
+	sessionFree(&c->s);
+	if (c->prev != NULL) c->prev->next = c->next;
+	else eventConns = c->next;
+	if (c->next != NULL) c->next->prev = c->prev;
+	if (!c->shed) otpStatsConnClose();
+	free(c);
+}
+
+// Start serving the non-blocking socket 'fd' on the loop 'epollFD'
+static void addEventConn(int epollFD, int fd, int shed) {
+	struct epoll_event ev;
+	struct eventConn *c = malloc(sizeof(*c));
+
+	if (c == NULL) { close(fd); return; }
+	if (!shed) otpStatsConnOpen();
+	c->fd = fd;
+	c->events = EPOLLIN;
+	c->shed = shed;
+	c->prev = NULL;
+	c->next = eventConns;
+	if (eventConns != NULL) eventConns->prev = c;
+	eventConns = c;
+	sessionInit(&c->s, service);
+	if (shed) sessionShed(&c->s);
+	ev.events = EPOLLIN;
+	ev.data.ptr = c;
+	if (epoll_ctl(epollFD, EPOLL_CTL_ADD, fd, &ev) < 0) closeEventConn(c);
+}
+
+// Move a connection along as far as it will go without blocking. Each call does a bounded
+// amount of work so one large request can't starve the others.
+static void eventConnReady(int epollFD, struct eventConn *c) {
+	struct iovec iov[2];
+	struct msghdr msg;
+	struct epoll_event ev;
+	char *buf;
+	size_t space;
+	ssize_t n;
+	int ops;
+
+	for (ops = 0; ops < 16 && !sessionDone(&c->s); ops++) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		if ((msg.msg_iovlen = sessionOutput(&c->s, iov)) > 0) {
+			n = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+			if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+			if (n < 0 && errno == EINTR) continue;
+			if (n < 0) { closeEventConn(c); return; }
+			sessionSent(&c->s, n);
+			continue;
+		}
+		if ((space = sessionReadSpace(&c->s, &buf)) == 0) {
+			sessionWait(&c->s);
+			continue;
+		}
+		n = recvWithFD(c->fd, buf, space, &c->s, 0);
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0) { closeEventConn(c); return; }
+		if (n == 0) sessionEOF(&c->s);
+		else sessionReceived(&c->s, n);
+	}
+	if (sessionDone(&c->s)) {
+		closeEventConn(c);
+		return;
+	}
+
+	// Wait for whichever direction the session needs next. Output still being transformed by the
+	// pool counts as writing: nothing else would wake the loop when it is done, so the next pass
+	// (as soon as the socket can take more) goes to sessionWait.
+	ev.events = sessionReadSpace(&c->s, &buf) == 0 ? EPOLLOUT : EPOLLIN;
+	if (ev.events != c->events) {
+		ev.data.ptr = c;
+		c->events = ev.events;
+		epoll_ctl(epollFD, EPOLL_CTL_MOD, c->fd, &ev);
+	}
+}
+
+// Expire every connection whose time is up; each gets one more pass to send its refusal
+static void eventSweep(int epollFD) {
+	struct eventConn *c, *next;
+	uint64_t now = otpNowUsec();
+
+	for (c = eventConns; c != NULL; c = next) {
+		next = c->next;
+		if (sessionTimeout(&c->s, now) != 0) continue;
+		sessionExpired(&c->s);
+		eventConnReady(epollFD, c);
+	}
+}
+
+// Accept everything that is waiting on every listener and register it for reading
+static void eventAccept(int epollFD) {
+	int estConnFD, i;
+
+	for (i = 0; i < numListeners; i++) {
+		while ((estConnFD = accept4(listenFDs[i], NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+			OTP_STAT_ADD(accepted, 1);
+			addEventConn(epollFD, estConnFD, 0);
+		}
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+			fprintf(stderr, "ERROR on accept\n");
+			OTP_STAT_ADD(acceptErrors, 1);
+		}
+	}
+}
+
+// Handing over: stop accepting, and close every connection that is between requests. A new one
+// that has sent nothing is closed by the sweep if it doesn't start a request soon.
+static void eventDrain(int epollFD) {
+	struct eventConn *c, *next;
+	int i;
+
+	drainLeftMs();		// Starts the clock
+	for (i = 0; i < numListeners; i++) epoll_ctl(epollFD, EPOLL_CTL_DEL, listenFDs[i], NULL);
+	epoll_ctl(epollFD, EPOLL_CTL_DEL, drainFD, NULL);
+	for (c = eventConns; c != NULL; c = next) {
+		next = c->next;
+		sessionDrain(&c->s);
+		if (sessionDone(&c->s)) closeEventConn(c);
+	}
+}
+
+static void runEpoll(void) {
+	struct epoll_event ev, events[64];
+	int epollFD, n, i, drainNow, draining = 0;
+	int sweep = sessionSweepMs();
+	uint64_t nextSweep = 0;
+
+	epollFD = epoll_create1(0);
+	if (epollFD < 0) error("ERROR creating epoll instance");
+	for (i = 0; i < numListeners; i++) {
+		fcntl(listenFDs[i], F_SETFL, fcntl(listenFDs[i], F_GETFL) | O_NONBLOCK);
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;		// NULL marks a listening socket
+		if (epoll_ctl(epollFD, EPOLL_CTL_ADD, listenFDs[i], &ev) < 0) error("ERROR on epoll_ctl");
+	}
+	if (drainFD >= 0) {
+		ev.events = EPOLLIN;
+		ev.data.ptr = &drainFD;
+		if (epoll_ctl(epollFD, EPOLL_CTL_ADD, drainFD, &ev) < 0) error("ERROR on epoll_ctl");
+	}
+	warmed();
+
+	while (!draining || (eventConns != NULL && drainLeftMs() > 0)) {
+		n = epoll_wait(epollFD, events, 64, sweep);
+		drainNow = 0;
+		for (i = 0; i < n; i++) {
+			if (events[i].data.ptr == NULL) eventAccept(epollFD);
+			else if (events[i].data.ptr == &drainFD) drainNow = 1;
+			else eventConnReady(epollFD, events[i].data.ptr);
+		}
+		if (drainNow) {		// After the batch, which may name connections it closes
+			eventDrain(epollFD);
+			draining = 1;
+			if (sweep < 0 || sweep > OTP_DRAIN_SWEEP_MS) sweep = OTP_DRAIN_SWEEP_MS;
+		}
+		if (sweep >= 0 && otpNowUsec() >= nextSweep) {
+			eventSweep(epollFD);
+			nextSweep = otpNowUsec() + sweep * 1000ULL;
+		}
+	}
+	while (eventConns != NULL) closeEventConn(eventConns);	// Out of time
+}
+
+/************** Load shedding ************************/
+
+// With -q, a blocking engine doesn't leave connections in the listen queue while every worker is
+// busy. The process (or thread) managing the workers takes them in itself and serves them on a
+// small event loop whose sessions refuse every request as busy (sessionShed), so the clients hear
+// at once that they should come back later or go elsewhere. It only watches the listeners while
+// the daemon is saturated; the worker that takes the last free slot wakes it through an eventfd.
+
+#define SHED_SWEEP_MS	1000	// How often shed connections are checked for timeouts
+
+static int shedEpollFD = -1;
+static int shedWatching;	// The listeners are in the shed epoll set
+static sigset_t waitMask;	// Mask while waiting: SIGCHLD is blocked everywhere else, so it can only
+				// interrupt the wait, and a worker exiting is replaced at once
+
+static void onChild(int sig) { (void)sig; }
+
+static void shedInit(void) {
+	struct epoll_event ev;
+	struct sigaction sa;
+	sigset_t chld;
+	int i;
+
+	shedEpollFD = epoll_create1(EPOLL_CLOEXEC);
+	saturatedFD = eventfd(0, EFD_NONBLOCK);
+	if (shedEpollFD < 0 || saturatedFD < 0) error("ERROR setting up load shedding");
+	ev.events = EPOLLIN;
+	ev.data.ptr = &saturatedFD;
+	if (epoll_ctl(shedEpollFD, EPOLL_CTL_ADD, saturatedFD, &ev) < 0) error("ERROR on epoll_ctl");
+	for (i = 0; i < numListeners; i++)	// See acceptNext
+		fcntl(listenFDs[i], F_SETFL, fcntl(listenFDs[i], F_GETFL) | O_NONBLOCK);
+	if (drainFD >= 0) {
+		ev.data.ptr = &drainFD;
+		if (epoll_ctl(shedEpollFD, EPOLL_CTL_ADD, drainFD, &ev) < 0) error("ERROR on epoll_ctl");
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = onChild;
+	sigaction(SIGCHLD, &sa, NULL);
+	sigemptyset(&chld);
+	sigaddset(&chld, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &chld, &waitMask);
+	sigdelset(&waitMask, SIGCHLD);
+}
+
+// A forked worker doesn't shed; it lets go of the shed connections and gets the usual signal
+// setup back
+static void shedChild(void) {
+	struct eventConn *c;
+	if (!shedding) return;
+	for (c = eventConns; c != NULL; c = c->next) close(c->fd);
+	close(shedEpollFD);
+	signal(SIGCHLD, SIG_DFL);
+	sigprocmask(SIG_SETMASK, &waitMask, NULL);
+}
+
+// One wait of the manager. Connections that arrive while the daemon is saturated are shed. With
+// 'accepting' (fork, whose parent takes every connection) the listeners are always watched and a
+// connection that arrives while not 'saturated' is returned to be served; otherwise they are
+// watched only while saturated, which is checked again before each accept. Returns a connection
+// or -1, also when interrupted by a child exiting.
+static int shedPoll(int accepting, int saturated) {
+	struct epoll_event ev, events[64];
+	eventfd_t wakes;
+	int n, i, j, fd;
+	int watch = accepting || saturated;
+
+	if (watch != shedWatching) {
+		for (i = 0; i < numListeners; i++) {
+			ev.events = EPOLLIN;
+			ev.data.ptr = NULL;
+			epoll_ctl(shedEpollFD, watch ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, listenFDs[i], &ev);
+		}
+		shedWatching = watch;
+	}
+	n = epoll_pwait(shedEpollFD, events, 64, eventConns != NULL ? SHED_SWEEP_MS : -1, &waitMask);
+	for (i = 0; i < n; i++) {
+		if (events[i].data.ptr == &saturatedFD) {
+			eventfd_read(saturatedFD, &wakes);	// The caller looks at the workers again
+		} else if (events[i].data.ptr == &drainFD) {
+			return -1;				// The caller sees it is drained
+		} else if (events[i].data.ptr != NULL) {
+			eventConnReady(shedEpollFD, events[i].data.ptr);
+		} else {
+			if (!accepting && !(saturated = otpStatsSaturated())) continue;
+			for (j = 0; j < numListeners; j++) {
+				if ((fd = accept(listenFDs[j], NULL, NULL)) < 0) continue;
+				if (!saturated) return fd;
+				OTP_STAT_ADD(shed, 1);
+				fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+				addEventConn(shedEpollFD, fd, 1);
+			}
+		}
+	}
+	eventSweep(shedEpollFD);
+	return -1;
+}
+
+/************** Sharding ************************/
+
+// With -s or -c the parent only supervises. Each shard is a process pinned to one CPU, running the
+// chosen engine on a TCP listener of its own: they are all bound to the same port with
+// SO_REUSEPORT, so the kernel spreads connections over the shards instead of queueing them all on
+// one socket. SO_INCOMING_CPU asks it to prefer the shard on the CPU that took the packet. The
+// listeners are opened in the parent, so a bad port fails at startup and a shard that dies can be
+// replaced without losing the connections queued on its socket. The unix socket, if any, stays
+// one listener shared by every shard.
+
+static int *shardFDs;	// Listener of each shard
+static int *shardCPUs;	// CPU each shard is pinned to
+
+// Parse a CPU list such as "0-3,8" into 'cpus' (room for CPU_SETSIZE). Returns how many, or -1.
+static int parseCPUs(const char *list, int *cpus) {
+	int n = 0, from, to;
+	char *end;
+
+	while (*list != '\0') {
+		from = to = strtol(list, &end, 10);
+		if (end == list || from < 0) return -1;
+		if (*end == '-') {
+			list = end + 1;
+			to = strtol(list, &end, 10);
+			if (end == list || to < from) return -1;
+		}
+		if (to >= CPU_SETSIZE || n + to - from + 1 > CPU_SETSIZE) return -1;
+		while (from <= to) cpus[n++] = from++;
+		if (*end == ',') end++;
+		else if (*end != '\0') return -1;
+		list = end;
+	}
+	return n > 0 ? n : -1;
+}
+
+// The CPUs this process may run on, into 'cpus'. Returns how many.
+static int allowedCPUs(int *cpus) {
+	cpu_set_t set;
+	int n = 0, i;
+	if (sched_getaffinity(0, sizeof(set), &set) < 0) return 0;
+	for (i = 0; i < CPU_SETSIZE; i++) {
+		if (CPU_ISSET(i, &set)) cpus[n++] = i;
+	}
+	return n;
+}
+
+// Every one of 'cpus' is one this process may run on
+static int cpusAllowed(const int *cpus, int n) {
+	cpu_set_t set;
+	int i;
+	if (sched_getaffinity(0, sizeof(set), &set) < 0) return 0;
+	for (i = 0; i < n; i++) {
+		if (!CPU_ISSET(cpus[i], &set)) return 0;
+	}
+	return 1;
+}
+
+static void runEngine(int engine, int workers);
+
+static pid_t spawnShard(int shard, int shards, int engine, int workers) {
+	pid_t parent = getpid();
+	pid_t pid = fork();
+	cpu_set_t set;
+	int i;
+
+	if (pid == 0) {
+		prctl(PR_SET_PDEATHSIG, SIGTERM);	// As spawnWorker
+		if (getppid() != parent) exit(0);
+		CPU_ZERO(&set);
+		CPU_SET(shardCPUs[shard], &set);
+		if (sched_setaffinity(0, sizeof(set), &set) < 0)
+			fprintf(stderr, "ERROR pinning shard %d to CPU %d\n", shard, shardCPUs[shard]);
+		setsockopt(shardFDs[shard], SOL_SOCKET, SO_INCOMING_CPU, &shardCPUs[shard], sizeof(int));
+		for (i = 0; i < shards; i++) {
+			if (i != shard) close(shardFDs[i]);
+		}
+		listenFDs[0] = shardFDs[shard];
+		handoffChild();
+		if (shedding) shedInit();
+		runEngine(engine, workers);
+		exit(0);
+	}
+	if (pid < 0) fprintf(stderr, "ERROR fork failed\n");
+	return pid;
+}
+
+// Start every shard, then replace any that exit until drained, and wait for them
+static void runShards(int shards, int engine, int workers) {
+	pid_t *pids = calloc(shards, sizeof(*pids));
+	pid_t pid;
+	int i;
+
+	if (pids == NULL) error("ERROR starting shards");
+	while (!drained()) {
+		for (i = 0; i < shards; i++) {
+			if (pids[i] <= 0) pids[i] = spawnShard(i, shards, engine, workers);
+		}
+		if ((pid = waitChild()) < 0) {
+			sleep(1);	// A fork failed; try again in a moment
+			continue;
+		}
+		for (i = 0; i < shards; i++) {
+			if (pids[i] == pid) pids[i] = 0;
+		}
+	}
+	drainChildren();
+	free(pids);
+}
+
+/************** Handoff ************************/
+
+// With -H the daemon listens on a unix socket at that path for its successor. A new daemon
+// started with the same -H connects there first and, if the old one answers, is sent its listening
+// sockets (SCM_RIGHTS) rather than binding its own. They are the same sockets, so connections
+// queued on them carry over and none are refused. The new daemon starts its workers on them,
+// alongside the old ones, and once every worker is up (its transform pool started) sends one byte.
+// The old daemon then drains: its workers stop accepting and close their connections once between
+// requests (sessionDrain), and it exits when the last is closed, or after OTP_DRAIN_MAX_MS. Its exit
+// closes the control connection, and the new daemon takes over the path for the next restart.
+
+#define DRAIN_GRACE_MS	100		// For every worker to see the drain before connections are counted
+#define WARM_MAX_MS	5000		// Longest a new daemon waits on its workers before taking over
+#define HANDOFF_MAX_FDS	64		// TCP listeners (one per shard) and the unix one
+
+struct handoffHello {	// Sent with the sockets
+	int numTCP;	// TCP listeners, first
+	int hasUnix;	// Then the unix socket's, if 1
+};
+
+static const char *handoffPath;
+static int *tcpFDs;		// This daemon's TCP listeners: listenFDs[0], or a shard's each
+static int numTCP;
+static int unixFD = -1;
+static int warmRead = -1;	// The other end of warmFD
+static int numWarm;		// Bytes expected on it: one per worker that calls warmed
+
+// Once drained, wait for the connections still open in any process of this daemon, then return
+static void drainWait(void) {
+	usleep(DRAIN_GRACE_MS * 1000);
+	while (drainLeftMs() > 0) {
+		if (otpStats == NULL || __atomic_load_n(&otpStats->open, __ATOMIC_RELAXED) == 0) return;
+		usleep(10 * 1000);
+	}
+}
+
+static int controlListen(void) {
+	struct sockaddr_un addr;
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	if (fd < 0) error("ERROR opening handoff socket");
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, handoffPath);
+	unlink(handoffPath);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) error("ERROR on binding handoff socket");
+	if (listen(fd, 4) < 0) error("ERROR on listen");
+	return fd;
+}
+
+// Send the listeners to a successor on 'fd'. Returns 0, or -1 if it went away.
+static int handoffSend(int fd) {
+	struct handoffHello hello = { numTCP, unixFD >= 0 };
+	union { struct cmsghdr align; char buf[CMSG_SPACE(HANDOFF_MAX_FDS * sizeof(int))]; } control;
+	struct iovec iov = { &hello, sizeof(hello) };
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	int num = numTCP + hello.hasUnix;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = CMSG_SPACE(num * sizeof(int));
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(num * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), tcpFDs, numTCP * sizeof(int));
+	if (hello.hasUnix) memcpy(CMSG_DATA(cmsg) + numTCP * sizeof(int), &unixFD, sizeof(int));
+	return sendmsg(fd, &msg, MSG_NOSIGNAL) == sizeof(hello) ? 0 : -1;
+}
+
+// Thread of the first process: hand the listeners to each successor that asks, until one is
+// ready, then start the drain. The control connection is left open, to close as this daemon exits.
+static void *handoffServe(void *unused) {
+	char ready;
+
+	while (1) {
+		if ((handoffConn = accept(controlFD, NULL, NULL)) < 0) {
+			if (errno != EINTR && errno != ECONNABORTED) usleep(100 * 1000);
+			continue;
+		}
+		if (handoffSend(handoffConn) == 0 && read(handoffConn, &ready, 1) == 1) break;
+		close(handoffConn);	// The successor failed to start; keep serving
+		handoffConn = -1;
+	}
+	close(controlFD);
+	controlFD = -1;
+	eventfd_write(drainFD, 1);
+	return unused;
+}
+
+// Thread of a successor's first process: once the workers are up, tell the old daemon, and wait
+// for it to exit before answering successors of its own
+static void *handoffTakeOver(void *unused) {
+	struct pollfd pfd = { warmRead, POLLIN, 0 };
+	char buf[64];
+	int ms = 0, n;
+
+	while (numWarm > 0 && ms < WARM_MAX_MS) {
+		if (poll(&pfd, 1, 100) > 0 && (n = read(warmRead, buf, sizeof(buf))) > 0) numWarm -= n;
+		else ms += 100;
+	}
+	if (write(handoffConn, "", 1) == 1) {
+		while (read(handoffConn, buf, sizeof(buf)) > 0 || errno == EINTR) continue;	// Until it exits
+	}
+	close(handoffConn);
+	handoffConn = -1;
+	controlFD = controlListen();
+	return handoffServe(unused);
+}
+
+// Ask a daemon answering at the -H path for its listeners: 'wantTCP' of them, on 'port'. Returns
+// the control connection, with tcpFDs and unixFD filled in, or -1 if nobody answered and this
+// daemon should open its own.
+static int handoffReceive(int wantTCP, int port) {
+	struct handoffHello hello;
+	union { struct cmsghdr align; char buf[CMSG_SPACE(HANDOFF_MAX_FDS * sizeof(int))]; } control;
+	struct iovec iov = { &hello, sizeof(hello) };
+	struct sockaddr_un addr;
+	struct sockaddr_in bound;
+	socklen_t len = sizeof(bound);
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	int *fds, i, yes = 1;
+
+	if (fd < 0) error("ERROR opening handoff socket");
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, handoffPath);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		return -1;	// First daemon here, or a stale socket file
+	}
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	if (recvmsg(fd, &msg, 0) != sizeof(hello) || (cmsg = CMSG_FIRSTHDR(&msg)) == NULL ||
+			cmsg->cmsg_type != SCM_RIGHTS ||
+			cmsg->cmsg_len != CMSG_LEN((hello.numTCP + hello.hasUnix) * sizeof(int))) {
+		fprintf(stderr, "ERROR receiving listeners from %s\n", handoffPath);
+		exit(1);
+	}
+	fds = (int *)CMSG_DATA(cmsg);
+	if (hello.numTCP != wantTCP || getsockname(fds[0], (struct sockaddr *)&bound, &len) < 0 ||
+			ntohs(bound.sin_port) != port) {
+		fprintf(stderr, "ERROR the daemon at %s has other listeners: use its port and -s\n", handoffPath);
+		exit(1);	// The old daemon sees the connection close and keeps serving
+	}
+	for (i = 0; i < wantTCP; i++) {
+		tcpFDs[i] = fds[i];
+		setsockopt(tcpFDs[i], IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));	// As openListener
+	}
+	if (hello.hasUnix) unixFD = fds[wantTCP];
+	return fd;
+}
+
+// The unix listener a predecessor passed on is bound to 'path'
+static int unixBoundTo(int fd, const char *path) {
+	struct sockaddr_un addr;
+	socklen_t len = sizeof(addr);
+
+	memset(&addr, 0, sizeof(addr));
+	return getsockname(fd, (struct sockaddr *)&addr, &len) == 0 && strcmp(addr.sun_path, path) == 0;
+}
+
+// Once this daemon's workers are running, answer successors; first, if it took over from
+// 'predecessor', let that daemon drain
+static void handoffStart(int predecessor) {
+	pthread_t tid;
+
+	handoffConn = predecessor;
+	if (predecessor < 0) controlFD = controlListen();
+	if (pthread_create(&tid, NULL, predecessor < 0 ? handoffServe : handoffTakeOver, NULL) != 0)
+		error("ERROR starting handoff thread");
+	pthread_detach(tid);
+}
+
+/************** Startup ************************/
+
+// A TCP listener on 'addr', shared with other sockets bound the same way if 'reusePort'
+static int openListener(struct sockaddr_in *addr, int backlog, int reusePort) {
+	int fd, yes = 1;
+
+	// Set up the socket
+	fd = socket(AF_INET, SOCK_STREAM, 0);	// Create the socket
+	if (fd < 0) error("ERROR opening socket");
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));	// Rebind right after a restart
+	// Inherited by every connection: answers go out as soon as they are written. With Nagle, on a
+	// connection kept for a client's next requests the second answer of a pipeline would wait on
+	// the client's delayed ACK of the first, 40 ms a round trip.
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+	if (reusePort && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)) < 0)
+		error("ERROR setting SO_REUSEPORT");
+
+	// Connect socket to port and flip it on
+	if (bind(fd, (struct sockaddr *)addr, sizeof(*addr)) < 0) error("ERROR on binding");
+	if (listen(fd, backlog) < 0) error("ERROR on listen");
+	return fd;
+}
+
+static void runEngine(int engine, int workers) {
+	switch (engine) {
+		case OTP_ENGINE_FORK:		runFork(workers); break;
+		case OTP_ENGINE_PREFORK:	runPrefork(workers); break;
+		case OTP_ENGINE_THREAD:		runThreads(workers); break;
+		case OTP_ENGINE_EPOLL:		runEpoll(); break;
+		case OTP_ENGINE_URING:
+			warmed();
+			if (otpRunUring(listenFDs, numListeners, drainFD, service) < 0) {
+				perror("io_uring unavailable, using epoll");
+				runEpoll();
+			}
+			break;
+	}
+}
+
+int otpServerMain(int argc, char *argv[], const struct otpService *svc) {
+	struct sockaddr_in serverAddress;
+	struct sockaddr_un unixAddress;
+	const char *unixPath = NULL;
+	int engine = -1;	// Prefork, or epoll when sharded
+	int workers = sysconf(_SC_NPROCESSORS_ONLN);
+	int backlog = SOMAXCONN;
+	int threads = sysconf(_SC_NPROCESSORS_ONLN);
+	struct otpLimits limits = { 0, 100, 0, 0 };
+	int shards = 0, numCPUs = 0, threadsGiven = 0;
+	int cpus[CPU_SETSIZE];
+	int listenSocketFD, opt, i, predecessor = -1, warm[2];
+
+	if (workers < 5) workers = 5;
+	if (threads < 2) threads = 0;	// One CPU: splitting requests only adds overhead
+	while ((opt = getopt(argc, argv, "e:w:b:k:u:t:q:r:i:d:s:c:H:")) != -1) {
+		switch (opt) {
+			case 'e':
+				if (strcmp(optarg, "fork") == 0) engine = OTP_ENGINE_FORK;
+				else if (strcmp(optarg, "prefork") == 0) engine = OTP_ENGINE_PREFORK;
+				else if (strcmp(optarg, "thread") == 0) engine = OTP_ENGINE_THREAD;
+				else if (strcmp(optarg, "epoll") == 0) engine = OTP_ENGINE_EPOLL;
+				else if (strcmp(optarg, "uring") == 0) engine = OTP_ENGINE_URING;
+				else usage(argv[0]);
+				break;
+			case 'w':
+				if ((workers = atoi(optarg)) < 1) usage(argv[0]);
+				break;
+			case 'b':
+				if ((backlog = atoi(optarg)) < 1) usage(argv[0]);
+				break;
+			case 'k':	// Loaded before any workers start, so they all share the mappings
+				if (otpKeyStoreAdd(optarg) < 0) {
+					fprintf(stderr, "ERROR loading pad %s\n", optarg);
+					exit(1);
+				}
+				break;
+			case 't':
+				if ((threads = atoi(optarg)) < 0) usage(argv[0]);
+				threadsGiven = 1;
+				break;
+			case 's':
+				if ((shards = atoi(optarg)) < 1) usage(argv[0]);
+				break;
+			case 'c':
+				if ((numCPUs = parseCPUs(optarg, cpus)) < 0) usage(argv[0]);
+				break;
+			case 'q':
+				if ((limits.maxRequests = atoi(optarg)) < 0) usage(argv[0]);
+				break;
+			case 'r':
+				if ((limits.retryAfterMs = atoi(optarg)) < 0) usage(argv[0]);
+				break;
+			case 'i':
+				if ((limits.idleMs = atoi(optarg)) < 0) usage(argv[0]);
+				break;
+			case 'd':
+				if ((limits.deadlineMs = atoi(optarg)) < 0) usage(argv[0]);
+				break;
+			case 'u':
+				unixPath = optarg;
+				if (strlen(unixPath) >= sizeof(unixAddress.sun_path)) usage(argv[0]);
+				break;
+			case 'H':
+				handoffPath = optarg;
+				if (strlen(handoffPath) >= sizeof(unixAddress.sun_path)) usage(argv[0]);
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	if (argc - optind != 1) usage(argv[0]);	// Check usage/args
+	if (numCPUs > 0 && shards == 0) shards = numCPUs;	// A shard per listed CPU
+	if (shards > 0) {
+		if (numCPUs == 0 && (numCPUs = allowedCPUs(cpus)) == 0) error("ERROR reading CPU affinity");
+		if (!cpusAllowed(cpus, numCPUs)) usage(argv[0]);
+		if (engine < 0) engine = OTP_ENGINE_EPOLL;
+		if (!threadsGiven) threads = 0;		// A shard has one CPU to itself
+	}
+	if (engine < 0) engine = OTP_ENGINE_PREFORK;
+	if (handoffPath != NULL && shards >= HANDOFF_MAX_FDS) usage(argv[0]);
+	service = svc;
+	otpPoolSetup(threads);
+	sessionSetLimits(&limits);
+	shedding = limits.maxRequests > 0 && engine < OTP_ENGINE_EPOLL;
+
+	// Set up the server address struct
+	memset((char *)&serverAddress, '\0', sizeof(serverAddress));	// Clear out the address struct
+	serverAddress.sin_family = AF_INET;		// Create network-capable socket
+	serverAddress.sin_port = htons(atoi(argv[optind]));	// Store the port number
+	serverAddress.sin_addr.s_addr = INADDR_ANY;	// Any address is allowed to connect
+
+	if (shards > 0) {
+		shardFDs = malloc(shards * sizeof(*shardFDs));
+		shardCPUs = malloc(shards * sizeof(*shardCPUs));
+		if (shardFDs == NULL || shardCPUs == NULL) error("ERROR starting shards");
+		for (i = 0; i < shards; i++) shardCPUs[i] = cpus[i % numCPUs];
+		tcpFDs = shardFDs;
+		numTCP = shards;
+	} else {
+		tcpFDs = listenFDs;
+		numTCP = 1;
+	}
+	// Take over the listeners of a daemon already running here (see Handoff), or open them
+	if (handoffPath != NULL) {
+		predecessor = handoffReceive(numTCP, ntohs(serverAddress.sin_port));
+		if ((drainFD = eventfd(0, 0)) < 0) error("ERROR creating eventfd");
+	}
+	if (predecessor < 0) {
+		for (i = 0; i < numTCP; i++) tcpFDs[i] = openListener(&serverAddress, backlog, shards > 0);
+	}
+	numListeners = 1;
+	if (shards > 0) listenFDs[0] = shardFDs[0];	// Each shard puts its own here
+
+	// Passed on, but not asked for this time, or asked for at another path: that one is opened
+	if (unixFD >= 0 && (unixPath == NULL || !unixBoundTo(unixFD, unixPath))) {
+		close(unixFD);
+		unixFD = -1;
+	}
+	if (unixFD >= 0) {
+		listenFDs[numListeners++] = unixFD;
+	} else if (unixPath != NULL) {
+		// Same-host clients can skip TCP entirely; a socket file left by an earlier run is replaced
+		memset(&unixAddress, 0, sizeof(unixAddress));
+		unixAddress.sun_family = AF_UNIX;
+		strcpy(unixAddress.sun_path, unixPath);
+		unlink(unixPath);
+		listenSocketFD = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (listenSocketFD < 0) error("ERROR opening unix socket");
+		if (bind(listenSocketFD, (struct sockaddr *)&unixAddress, sizeof(unixAddress)) < 0)
+			error("ERROR on binding unix socket");
+		if (listen(listenSocketFD, backlog) < 0) error("ERROR on listen");
+		listenFDs[numListeners++] = unixFD = listenSocketFD;
+	}
+	if (numListeners > 1 || handoffPath != NULL) {	// See acceptNext
+		for (i = 0; i < numTCP; i++) fcntl(tcpFDs[i], F_SETFL, fcntl(tcpFDs[i], F_GETFL) | O_NONBLOCK);
+		if (unixFD >= 0) fcntl(unixFD, F_SETFL, fcntl(unixFD, F_GETFL) | O_NONBLOCK);
+	}
+	// Shards share the counters, so the stats and -q still cover the daemon as a whole
+	if (otpStatsInit(engine >= OTP_ENGINE_EPOLL ? 0 : workers * (shards ? shards : 1)) < 0) error("ERROR mapping stats");
+
+	if (predecessor >= 0) {	// Every worker says when it is ready
+		if (pipe2(warm, O_NONBLOCK) < 0) error("ERROR creating pipe");
+		warmRead = warm[0];
+		warmFD = warm[1];
+		numWarm = (engine == OTP_ENGINE_PREFORK || engine == OTP_ENGINE_THREAD ? workers : 1) * numTCP;
+	}
+	if (handoffPath != NULL) handoffStart(predecessor);
+
+	if (shards > 0) {
+		runShards(shards, engine, workers);
+	} else {
+		if (shedding) shedInit();
+		runEngine(engine, workers);
+	}
+	// Only reached once drained: finish what is left, and exit, closing the control connection
+	drainWait();
+	for (i = 0; i < numListeners; i++) close(listenFDs[i]);
+	return 0;
+}
@@ -0,0 +1,59 @@
+/* Author: Brad Powell
+ * Date: 6/14/2019
+ * otp_server: Listening socket and serving engines shared by otp_d, otp_enc_d and otp_dec_d
+ * Use: daemon [-e fork|prefork|thread|epoll|uring] [-w workers] [-b backlog] [-k pad ...] [-u socket]
+ *             [-t threads] [-q requests] [-r retry_ms] [-i idle_ms] [-d deadline_ms] [-s shards]
+ *             [-c cpus] [-H handoff_socket] listening_port
+ *   fork	one child per connection, at most 'workers' at once
+ *   prefork	'workers' long-lived processes all blocking in accept on the shared socket (default)
+ *   thread	the same with threads in one process
+ *   epoll	a single thread multiplexing every connection with non-blocking I/O
+ *   uring	a single thread batching its I/O through io_uring (otp_uring.h); falls back to epoll
+ * Workers default to the number of online CPUs, but never fewer than 5 so five slow clients can't
+ * starve a sixth. The listen backlog defaults to SOMAXCONN. Each -k loads a pad into the key
+ * store (otp_keystore.h) for requests that name their key instead of sending it. -u also
+ * listens on a unix socket at the given path; clients there can pass their job in a memfd. -t
+ * sizes the transform pool that splits large requests over several cores (otp_pool.h); it
+ * defaults to the number of CPUs, or none on a single CPU.
+ *
+ * The rest are limits for running under load (otp_session.h); all are off unless given. -q caps
+ * the requests in flight across the daemon, and requests past it are refused at once as busy,
+ * with -r (default 100) as the suggested number of milliseconds to wait before trying again.
+ * Legacy requests count too, and are refused with "reject", the only refusal old clients know. On
+ * the blocking engines -q also means connections arriving while every worker is busy are answered
+ * busy rather than left in the listen queue. -i closes connections that move no data for that
+ * many milliseconds, whether idle between requests or a client too slow to send or read. -d gives
+ * each request (or stream chunk) that many milliseconds from its header to its answer.
+ *
+ * -s runs that many shards: processes pinned to a CPU each, with their own SO_REUSEPORT listener on
+ * the port, so connections are spread over the cores by the kernel rather than all taken from one
+ * socket. -c lists the CPUs to use, such as 0-3,8, and alone means a shard on each; without it the
+ * shards go round the CPUs the daemon may run on. Each shard runs the engine given (epoll unless
+ * -e says otherwise) with its own workers, connections and buffers, and no transform pool unless -t
+ * asks for one. The parent only replaces shards that exit. Counters and the -q limit stay shared.
+ *
+ * -H restarts without refusing a connection. The daemon listens for its successor on a unix
+ * socket at that path; start the new binary with the same -H, port and -s and it is sent the
+ * running daemon's listening sockets (SCM_RIGHTS) instead of binding its own. The -u socket is
+ * taken over too when -u names the same path, and opened afresh otherwise. Once the new workers
+ * are up, with their transform pools started, the old daemon stops accepting, closes each
+ * connection at its next break between requests (or, for one that hasn't sent anything, a second
+ * on), and exits when none are left, 30 seconds at most; the new one takes over the path for the
+ * restart after. Should the new daemon fail before it is ready, the old one carries on. Clients
+ * retry on a new connection a request whose kept connection was closed under it (otp_route.c).
+ */
+
+#ifndef OTP_SERVER_H
+#define OTP_SERVER_H
+
+#include "otp_session.h"
+
+#define OTP_ENGINE_FORK		0
+#define OTP_ENGINE_PREFORK	1
+#define OTP_ENGINE_THREAD	2
+#define OTP_ENGINE_EPOLL	3
+#define OTP_ENGINE_URING	4
+
+int otpServerMain(int argc, char *argv[], const struct otpService *svc);
+
+#endif
@@ -0,0 +1,655 @@
+/* Author: Brad Powell
+ * Date: 6/14/2019
+ * otp_session: Daemon side of the protocol as a state machine
+ * See otp_session.h for how the serving engines drive it.
+ */
+
+#define _GNU_SOURCE	// F_GET_SEALS
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "otp_keystore.h"
+#include "otp_pool.h"
+#include "otp_stats.h"
+#include "otp_session.h"
+
+// Session states
+#define SS_DETECT		0	// First bytes: binary header or legacy token?
+#define SS_HEADER		1	// Rest of the request header
+#define SS_BODY			2	// Text and key of a whole request
+#define SS_STREAM_HEADER	3	// Header of the next stream chunk
+#define SS_STREAM_BODY		4	// Text and key of a stream chunk
+#define SS_DRAIN		5	// Discarding a refused request
+#define SS_LEGACY_TEXT		6	// Legacy text up to "@@"
+#define SS_LEGACY_KEY		7	// Legacy key up to "@@"
+#define SS_CLOSE		8	// Finished once the output is flushed
+
+#define CLOSE_GRACE_USEC	1000000ULL	// Time a timed out session's refusal has to go out
+#define SHED_IDLE_MS		5000		// Idle limit of a shed session when there is no other
+#define DRAIN_FIRST_USEC	1000000ULL	// Time a new connection has to start a request once draining
+
+static __thread char scratch[4096];	// Landing spot for drained bytes, never read
+static struct otpLimits limits;
+
+void sessionSetLimits(const struct otpLimits *l) {
+	limits = *l;
+}
+
+// How often an event loop should look for expired sessions, in ms; -1 if none can expire
+int sessionSweepMs(void) {
+	int ms = limits.idleMs;
+	if (limits.deadlineMs > 0 && (ms == 0 || limits.deadlineMs < ms)) ms = limits.deadlineMs;
+	if (ms == 0) return -1;
+	ms /= 4;
+	return ms < 10 ? 10 : ms > 1000 ? 1000 : ms;
+}
+
+void sessionInit(struct otpSession *s, const struct otpService *svc) {
+	memset(s, 0, sizeof(*s));
+	s->svc = svc;
+	s->state = SS_DETECT;
+	s->memfd = -1;
+	s->lastActive = otpNowUsec();
+}
+
+// Every request on this session will be refused as busy; the engine took it in past its limit
+void sessionShed(struct otpSession *s) {
+	s->shed = 1;
+}
+
+// The current request no longer counts against the in-flight limit
+static void release(struct otpSession *s) {
+	if (s->admitted) otpStatsRelease();
+	s->admitted = 0;
+}
+
+void sessionFree(struct otpSession *s) {
+	release(s);
+	if (s->par != NULL) otpParallelFree(s->par);	// Pool threads may still be writing to the body
+	s->par = NULL;
+	if (s->memfd >= 0) close(s->memfd);
+	s->memfd = -1;
+	free(s->body);
+	free(s->key);
+	free(s->chunk);
+	s->body = s->key = s->chunk = NULL;
+}
+
+/************** Output ************************/
+
+static int outputPending(const struct otpSession *s) {
+	return s->outPos < s->outHdrLen + s->outDataLen;
+}
+
+// Queue a header followed by 'len' bytes of session-owned data
+static void queueFrame(struct otpSession *s, const struct otpHeader *hdr, char *data, size_t len) {
+	otpPackHeader(hdr, s->outHdr);
+	s->outHdrLen = OTP_HDR_SIZE;
+	s->outData = data;
+	s->outDataLen = len;
+	s->outPos = 0;
+}
+
+// Queue a short legacy token such as "confirm"
+static void queueToken(struct otpSession *s, const char *token) {
+	s->outHdrLen = strlen(token);
+	memcpy(s->outHdr, token, s->outHdrLen);
+	s->outData = NULL;
+	s->outDataLen = 0;
+	s->outPos = 0;
+}
+
+// Fill 'iov' with the unsent output that is ready to go. Returns the number of entries used, 0 if
+// nothing is pending or the rest of the data is still being transformed (see sessionWait).
+int sessionOutput(struct otpSession *s, struct iovec *iov) {
+	size_t ready = s->outDataLen;
+	int n = 0;
+	if (!outputPending(s)) return 0;
+	if (s->par != NULL) ready = otpParallelReady(s->par);
+	if (s->outPos < s->outHdrLen) {
+		iov[n].iov_base = s->outHdr + s->outPos;
+		iov[n].iov_len = s->outHdrLen - s->outPos;
+		n++;
+		if (ready > 0) {
+			iov[n].iov_base = s->outData;
+			iov[n].iov_len = ready;
+			n++;
+		}
+	} else if (s->outPos - s->outHdrLen < ready) {
+		iov[n].iov_base = s->outData + (s->outPos - s->outHdrLen);
+		iov[n].iov_len = ready - (s->outPos - s->outHdrLen);
+		n++;
+	}
+	return n;
+}
+
+// Output is pending but none of it is ready: help transform it, or wait for the pool to
+void sessionWait(struct otpSession *s) {
+	if (s->par != NULL && outputPending(s)) otpParallelWait(s->par);
+}
+
+void sessionSent(struct otpSession *s, size_t n) {
+	s->outPos += n;
+	s->lastActive = otpNowUsec();
+	OTP_STAT_ADD(bytesOut, n);
+	if (!outputPending(s)) {
+		// That was the last of the request's answer, or of a stream chunk's
+		if (s->state == SS_HEADER || s->state == SS_CLOSE) release(s);
+		s->deadline = 0;
+		if (s->par != NULL) {
+			otpStatsObserve(OTP_PHASE_TRANSFORM, otpParallelFree(s->par));
+			s->par = NULL;
+		}
+		if (s->queuedAt != 0) {
+			otpStatsObserve(OTP_PHASE_SEND, otpNowUsec() - s->queuedAt);
+			s->queuedAt = 0;
+		}
+		s->outHdrLen = s->outDataLen = s->outPos = 0;
+		s->outData = NULL;
+		// An answered request's buffer isn't needed while the connection waits for the next one
+		if (s->state == SS_HEADER) {
+			free(s->body);
+			s->body = NULL;
+		}
+		if (s->draining && s->state == SS_HEADER && s->hdrUsed == 0) s->state = SS_CLOSE;
+	}
+}
+
+// Nothing left to read or write: the engine should close the connection
+int sessionDone(const struct otpSession *s) {
+	return s->state == SS_CLOSE && !outputPending(s);
+}
+
+// Milliseconds the engine may wait on the socket before calling sessionExpired: 0 if that is due
+// now, -1 if the session can wait forever. Idling doesn't count while the pool is still working
+// on the answer.
+int sessionTimeout(const struct otpSession *s, uint64_t now) {
+	uint64_t at = 0;
+	int idleMs = (limits.idleMs == 0 && s->shed) ? SHED_IDLE_MS : limits.idleMs;
+	if (s->expired) at = s->lastActive + CLOSE_GRACE_USEC;
+	else if (s->draining && s->state == SS_DETECT && s->hdrUsed == 0) at = s->lastActive + DRAIN_FIRST_USEC;
+	else if (idleMs > 0 && s->par == NULL) at = s->lastActive + idleMs * 1000ULL;
+	if (!s->expired && s->deadline != 0 && (at == 0 || s->deadline < at)) at = s->deadline;
+	if (at == 0) return -1;
+	return at <= now ? 0 : (int)((at - now + 999) / 1000);
+}
+
+static void reject(struct otpSession *s, int status, int drain);
+
+// The wait sessionTimeout allowed is over. A request that missed its deadline is refused, if none
+// of its answer has gone out; otherwise (or if the refusal can't be delivered either) the output
+// is dropped and the session is done.
+void sessionExpired(struct otpSession *s) {
+	uint64_t now = otpNowUsec();
+	if (!s->expired && !(s->draining && s->state == SS_DETECT)) OTP_STAT_ADD(timedOut, 1);
+	if (!s->expired && s->deadline != 0 && s->deadline <= now && !outputPending(s)) {
+		reject(s, OTP_ST_TIMEOUT, 0);
+		s->expired = 1;
+		s->lastActive = now;
+		return;
+	}
+	s->expired = 1;
+	s->outHdrLen = s->outDataLen = s->outPos = 0;
+	s->outData = NULL;
+	s->state = SS_CLOSE;
+}
+
+// The daemon is handing over to a new one: see otp_session.h
+void sessionDrain(struct otpSession *s) {
+	s->draining = 1;
+	if (s->state == SS_HEADER && s->hdrUsed == 0 && !outputPending(s)) s->state = SS_CLOSE;
+}
+
+/************** Binary requests ************************/
+
+static const struct otpOperation *findOp(const struct otpService *svc, int opcode) {
+	int i;
+	for (i = 0; i < svc->numOps; i++) {
+		if (svc->ops[i].opcode == opcode) return &svc->ops[i];
+	}
+	return NULL;
+}
+
+// Text bytes that follow the header (on the wire or in a memfd)
+static uint64_t textBytes(const struct otpHeader *req) {
+	return (req->flags & OTP_F_PACKED) ? otpPackedSize(req->payloadLen) : req->payloadLen;
+}
+
+// Key bytes that follow the text; none if the key is a pad reference
+static uint64_t keyBytes(const struct otpHeader *req) {
+	if (req->flags & OTP_F_KEYREF) return 0;
+	return (req->flags & OTP_F_PACKED) ? otpPackedSize(req->keyLen) : req->keyLen;
+}
+
+// Bytes that follow the header on the wire
+static uint64_t wireBytes(const struct otpHeader *req) {
+	return (req->flags & OTP_F_MEMFD) ? 0 : textBytes(req) + keyBytes(req);
+}
+
+// Send a REJECT for the current request and throw away whatever the client still sends for it,
+// after which the connection is ready for the next request. A refused stream has no length up
+// front, so that drains until the client hangs up; an unreadable header ends the connection.
+static void reject(struct otpSession *s, int status, int drain) {
+	struct otpHeader resp;
+	if (status < OTP_STAT_STATUSES) OTP_STAT_ADD(rejected[status], 1);
+	release(s);
+	s->deadline = 0;
+	memset(&resp, 0, sizeof(resp));
+	resp.opcode = OTP_OP_REJECT;
+	resp.status = status;
+	resp.tag = s->req.tag;
+	if (status == OTP_ST_BUSY) resp.aux = limits.retryAfterMs;
+	queueFrame(s, &resp, NULL, 0);
+
+	if (!drain) {
+		s->state = SS_CLOSE;
+	} else if (s->req.flags & OTP_F_STREAM) {
+		s->drainToEOF = 1;
+		s->state = SS_DRAIN;
+	} else if (wireBytes(&s->req) > 0) {
+		s->drainLeft = wireBytes(&s->req);
+		s->state = SS_DRAIN;
+	} else {
+		s->state = SS_HEADER;
+	}
+}
+
+// Whole request has arrived: transform in place and send the text part back
+static void requestBody(struct otpSession *s) {
+	struct otpHeader resp;
+	const char *key = s->padKey ? s->padKey : s->body + textBytes(&s->req);
+	uint64_t received = otpNowUsec();
+
+	otpStatsObserve(OTP_PHASE_RECEIVE, received - s->startedAt);
+	if (s->req.flags & OTP_F_PACKED) {
+		// Worked on as it came off the wire; the answer goes back packed too
+		otpPackedTransform((unsigned char *)s->body, key, s->padKey == NULL, s->req.payloadLen,
+				s->op->decode);
+	} else {
+		// Big requests go to the pool and are sent block by block as they finish
+		s->par = otpParallelStart(s->transform, s->body, key, s->req.payloadLen);
+		if (s->par == NULL) s->transform(s->body, key, s->req.payloadLen);
+	}
+	s->queuedAt = otpNowUsec();
+	if (s->par == NULL) otpStatsObserve(OTP_PHASE_TRANSFORM, s->queuedAt - received);
+	OTP_STAT_ADD(completed[s->op->opcode % OTP_STAT_OPS], 1);
+
+	memset(&resp, 0, sizeof(resp));
+	resp.opcode = OTP_OP_RESULT;
+	resp.flags = s->req.flags & OTP_F_PACKED;
+	resp.tag = s->req.tag;
+	resp.payloadLen = s->req.payloadLen;
+	queueFrame(s, &resp, s->body, textBytes(&s->req));
+	s->state = SS_HEADER;
+}
+
+// Answer a stats request with the metrics text; it has no body to wait for
+static void statsRequest(struct otpSession *s) {
+	struct otpHeader resp;
+	size_t len = 0;
+
+	if (s->req.payloadLen + s->req.keyLen > 0 || s->req.flags != 0) {
+		reject(s, OTP_ST_BAD_REQUEST, 1);
+		return;
+	}
+	if ((s->body = otpStatsFormat(&len)) == NULL) {
+		reject(s, OTP_ST_NO_MEMORY, 1);
+		return;
+	}
+	memset(&resp, 0, sizeof(resp));
+	resp.opcode = OTP_OP_RESULT;
+	resp.tag = s->req.tag;
+	resp.payloadLen = len;
+	queueFrame(s, &resp, s->body, len);
+	s->state = SS_HEADER;
+}
+
+// Connection opening: grant whichever of the wanted features this daemon has
+static void helloRequest(struct otpSession *s) {
+	struct otpHeader resp;
+
+	if (s->req.payloadLen + s->req.keyLen > 0 || s->req.flags != 0) {
+		reject(s, OTP_ST_BAD_REQUEST, 1);
+		return;
+	}
+	s->features = s->req.aux & OTP_FEAT_PACKED;
+	memset(&resp, 0, sizeof(resp));
+	resp.opcode = OTP_OP_RESULT;
+	resp.tag = s->req.tag;
+	resp.aux = s->features;
+	queueFrame(s, &resp, NULL, 0);
+	s->state = SS_HEADER;
+}
+
+// Memfd request: map the client's memfd, transform the text in place and answer with an empty
+// result. Only the mapping is touched; no request bytes cross the socket.
+static void memfdRequest(struct otpSession *s) {
+	struct otpHeader resp;
+	struct stat st;
+	uint64_t size = s->req.payloadLen + keyBytes(&s->req);
+	uint64_t started = otpNowUsec();
+	char *map = NULL;
+	int fd = s->memfd;
+	int seals;
+
+	s->memfd = -1;
+	if (fd < 0 || size < s->req.payloadLen) {	// No memfd, or text and key lengths that wrap
+		reject(s, OTP_ST_BAD_REQUEST, 1);
+		if (fd >= 0) close(fd);
+		return;
+	}
+	// A client shrinking the file under us would crash the worker, so insist on the seal
+	seals = fcntl(fd, F_GET_SEALS);
+	if (seals < 0 || !(seals & F_SEAL_SHRINK) || fstat(fd, &st) < 0 || (uint64_t)st.st_size < size ||
+			(size > 0 && (map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)) {
+		close(fd);
+		reject(s, OTP_ST_BAD_REQUEST, 1);
+		return;
+	}
+	close(fd);
+	if (size > 0) {
+		s->transform(map, s->padKey ? s->padKey : map + s->req.payloadLen, s->req.payloadLen);
+		munmap(map, size);
+	}
+	otpStatsObserve(OTP_PHASE_TRANSFORM, otpNowUsec() - started);
+	OTP_STAT_ADD(completed[s->op->opcode % OTP_STAT_OPS], 1);
+
+	memset(&resp, 0, sizeof(resp));
+	resp.opcode = OTP_OP_RESULT;
+	resp.flags = OTP_F_MEMFD;
+	resp.tag = s->req.tag;
+	queueFrame(s, &resp, NULL, 0);
+	s->state = SS_HEADER;
+}
+
+// Request header has arrived: check it and size the body buffer to fit text and key exactly
+static void requestHeader(struct otpSession *s) {
+	const struct otpCodec *codec;
+	int status;
+	s->hdrUsed = 0;
+	s->padKey = NULL;
+	s->startedAt = otpNowUsec();
+	if (otpUnpackHeader(s->hdrBuf, &s->req) < 0) {
+		memset(&s->req, 0, sizeof(s->req));
+		reject(s, OTP_ST_BAD_REQUEST, 0);
+		return;
+	}
+	if (s->req.opcode == OTP_OP_STATS) {
+		statsRequest(s);
+		return;
+	}
+	if (s->req.opcode == OTP_OP_HELLO) {
+		helloRequest(s);
+		return;
+	}
+	// Bound the body before anything sizes, drains or allocates it, which also keeps the sum
+	// of text and key (packed or not) from wrapping; no point draining that much, so hang up
+	if (!(s->req.flags & OTP_F_MEMFD) && (s->req.payloadLen > OTP_MAX_REQUEST ||
+			(!(s->req.flags & OTP_F_KEYREF) && s->req.keyLen > OTP_MAX_REQUEST))) {
+		reject(s, OTP_ST_NO_MEMORY, 0);
+		return;
+	}
+	if ((s->op = findOp(s->svc, s->req.opcode)) == NULL) {
+		reject(s, OTP_ST_WRONG_SERVER, 1);
+		return;
+	}
+	if ((codec = otpCodecFor(s->req.alphabet)) == NULL ||
+			((s->req.flags & OTP_F_KEYREF) && s->req.alphabet != OTP_ALPHA_LETTERS)) {
+		reject(s, OTP_ST_BAD_REQUEST, 1);	// Pads only hold letters
+		return;
+	}
+	s->transform = s->op->decode ? codec->decode : codec->encode;
+	if ((s->req.flags & OTP_F_STREAM) && (s->req.flags & (OTP_F_KEYREF | OTP_F_MEMFD))) {
+		reject(s, OTP_ST_BAD_REQUEST, 1);	// Streams always carry their text and key
+		return;
+	}
+	if ((s->req.flags & OTP_F_PACKED) && (!(s->features & OTP_FEAT_PACKED) ||
+			s->req.alphabet != OTP_ALPHA_LETTERS || (s->req.flags & (OTP_F_STREAM | OTP_F_MEMFD)))) {
+		reject(s, OTP_ST_BAD_REQUEST, 1);	// Only whole letter requests, once granted
+		return;
+	}
+	// Admission: past the limit the client hears so now, before any pad is claimed or body read
+	if (s->shed || !otpStatsAdmit(limits.maxRequests)) {
+		reject(s, OTP_ST_BUSY, 1);
+		return;
+	}
+	s->admitted = 1;
+	if (limits.deadlineMs > 0) s->deadline = s->startedAt + limits.deadlineMs * 1000ULL;
+	if (s->req.flags & OTP_F_STREAM) {
+		s->state = SS_STREAM_HEADER;
+		return;
+	}
+	if (s->req.flags & OTP_F_KEYREF) {
+		// Claim the pad range before the text arrives; encoding uses it up
+		status = otpKeyStoreGet(s->req.aux, s->req.keyLen, s->req.payloadLen,
+				s->req.opcode == OTP_OP_ENCODE, &s->padKey);
+		if (status != OTP_ST_OK) {
+			reject(s, status, 1);
+			return;
+		}
+	} else if (s->req.keyLen < s->req.payloadLen) {
+		reject(s, OTP_ST_SHORT_KEY, 1);
+		return;
+	}
+	if (s->req.flags & OTP_F_MEMFD) {
+		memfdRequest(s);
+		return;
+	}
+
+	s->bodyLen = wireBytes(&s->req);	// At most twice OTP_MAX_REQUEST, checked above
+	s->bodyUsed = 0;
+	if ((s->body = malloc(s->bodyLen + 1)) == NULL) {
+		reject(s, OTP_ST_NO_MEMORY, 1);
+		return;
+	}
+	s->state = SS_BODY;
+	if (s->bodyLen == 0) requestBody(s);
+}
+
+// Stream chunk has arrived: transform it and send it straight back
+static void chunkBody(struct otpSession *s) {
+	struct otpHeader resp;
+	size_t n = s->bodyLen / 2;
+	s->transform(s->chunk, s->chunk + n, n);
+
+	memset(&resp, 0, sizeof(resp));
+	resp.opcode = OTP_OP_CHUNK;
+	resp.flags = s->chunkFlags & OTP_F_END;
+	resp.tag = s->req.tag;
+	resp.payloadLen = n;
+	queueFrame(s, &resp, s->chunk, n);
+	s->state = (s->chunkFlags & OTP_F_END) ? SS_HEADER : SS_STREAM_HEADER;
+	if (s->chunkFlags & OTP_F_END) OTP_STAT_ADD(completed[s->op->opcode % OTP_STAT_OPS], 1);
+}
+
+static void chunkHeader(struct otpSession *s) {
+	struct otpHeader hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	s->hdrUsed = 0;
+	if (otpUnpackHeader(s->hdrBuf, &hdr) < 0 || hdr.opcode != OTP_OP_CHUNK ||
+			hdr.payloadLen > OTP_MAX_CHUNK || hdr.keyLen != hdr.payloadLen) {
+		reject(s, (hdr.keyLen < hdr.payloadLen) ? OTP_ST_SHORT_KEY : OTP_ST_BAD_REQUEST, 1);
+		return;
+	}
+	if (s->chunk == NULL && (s->chunk = malloc(2 * OTP_MAX_CHUNK)) == NULL) {
+		reject(s, OTP_ST_NO_MEMORY, 1);
+		return;
+	}
+	if (limits.deadlineMs > 0) s->deadline = otpNowUsec() + limits.deadlineMs * 1000ULL;
+	s->chunkFlags = hdr.flags;
+	s->bodyLen = 2 * hdr.payloadLen;
+	s->bodyUsed = 0;
+	s->state = SS_STREAM_BODY;
+	if (s->bodyLen == 0) chunkBody(s);
+}
+
+/************** Legacy requests ************************/
+
+// "secret"/"message" arrived in one piece, as the old clients send it; it picks the operation. The
+// request counts against the in-flight limit like a binary one, but the old clients know no busy
+// answer, so past the limit they get the only refusal they do know.
+static void legacyToken(struct otpSession *s) {
+	const struct otpOperation *op;
+	size_t len;
+	int i;
+
+	for (i = 0; i < s->svc->numOps; i++) {
+		op = &s->svc->ops[i];
+		len = strlen(op->legacyToken);
+		if (s->hdrUsed == len && memcmp(s->hdrBuf, op->legacyToken, len) == 0) {
+			if (s->shed || !otpStatsAdmit(limits.maxRequests)) {
+				OTP_STAT_ADD(rejected[OTP_ST_BUSY], 1);	// Counted as the refusal it stands for
+				break;
+			}
+			s->admitted = 1;
+			s->op = op;
+			s->transform = op->decode ? otpDecode : otpEncode;	// Legacy clients only know letters
+			queueToken(s, "confirm");
+			s->state = SS_LEGACY_TEXT;
+			return;
+		}
+	}
+	queueToken(s, "reject");
+	s->state = SS_CLOSE;
+}
+
+// Grow a legacy buffer so there is always room for another full read
+static int legacyReserve(char **buf, size_t *cap, size_t used) {
+	size_t newCap = *cap ? *cap : 4096;
+	char *grown;
+	while (newCap - used < 256) newCap *= 2;
+	if (newCap == *cap) return 0;
+	grown = realloc(*buf, newCap);
+	if (grown == NULL) return -1;
+	*buf = grown;
+	*cap = newCap;
+	return 0;
+}
+
+// Look for "@@" in the newly arrived bytes only. Returns its position, or -1.
+static long legacyScan(struct otpSession *s, const char *buf, size_t used) {
+	for (; s->scan + 1 < used; s->scan++) {
+		if (buf[s->scan] == '@' && buf[s->scan+1] == '@') return s->scan;
+	}
+	return -1;
+}
+
+static void legacyReceived(struct otpSession *s, size_t n) {
+	long end;
+	if (s->state == SS_LEGACY_TEXT) {
+		s->bodyUsed += n;
+		if ((end = legacyScan(s, s->body, s->bodyUsed)) < 0) return;
+		s->bodyLen = end;
+		s->scan = 0;
+		queueToken(s, "confirm");	// Stay in sync before the key
+		s->state = SS_LEGACY_KEY;
+		return;
+	}
+
+	s->keyUsed += n;
+	if ((end = legacyScan(s, s->key, s->keyUsed)) < 0) return;
+	s->state = SS_CLOSE;
+	if ((size_t)end < s->bodyLen) return;	// Short key: hang up, as the old daemons did
+
+	// Send the result back with the @@ terminator restored. The text buffer still has room
+	// for it, since that is where the terminator arrived.
+	s->transform(s->body, s->key, s->bodyLen);
+	OTP_STAT_ADD(completed[s->op->opcode % OTP_STAT_OPS], 1);
+	s->body[s->bodyLen] = '@';
+	s->body[s->bodyLen+1] = '@';
+	s->outHdrLen = 0;
+	s->outData = s->body;
+	s->outDataLen = s->bodyLen + 2;
+	s->outPos = 0;
+}
+
+/************** Input ************************/
+
+// Where the next received bytes should go and how many are wanted. 0 means don't read now.
+size_t sessionReadSpace(struct otpSession *s, char **buf) {
+	if (outputPending(s)) return 0;
+	switch (s->state) {
+		case SS_DETECT:
+		case SS_HEADER:
+		case SS_STREAM_HEADER:
+			*buf = (char *)s->hdrBuf + s->hdrUsed;
+			return OTP_HDR_SIZE - s->hdrUsed;
+		case SS_BODY:
+			*buf = s->body + s->bodyUsed;
+			return s->bodyLen - s->bodyUsed;
+		case SS_STREAM_BODY:
+			*buf = s->chunk + s->bodyUsed;
+			return s->bodyLen - s->bodyUsed;
+		case SS_DRAIN:
+			*buf = scratch;
+			if (!s->drainToEOF && s->drainLeft < sizeof(scratch)) return s->drainLeft;
+			return sizeof(scratch);
+		case SS_LEGACY_TEXT:
+			if (legacyReserve(&s->body, &s->bodyCap, s->bodyUsed) < 0) break;
+			*buf = s->body + s->bodyUsed;
+			return s->bodyCap - s->bodyUsed - 1;
+		case SS_LEGACY_KEY:
+			if (legacyReserve(&s->key, &s->keyCap, s->keyUsed) < 0) break;
+			*buf = s->key + s->keyUsed;
+			return s->keyCap - s->keyUsed - 1;
+	}
+	s->state = SS_CLOSE;
+	return 0;
+}
+
+// 'n' bytes were placed where sessionReadSpace asked
+void sessionReceived(struct otpSession *s, size_t n) {
+	OTP_STAT_ADD(bytesIn, n);
+	s->lastActive = otpNowUsec();
+	switch (s->state) {
+		case SS_DETECT:
+			s->hdrUsed += n;
+			if (s->hdrUsed < 3) break;	// Not enough to tell yet
+			if (!otpIsBinary(s->hdrBuf, s->hdrUsed)) {
+				legacyToken(s);
+				break;
+			}
+			s->state = SS_HEADER;
+			if (s->hdrUsed == OTP_HDR_SIZE) requestHeader(s);
+			break;
+		case SS_HEADER:
+			s->hdrUsed += n;
+			if (s->hdrUsed == OTP_HDR_SIZE) requestHeader(s);
+			break;
+		case SS_BODY:
+			s->bodyUsed += n;
+			if (s->bodyUsed == s->bodyLen) requestBody(s);
+			break;
+		case SS_STREAM_HEADER:
+			s->hdrUsed += n;
+			if (s->hdrUsed == OTP_HDR_SIZE) chunkHeader(s);
+			break;
+		case SS_STREAM_BODY:
+			s->bodyUsed += n;
+			if (s->bodyUsed == s->bodyLen) chunkBody(s);
+			break;
+		case SS_DRAIN:
+			if (s->drainToEOF) break;
+			s->drainLeft -= n;
+			if (s->drainLeft == 0) s->state = SS_HEADER;
+			break;
+		case SS_LEGACY_TEXT:
+		case SS_LEGACY_KEY:
+			legacyReceived(s, n);
+			break;
+	}
+}
+
+// A descriptor arrived with the data (SCM_RIGHTS); it belongs to the next memfd request
+void sessionReceivedFD(struct otpSession *s, int fd) {
+	if (s->memfd >= 0) close(s->memfd);
+	s->memfd = fd;
+}
+
+// Peer closed its side, normally between requests. Anything already queued is still flushed.
+void sessionEOF(struct otpSession *s) {
+	s->state = SS_CLOSE;
+}
@@ -0,0 +1,119 @@
+/* Author: Brad Powell
+ * Date: 6/14/2019
+ * otp_session: Daemon side of the protocol as a state machine
+ * A session owns one connection's protocol state but does no I/O itself. The serving engine asks
+ * where to put the next bytes (sessionReadSpace), reports what arrived (sessionReceived), and
+ * writes out whatever sessionOutput hands back. That way the blocking workers and the event loop
+ * all run the exact same protocol code. A large result may be handed out piecewise while the
+ * transform pool (otp_pool.h) finishes it; when sessionOutput has nothing ready yet the engine
+ * calls sessionWait. A binary connection carries any number of requests
+ * back to back; they are served in arrival order. A session never reads while it has output
+ * pending, so a slow reader stalls its own requests instead of growing daemon memory.
+ *
+ * Limits (sessionSetLimits) are shared by every session. A request beyond the daemon's in-flight
+ * limit, or any request on a session marked with sessionShed, is refused at once with OTP_ST_BUSY.
+ * Sessions also keep the time: the engine asks sessionTimeout how long it may wait for the socket
+ * and calls sessionExpired when that runs out. An idle connection (or a client too slow to send
+ * or read anything) is then closed, and a request past its deadline is refused with
+ * OTP_ST_TIMEOUT first if none of its answer has gone out yet. Legacy requests count against the
+ * limit too, but the old clients know no busy answer: past it they are sent "reject", which they
+ * report as the wrong server.
+ *
+ * When the daemon hands over to a new one (otp_server.h -H), sessionDrain has a session finish at
+ * its next point between requests: once the answer in hand is out, or straight away if it is
+ * waiting for the next request. A new connection that has sent nothing yet gets a second from
+ * its accept to start its first request (sessionTimeout), so a client that connected just as the
+ * drain began is still served while one that only holds its connection open is not. Whatever is
+ * left after OTP_DRAIN_MAX_MS the engine closes as it returns.
+ */
+
+#ifndef OTP_SESSION_H
+#define OTP_SESSION_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include "otp_proto.h"
+#include "otp_codec.h"
+#include "otp_pool.h"
+
+// One operation a daemon serves: the opcode it accepts, the matching legacy handshake token and
+// which way it transforms. Each request's alphabet picks the codec (otp_codec.h).
+struct otpOperation {
+	int opcode;
+	const char *legacyToken;
+	int decode;		// Subtract the key instead of adding it
+};
+
+#define OTP_DRAIN_MAX_MS	30000	// Longest a draining engine waits on its connections
+#define OTP_DRAIN_SWEEP_MS	100	// How often it looks at them meanwhile
+
+// Admission and timeouts, set once before serving (daemon -q -r -i -d). Zero turns a limit off.
+struct otpLimits {
+	int maxRequests;	// Requests in flight across the whole daemon
+	int retryAfterMs;	// Suggested to clients in every OTP_ST_BUSY
+	int idleMs;		// A connection that moves no bytes for this long is closed
+	int deadlineMs;		// Time from a request's (or stream chunk's) header to its answer being sent
+};
+
+// What a daemon serves: one or more operations, dispatched on each request's opcode
+struct otpService {
+	const struct otpOperation *ops;
+	int numOps;
+};
+
+struct otpSession {
+	const struct otpService *svc;
+	int state;
+	struct otpHeader req;			// Request being served
+	const struct otpOperation *op;		// ... and what it asked for
+	otpCodecFn transform;			// ... in its alphabet
+	uint64_t startedAt, queuedAt;		// Header complete, result queued (us, for otp_stats)
+	int features;				// OTP_FEAT_* granted by OTP_OP_HELLO
+	int admitted;				// The request counts against the in-flight limit
+	int shed;				// Refuse every request as busy
+	int expired;				// Timed out; closing once the refusal is out
+	int draining;				// Closing at the next point between requests
+	uint64_t lastActive, deadline;		// Last bytes moved, and when the request must be done (us)
+
+	unsigned char hdrBuf[OTP_HDR_SIZE];	// Incoming header (or legacy token)
+	size_t hdrUsed;
+
+	char *body;				// Whole request, or legacy text
+	size_t bodyLen, bodyUsed, bodyCap;
+	const char *padKey;			// Key of a pad reference request, in the key store
+	int memfd;				// Descriptor passed for a memfd request, or -1
+	char *key;				// Legacy key
+	size_t keyUsed, keyCap;
+	size_t scan;				// Legacy "@@" search position
+	char *chunk;				// Stream chunk buffer, allocated on first use
+	int chunkFlags;
+	uint64_t drainLeft;			// Bytes of a refused request still to discard
+	int drainToEOF;
+
+	unsigned char outHdr[OTP_HDR_SIZE];	// Pending output: a header (or legacy token) ...
+	size_t outHdrLen;
+	char *outData;				// ... followed by data owned by the session
+	size_t outDataLen;
+	size_t outPos;
+	struct otpParallel *par;		// outData still being transformed by the pool, if not NULL
+};
+
+void sessionSetLimits(const struct otpLimits *l);
+int sessionSweepMs(void);
+void sessionInit(struct otpSession *s, const struct otpService *svc);
+void sessionShed(struct otpSession *s);
+void sessionFree(struct otpSession *s);
+size_t sessionReadSpace(struct otpSession *s, char **buf);
+void sessionReceived(struct otpSession *s, size_t n);
+void sessionReceivedFD(struct otpSession *s, int fd);
+void sessionEOF(struct otpSession *s);
+int sessionOutput(struct otpSession *s, struct iovec *iov);
+void sessionWait(struct otpSession *s);
+void sessionSent(struct otpSession *s, size_t n);
+int sessionDone(const struct otpSession *s);
+int sessionTimeout(const struct otpSession *s, uint64_t now);
+void sessionExpired(struct otpSession *s);
+void sessionDrain(struct otpSession *s);
+
+#endif
@@ -0,0 +1,194 @@
+/* Author: Brad Powell
+ * Date: 6/23/2019
+ * otp_stats: Daemon counters and latency histograms
+ * See otp_stats.h for what is counted.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <sys/mman.h>
+#include "otp_proto.h"
+#include "otp_stats.h"
+
+struct otpStats *otpStats;
+static uint64_t workerLimit;	// Busy connections that mean saturated; 0 for no limit
+
+// Map the shared counters. 'workers' is the most connections the engine serves at once, 0 if
+// it has no fixed limit. Returns 0, or -1 if the mapping fails.
+int otpStatsInit(int workers) {
+	void *p = mmap(NULL, sizeof(struct otpStats), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) return -1;
+	otpStats = p;		// Anonymous mappings start zeroed
+	workerLimit = workers;
+	return 0;
+}
+
+void otpStatsObserve(int phase, uint64_t usec) {
+	struct otpHistogram *h;
+	int b = 0;
+	if (otpStats == NULL) return;
+	h = &otpStats->phase[phase];
+	while (b < OTP_STAT_BUCKETS - 1 && usec > (1ULL << b)) b++;
+	__atomic_fetch_add(&h->bucket[b], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->sumUsec, usec, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+}
+
+// The connection that takes the last free worker starts the saturation clock; the first one to
+// give a worker back stops it. Returns 1 for that last one.
+int otpStatsConnOpen(void) {
+	if (otpStats == NULL) return 0;
+	if (__atomic_add_fetch(&otpStats->open, 1, __ATOMIC_RELAXED) != workerLimit) return 0;
+	__atomic_store_n(&otpStats->saturatedSince, otpNowUsec(), __ATOMIC_RELAXED);
+	return 1;
+}
+
+void otpStatsConnClose(void) {
+	uint64_t since;
+	if (otpStats == NULL) return;
+	if (__atomic_fetch_sub(&otpStats->open, 1, __ATOMIC_RELAXED) == workerLimit && workerLimit > 0) {
+		since = __atomic_load_n(&otpStats->saturatedSince, __ATOMIC_RELAXED);
+		if (since != 0) OTP_STAT_ADD(saturatedUsec, otpNowUsec() - since);
+	}
+}
+
+// Every worker is busy with a connection
+int otpStatsSaturated(void) {
+	return otpStats != NULL && workerLimit > 0 && __atomic_load_n(&otpStats->open, __ATOMIC_RELAXED) >= workerLimit;
+}
+
+// Count one more request in flight, unless that would pass 'limit' (0 for none). Returns 1 if
+// the request was admitted; release it with otpStatsRelease once it is answered.
+int otpStatsAdmit(uint64_t limit) {
+	if (otpStats == NULL) return 1;
+	if (__atomic_add_fetch(&otpStats->inFlight, 1, __ATOMIC_RELAXED) <= limit || limit == 0) return 1;
+	__atomic_fetch_sub(&otpStats->inFlight, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+void otpStatsRelease(void) {
+	if (otpStats != NULL) __atomic_fetch_sub(&otpStats->inFlight, 1, __ATOMIC_RELAXED);
+}
+
+/************** Prometheus text format ************************/
+
+struct text {
+	char *buf;
+	size_t len, cap;
+};
+
+static void put(struct text *t, const char *fmt, ...) {
+	va_list ap;
+	int n;
+	char *grown;
+
+	for (;;) {
+		va_start(ap, fmt);
+		n = vsnprintf(t->buf + t->len, t->cap - t->len, fmt, ap);
+		va_end(ap);
+		if (n < 0) return;
+		if (t->len + n < t->cap) break;
+		grown = realloc(t->buf, t->cap * 2 + n);
+		if (grown == NULL) return;
+		t->buf = grown;
+		t->cap = t->cap * 2 + n;
+	}
+	t->len += n;
+}
+
+static void metric(struct text *t, const char *name, const char *type, const char *help) {
+	put(t, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static uint64_t get(const uint64_t *v) {
+	return __atomic_load_n(v, __ATOMIC_RELAXED);
+}
+
+static const char *opName(int op) {
+	switch (op) {
+		case OTP_OP_ENCODE:	return "encode";
+		case OTP_OP_DECODE:	return "decode";
+		default:		return NULL;
+	}
+}
+
+static const char *statusName(int status) {
+	switch (status) {
+		case OTP_ST_WRONG_SERVER:	return "wrong_server";
+		case OTP_ST_BAD_REQUEST:	return "bad_request";
+		case OTP_ST_SHORT_KEY:		return "short_key";
+		case OTP_ST_NO_MEMORY:		return "no_memory";
+		case OTP_ST_BAD_CHAR:		return "bad_char";
+		case OTP_ST_NO_KEY:		return "no_key";
+		case OTP_ST_KEY_USED:		return "key_used";
+		case OTP_ST_BUSY:		return "busy";
+		case OTP_ST_TIMEOUT:		return "timeout";
+		default:			return NULL;
+	}
+}
+
+// Render every metric. Returns a malloc'd buffer of '*len' bytes, or NULL.
+char *otpStatsFormat(size_t *len) {
+	static const char *phaseNames[OTP_PHASES] = { "receive", "transform", "send" };
+	struct text t = { malloc(4096), 0, 4096 };
+	const struct otpStats *s = otpStats;
+	uint64_t cumulative;
+	int i, b;
+
+	if (t.buf == NULL || s == NULL) {
+		free(t.buf);
+		return NULL;
+	}
+	metric(&t, "otp_connections_accepted_total", "counter", "Connections accepted.");
+	put(&t, "otp_connections_accepted_total %llu\n", (unsigned long long)get(&s->accepted));
+	metric(&t, "otp_connections_open", "gauge", "Connections being served.");
+	put(&t, "otp_connections_open %llu\n", (unsigned long long)get(&s->open));
+	metric(&t, "otp_accept_errors_total", "counter", "Failed accept calls.");
+	put(&t, "otp_accept_errors_total %llu\n", (unsigned long long)get(&s->acceptErrors));
+	metric(&t, "otp_fork_errors_total", "counter", "Failed forks of serving processes.");
+	put(&t, "otp_fork_errors_total %llu\n", (unsigned long long)get(&s->forkErrors));
+	metric(&t, "otp_saturated_seconds_total", "counter", "Time every worker was busy.");
+	put(&t, "otp_saturated_seconds_total %.6f\n", get(&s->saturatedUsec) / 1e6);
+	metric(&t, "otp_connections_shed_total", "counter", "Connections answered busy because every worker was.");
+	put(&t, "otp_connections_shed_total %llu\n", (unsigned long long)get(&s->shed));
+	metric(&t, "otp_connections_timed_out_total", "counter", "Connections closed for idling or missing a deadline.");
+	put(&t, "otp_connections_timed_out_total %llu\n", (unsigned long long)get(&s->timedOut));
+
+	metric(&t, "otp_requests_in_flight", "gauge", "Requests admitted and not yet answered.");
+	put(&t, "otp_requests_in_flight %llu\n", (unsigned long long)get(&s->inFlight));
+	metric(&t, "otp_requests_completed_total", "counter", "Requests answered with a result.");
+	for (i = 0; i < OTP_STAT_OPS; i++) {
+		if (opName(i) != NULL)
+			put(&t, "otp_requests_completed_total{op=\"%s\"} %llu\n", opName(i),
+					(unsigned long long)get(&s->completed[i]));
+	}
+	metric(&t, "otp_requests_rejected_total", "counter", "Requests refused, by reason.");
+	for (i = 0; i < OTP_STAT_STATUSES; i++) {
+		if (statusName(i) != NULL)
+			put(&t, "otp_requests_rejected_total{status=\"%s\"} %llu\n", statusName(i),
+					(unsigned long long)get(&s->rejected[i]));
+	}
+	metric(&t, "otp_received_bytes_total", "counter", "Bytes read from clients.");
+	put(&t, "otp_received_bytes_total %llu\n", (unsigned long long)get(&s->bytesIn));
+	metric(&t, "otp_sent_bytes_total", "counter", "Bytes written to clients.");
+	put(&t, "otp_sent_bytes_total %llu\n", (unsigned long long)get(&s->bytesOut));
+
+	metric(&t, "otp_phase_seconds", "histogram", "Time per request in each phase.");
+	for (i = 0; i < OTP_PHASES; i++) {
+		for (b = 0, cumulative = 0; b < OTP_STAT_BUCKETS; b++) {
+			cumulative += get(&s->phase[i].bucket[b]);
+			if (b < OTP_STAT_BUCKETS - 1)
+				put(&t, "otp_phase_seconds_bucket{phase=\"%s\",le=\"%g\"} %llu\n", phaseNames[i],
+						(double)(1ULL << b) / 1e6, (unsigned long long)cumulative);
+			else
+				put(&t, "otp_phase_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %llu\n", phaseNames[i],
+						(unsigned long long)cumulative);
+		}
+		put(&t, "otp_phase_seconds_sum{phase=\"%s\"} %.6f\n", phaseNames[i], get(&s->phase[i].sumUsec) / 1e6);
+		put(&t, "otp_phase_seconds_count{phase=\"%s\"} %llu\n", phaseNames[i],
+				(unsigned long long)get(&s->phase[i].count));
+	}
+	*len = t.len;
+	return t.buf;
+}
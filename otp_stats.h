@@ -0,0 +1,66 @@
+/* Author: Brad Powell
+ * Date: 6/23/2019
+ * otp_stats: Daemon counters and latency histograms
+ * The numbers live in one shared anonymous mapping made before any workers start, so forked
+ * workers, threads and the event loop all add to the same counters. Every update is a single
+ * relaxed atomic add: no locks and no syscalls beyond reading the clock. Clients fetch them with an
+ * OTP_OP_STATS request (otp_enc -S port), which is answered in the Prometheus text format.
+ *
+ * Per request the daemon times three phases: receive (header complete to body complete),
+ * transform and send (result queued to fully written). Histogram buckets double from 1 us up.
+ * The daemon counts as saturated while every worker is busy with a connection, which is the time
+ * new connections sit in the listen queue; the event loop has no such limit.
+ *
+ * The in-flight request count doubles as the daemon's admission control (otp_session.h): it is
+ * shared by every worker, so the limit holds for the daemon as a whole.
+ */
+
+#ifndef OTP_STATS_H
+#define OTP_STATS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define OTP_PHASE_RECEIVE	0
+#define OTP_PHASE_TRANSFORM	1
+#define OTP_PHASE_SEND		2
+#define OTP_PHASES		3
+
+#define OTP_STAT_BUCKETS	25	// 1 us .. 2^23 us (about 8 s), then +Inf
+#define OTP_STAT_OPS		8	// Indexed by opcode
+#define OTP_STAT_STATUSES	16	// Indexed by status
+
+struct otpHistogram {
+	uint64_t bucket[OTP_STAT_BUCKETS];	// Not cumulative; formatting adds them up
+	uint64_t sumUsec;
+	uint64_t count;
+};
+
+struct otpStats {
+	uint64_t accepted, acceptErrors, forkErrors;
+	uint64_t open;				// Connections being served right now
+	uint64_t inFlight;			// Requests admitted and not yet answered (otpStatsAdmit)
+	uint64_t shed;				// Connections turned away while every worker was busy
+	uint64_t timedOut;			// Connections closed for idling or missing a deadline
+	uint64_t saturatedUsec, saturatedSince;
+	uint64_t completed[OTP_STAT_OPS];
+	uint64_t rejected[OTP_STAT_STATUSES];
+	uint64_t bytesIn, bytesOut;
+	struct otpHistogram phase[OTP_PHASES];
+};
+
+extern struct otpStats *otpStats;	// NULL (and every update a no-op) until otpStatsInit
+
+#define OTP_STAT_ADD(field, n) \
+	do { if (otpStats) __atomic_fetch_add(&otpStats->field, (n), __ATOMIC_RELAXED); } while (0)
+
+int otpStatsInit(int workers);
+void otpStatsObserve(int phase, uint64_t usec);
+int otpStatsConnOpen(void);
+void otpStatsConnClose(void);
+int otpStatsSaturated(void);
+int otpStatsAdmit(uint64_t limit);
+void otpStatsRelease(void);
+char *otpStatsFormat(size_t *len);
+
+#endif
@@ -0,0 +1,297 @@
+/* Author: Brad Powell
+ * Date: 6/25/2019
+ * otp_stream: Streaming mode of otp_enc/otp_dec (-s, or a text of "-")
+ * Text is read, sent, answered and written out at the same time over one connection. Text is
+ * cut into CHUNK frames of up to OTP_MAX_CHUNK characters, and up to STREAM_WINDOW of them may be
+ * in flight before the first answer is back. One poll loop feeds the socket, reads the answers and
+ * reads more text whenever there is room, so memory use is a few fixed buffers however long the
+ * stream is. When the text runs dry for a moment, what has been read so far goes out as a short
+ * chunk instead of waiting for a full one, so interactive pipelines don't stall.
+ *
+ * A whole stream (standard input) may span many lines. Newlines are not part of the alphabet, so
+ * they are taken out of the text and key before sending, and put back in the answer at the places
+ * they came from. Otherwise the text ends at its first newline, as in the other modes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include "otp_proto.h"
+#include "otp_codec.h"
+#include "otp_client.h"
+
+#define STREAM_WINDOW	8	// Chunks sent ahead of their answers
+#define STREAM_BREAKS	4096	// Newlines remembered per chunk; a chunk ends early at this many
+
+// A chunk that has been sent and not answered yet
+struct sentChunk {
+	size_t len;
+	int numBreaks;
+	uint32_t breaks[STREAM_BREAKS];	// A newline goes before each of these offsets of the answer
+};
+
+struct stream {
+	int fd, textFD, outFD;
+	FILE *key;
+	const struct otpCodec *codec;
+	int whole;			// Standard input: all of it, newlines kept
+	int textDone;			// No more text to read
+	int building;			// A chunk has been started
+	int endQueued;			// The chunk flagged OTP_F_END has been queued
+
+	char raw[OTP_MAX_CHUNK];	// Text read but not yet put in a chunk
+	size_t rawPos, rawLen;
+
+	unsigned char frame[OTP_HDR_SIZE + 2 * OTP_MAX_CHUNK];	// Chunk being built or sent: header, text, key
+	size_t frameLen, framePos;	// framePos < frameLen while it is being sent
+	size_t textLen;			// Text in the chunk being built
+
+	struct sentChunk window[STREAM_WINDOW];
+	unsigned long long built, answered;	// Chunks queued, and answers written out
+
+	unsigned char hdrIn[OTP_HDR_SIZE];	// Answer coming back
+	size_t hdrUsed, dataUsed, dataLen;
+	int inData;
+	char answer[OTP_MAX_CHUNK];
+	char out[OTP_MAX_CHUNK + STREAM_BREAKS];	// Answer with its newlines put back
+};
+
+static int readyToRead(int fd) {
+	struct pollfd pfd = { fd, POLLIN, 0 };
+	return poll(&pfd, 1, 0) > 0;
+}
+
+static int writeAll(int fd, const char *buf, size_t len) {
+	ssize_t n;
+	while (len > 0) {
+		n = write(fd, buf, len);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+// Read 'len' characters of key into 'buf'. A whole stream skips the key's newlines, so keys can be
+// joined end to end; otherwise the key ends at its first one. Returns 0, or -1 if it runs out.
+static int readKey(struct stream *st, char *buf, size_t len) {
+	size_t have = 0, n, i, j;
+	while (have < len) {
+		n = fread(buf + have, 1, len - have, st->key);
+		if (n == 0) return -1;
+		if (st->codec->lines) {
+			for (i = j = have; i < have + n; i++) {
+				if (buf[i] != '\n') buf[j++] = buf[i];
+				else if (!st->whole) return -1;
+			}
+			n = j - have;
+		}
+		have += n;
+	}
+	return 0;
+}
+
+// Finish the chunk being built: add its key, check it and queue it for sending. Returns OTP_ST_OK
+// or the OTP_ST_* status that ends the stream.
+static int queueChunk(struct stream *st) {
+	struct otpHeader hdr;
+	char *text = (char *)st->frame + OTP_HDR_SIZE;
+	struct sentChunk *c = &st->window[st->built % STREAM_WINDOW];
+
+	otpPhase(OTP_CPHASE_LOAD);
+	if (readKey(st, text + st->textLen, st->textLen) < 0) return OTP_ST_SHORT_KEY;
+	otpPhase(OTP_CPHASE_VALIDATE);
+	if (!st->codec->validate(text, 2 * st->textLen)) return OTP_ST_BAD_CHAR;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.opcode = OTP_OP_CHUNK;
+	hdr.flags = (st->textDone && st->rawPos == st->rawLen) ? OTP_F_END : 0;
+	hdr.payloadLen = hdr.keyLen = st->textLen;
+	otpPackHeader(&hdr, st->frame);
+	st->frameLen = OTP_HDR_SIZE + 2 * st->textLen;
+	st->framePos = 0;
+	c->len = st->textLen;
+	st->textLen = 0;
+	st->building = 0;
+	st->endQueued = (hdr.flags & OTP_F_END) != 0;
+	st->built++;
+	otpTimingsCount(NULL, 0, c->len);
+	return OTP_ST_OK;
+}
+
+// Move read text into the chunk being built, taking out newlines. Returns 1 if the chunk is full.
+static int fillChunk(struct stream *st) {
+	struct sentChunk *c = &st->window[st->built % STREAM_WINDOW];
+	char *text = (char *)st->frame + OTP_HDR_SIZE;
+	char ch;
+
+	if (!st->building) {
+		c->numBreaks = 0;
+		st->building = 1;
+	}
+	while (st->rawPos < st->rawLen && st->textLen < OTP_MAX_CHUNK) {
+		ch = st->raw[st->rawPos];
+		if (ch == '\n' && st->codec->lines) {
+			if (!st->whole) {
+				st->textDone = 1;	// The rest of the file isn't part of the text
+				st->rawPos = st->rawLen;
+				return 0;
+			}
+			if (c->numBreaks == STREAM_BREAKS) return 1;
+			c->breaks[c->numBreaks++] = st->textLen;
+			st->rawPos++;
+			continue;
+		}
+		text[st->textLen++] = ch;
+		st->rawPos++;
+	}
+	return st->textLen == OTP_MAX_CHUNK;
+}
+
+static int readText(struct stream *st) {
+	ssize_t n;
+	otpPhase(OTP_CPHASE_LOAD);
+	n = read(st->textFD, st->raw, sizeof(st->raw));
+	if (n < 0) return errno == EINTR ? 0 : -1;
+	st->rawPos = 0;
+	st->rawLen = n;
+	if (n == 0) st->textDone = 1;
+	return 0;
+}
+
+// Answer for the oldest chunk in flight is complete: put its newlines back and write it out
+static int writeAnswer(struct stream *st) {
+	struct sentChunk *c = &st->window[st->answered % STREAM_WINDOW];
+	size_t from = 0, len = 0;
+	int i;
+
+	for (i = 0; i < c->numBreaks; i++) {
+		memcpy(st->out + len, st->answer + from, c->breaks[i] - from);
+		len += c->breaks[i] - from;
+		st->out[len++] = '\n';
+		from = c->breaks[i];
+	}
+	memcpy(st->out + len, st->answer + from, c->len - from);
+	len += c->len - from;
+	st->answered++;
+	otpPhase(OTP_CPHASE_WRITE);
+	return writeAll(st->outFD, st->out, len);
+}
+
+// Take whatever the daemon has sent. Returns OTP_ST_OK, its OTP_ST_* refusal, or -1.
+static int receive(struct stream *st) {
+	struct otpHeader hdr;
+	ssize_t n;
+
+	if (!st->inData) {
+		n = recv(st->fd, st->hdrIn + st->hdrUsed, OTP_HDR_SIZE - st->hdrUsed, 0);
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return OTP_ST_OK;
+		if (n <= 0) return -1;
+		if ((st->hdrUsed += n) < OTP_HDR_SIZE) return OTP_ST_OK;
+		st->hdrUsed = 0;
+		if (otpUnpackHeader(st->hdrIn, &hdr) < 0) return -1;
+		if (hdr.opcode == OTP_OP_REJECT) return hdr.status ? hdr.status : OTP_ST_BAD_REQUEST;
+		if (hdr.opcode != OTP_OP_CHUNK || st->answered == st->built ||
+				hdr.payloadLen != st->window[st->answered % STREAM_WINDOW].len)
+			return -1;
+		st->inData = 1;
+		st->dataLen = hdr.payloadLen;
+		st->dataUsed = 0;
+	} else {
+		n = recv(st->fd, st->answer + st->dataUsed, st->dataLen - st->dataUsed, 0);
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return OTP_ST_OK;
+		if (n <= 0) return -1;
+		st->dataUsed += n;
+	}
+	if (st->inData && st->dataUsed == st->dataLen) {
+		st->inData = 0;
+		if (writeAnswer(st) < 0) return -1;
+	}
+	return OTP_ST_OK;
+}
+
+// Stream the text read from 'textFD', and as much of 'key' as it needs, to the daemon, writing the
+// answers to 'outFD' as they come back. With 'whole' the text is everything up to end of file and
+// keeps its newlines (see above); otherwise it ends at its first newline, which is not written.
+// Returns OTP_ST_OK, an OTP_ST_* status if the input or the daemon refused, or -1 on errors.
+int otpStreamTransfer(int fd, int opcode, int alphabet, int textFD, FILE *key, int outFD, int whole) {
+	struct stream *st = calloc(1, sizeof(*st));
+	struct otpHeader hdr;
+	struct pollfd pfd[2];
+	int flags = fcntl(fd, F_GETFL);
+	int ret = -1, status;
+	ssize_t n;
+
+	if (st == NULL) return -1;
+	st->fd = fd;
+	st->textFD = textFD;
+	st->outFD = outFD;
+	st->key = key;
+	st->codec = otpCodecFor(alphabet);
+	st->whole = whole;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.opcode = opcode;
+	hdr.flags = OTP_F_STREAM;
+	hdr.alphabet = alphabet;
+	if (otpSendHeader(fd, &hdr) < 0) goto done;
+	fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+
+	while (!st->endQueued || st->framePos < st->frameLen || st->answered < st->built) {
+		// Build the next chunk from the text read so far, reading more while it is there at once.
+		// Once the text runs dry, whatever was collected goes out as it is.
+		while (!st->endQueued && st->framePos == st->frameLen && st->built - st->answered < STREAM_WINDOW) {
+			if (!fillChunk(st) && !st->textDone) {
+				if (readyToRead(textFD)) {
+					if (readText(st) < 0) goto done;
+					continue;
+				}
+				if (!st->building || (st->textLen == 0 && st->window[st->built % STREAM_WINDOW].numBreaks == 0))
+					break;		// Nothing to send; wait for text below
+			}
+			if ((status = queueChunk(st)) != OTP_ST_OK) {
+				ret = status;
+				goto done;
+			}
+		}
+
+		pfd[0].fd = fd;
+		pfd[0].events = POLLIN | (st->framePos < st->frameLen ? POLLOUT : 0);
+		pfd[1].fd = (st->framePos == st->frameLen && !st->textDone && st->rawPos == st->rawLen &&
+				st->built - st->answered < STREAM_WINDOW) ? textFD : -1;
+		pfd[1].events = POLLIN;
+		// Waiting on the text can take as long as it likes, but not on answers owed by the daemon.
+		// Time in here is sending while a chunk is going out, then waiting if answers are owed.
+		otpPhase(st->framePos < st->frameLen ? OTP_CPHASE_SEND : st->answered < st->built ? OTP_CPHASE_WAIT : OTP_CPHASE_LOAD);
+		n = poll(pfd, 2, (st->answered < st->built || st->framePos < st->frameLen) ? otpTimeout() : -1);
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR) continue;
+			if (n == 0) errno = ETIMEDOUT;
+			goto done;
+		}
+		if ((pfd[0].revents & POLLOUT) && st->framePos < st->frameLen) {
+			n = send(fd, st->frame + st->framePos, st->frameLen - st->framePos, MSG_NOSIGNAL);
+			if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) goto done;
+			if (n > 0) st->framePos += n;
+		}
+		if (pfd[0].revents & (POLLIN | POLLHUP | POLLERR)) otpPhase(OTP_CPHASE_RECEIVE);
+		if ((pfd[0].revents & (POLLIN | POLLHUP | POLLERR)) && (status = receive(st)) != OTP_ST_OK) {
+			ret = status;
+			goto done;
+		}
+		if (pfd[1].fd >= 0 && (pfd[1].revents & (POLLIN | POLLHUP | POLLERR)) && readText(st) < 0) goto done;
+	}
+	ret = OTP_ST_OK;
+done:
+	fcntl(fd, F_SETFL, flags);
+	free(st);
+	return ret;
+}
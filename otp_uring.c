@@ -0,0 +1,421 @@
+/* Author: Brad Powell
+ * Date: 6/26/2019
+ * otp_uring: io_uring serving engine (-e uring)
+ * See otp_uring.h. The ring is driven with the raw system calls, so nothing beyond the kernel
+ * headers is needed to build it.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include "otp_stats.h"
+#include "otp_uring.h"
+
+#define URING_CONNS	1024	// Connections served at once; more wait in the listen queue
+#define URING_ENTRIES	256	// Submission queue slots
+#define URING_LISTENERS	2
+#define URING_TIMER	(URING_LISTENERS + 1)	// user_data of the timeout sweep
+#define URING_CANCEL	(URING_LISTENERS + 2)	// ... and of cancellations, whose results don't matter
+#define URING_DRAIN	(URING_LISTENERS + 3)	// ... and of the poll on the drain eventfd
+
+// One connection. They all live in one arena registered with the ring, so reads into a session's
+// header buffer can use the registered (fixed) buffer and skip the per-call page pinning.
+struct uringConn {
+	struct otpSession s;
+	int fd;
+	int isUnix;		// Reads use recvmsg, so memfd requests can pass their descriptor
+	int sending;		// The operation in flight is a send
+	int inUse;
+	struct iovec iov[2];
+	struct msghdr msg;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	struct uringConn *nextFree;
+};
+
+static struct {
+	int fd;
+	unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+	unsigned *cqHead, *cqTail, *cqMask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned sqEntries;
+	unsigned tail, submitted;	// Our copy of the SQ tail, and how much of it the kernel has
+	int fixed;			// The connection arena is registered as buffer 0
+} ring;
+
+static const struct otpService *service;
+static const int *listeners;
+static int numListeners;
+static int acceptArmed[URING_LISTENERS];
+static int draining;		// No more accepts; finish once the connections are gone
+static int live;		// Connections in use
+static uint64_t drainUntil;	// When a drain gives up on the connections left (usec)
+static struct uringConn *arena, *freeConns;
+static struct __kernel_timespec sweepEvery;
+
+static int uringSetup(unsigned entries, struct io_uring_params *p) {
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uringEnter(unsigned toSubmit, unsigned minComplete, unsigned flags) {
+	return syscall(__NR_io_uring_enter, ring.fd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+static int uringRegister(unsigned opcode, void *arg, unsigned nrArgs) {
+	return syscall(__NR_io_uring_register, ring.fd, opcode, arg, nrArgs);
+}
+
+/************** Ring ************************/
+
+// Hand every queued entry to the kernel, and wait for at least one completion if 'wait'
+static int submit(int wait) {
+	int n;
+	__atomic_store_n(ring.sqTail, ring.tail, __ATOMIC_RELEASE);
+	do {
+		n = uringEnter(ring.tail - ring.submitted, wait, wait ? IORING_ENTER_GETEVENTS : 0);
+	} while (n < 0 && errno == EINTR);
+	if (n > 0) ring.submitted += n;
+	return n;
+}
+
+// Next free submission entry, cleared. A full queue is flushed first; without SQPOLL the kernel
+// takes every entry during io_uring_enter, so that always makes room.
+static struct io_uring_sqe *getSqe(void) {
+	struct io_uring_sqe *sqe;
+	unsigned i;
+	if (ring.tail - __atomic_load_n(ring.sqHead, __ATOMIC_ACQUIRE) == ring.sqEntries) submit(0);
+	i = ring.tail & *ring.sqMask;
+	sqe = &ring.sqes[i];
+	memset(sqe, 0, sizeof(*sqe));
+	ring.sqArray[i] = i;
+	ring.tail++;
+	return sqe;
+}
+
+// The kernel must offer every operation the engine uses
+static int probeOps(void) {
+	static const int needed[] = { IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_RECVMSG, IORING_OP_SENDMSG,
+			IORING_OP_READ_FIXED, IORING_OP_TIMEOUT, IORING_OP_ASYNC_CANCEL };
+	size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe = calloc(1, size);
+	int ok = probe != NULL && uringRegister(IORING_REGISTER_PROBE, probe, 256) == 0;
+	size_t i;
+
+	for (i = 0; ok && i < sizeof(needed) / sizeof(needed[0]); i++) {
+		if (needed[i] > probe->last_op || !(probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED)) ok = 0;
+	}
+	free(probe);
+	return ok ? 0 : -1;
+}
+
+static int ringInit(void) {
+	struct io_uring_params p;
+	size_t sqSize, cqSize;
+	char *sq, *cq;
+
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = 2 * URING_CONNS;		// Every connection and listener has at most one operation out
+#ifdef IORING_SETUP_DEFER_TASKRUN
+	// Only this thread touches the ring, so completions can wait until it asks for them instead
+	// of interrupting it; kernels before 6.1 refuse the flags and get a plain ring
+	p.flags |= IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+	if ((ring.fd = uringSetup(URING_ENTRIES, &p)) < 0 && errno == EINVAL) {
+		p.flags &= ~(IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN);
+		ring.fd = uringSetup(URING_ENTRIES, &p);
+	}
+#else
+	ring.fd = uringSetup(URING_ENTRIES, &p);
+#endif
+	if (ring.fd < 0) return -1;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP) || probeOps() < 0) {
+		close(ring.fd);
+		errno = ENOSYS;
+		return -1;
+	}
+	sqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cqSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (cqSize > sqSize) sqSize = cqSize;
+	sq = mmap(NULL, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED) return -1;
+	cq = sq;			// One mapping for both rings
+	ring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+	if (ring.sqes == MAP_FAILED) return -1;
+	ring.sqHead = (unsigned *)(sq + p.sq_off.head);
+	ring.sqTail = (unsigned *)(sq + p.sq_off.tail);
+	ring.sqMask = (unsigned *)(sq + p.sq_off.ring_mask);
+	ring.sqArray = (unsigned *)(sq + p.sq_off.array);
+	ring.cqHead = (unsigned *)(cq + p.cq_off.head);
+	ring.cqTail = (unsigned *)(cq + p.cq_off.tail);
+	ring.cqMask = (unsigned *)(cq + p.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	ring.sqEntries = p.sq_entries;
+	ring.tail = ring.submitted = *ring.sqTail;
+	return 0;
+}
+
+/************** Connections ************************/
+
+static void armAccept(int i) {
+	struct io_uring_sqe *sqe = getSqe();
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = listeners[i];
+	sqe->user_data = i + 1;		// Small numbers are listeners, anything else a connection
+	acceptArmed[i] = 1;
+}
+
+static void closeConn(struct uringConn *c) {
+	int i;
+	c->inUse = 0;
+	close(c->fd);
+	sessionFree(&c->s);
+	otpStatsConnClose();
+	c->nextFree = freeConns;
+	freeConns = c;
+	live--;
+	for (i = 0; i < numListeners && !draining; i++) {
+		if (!acceptArmed[i]) armAccept(i);	// A slot is free again
+	}
+}
+
+// Queue the next operation the session wants: a send of its pending output, or a read. Closes
+// the connection once the session is done.
+static void advance(struct uringConn *c) {
+	struct io_uring_sqe *sqe;
+	char *buf;
+	size_t space;
+	int n;
+
+	while (!sessionDone(&c->s)) {
+		if ((n = sessionOutput(&c->s, c->iov)) > 0) {
+			memset(&c->msg, 0, sizeof(c->msg));
+			c->msg.msg_iov = c->iov;
+			c->msg.msg_iovlen = n;
+			sqe = getSqe();
+			sqe->opcode = IORING_OP_SENDMSG;
+			sqe->fd = c->fd;
+			sqe->addr = (uintptr_t)&c->msg;
+			sqe->len = 1;
+			sqe->msg_flags = MSG_NOSIGNAL;
+			sqe->user_data = (uintptr_t)c;
+			c->sending = 1;
+			return;
+		}
+		if ((space = sessionReadSpace(&c->s, &buf)) == 0) {
+			sessionWait(&c->s);	// Output still being transformed by the pool
+			continue;
+		}
+		sqe = getSqe();
+		sqe->fd = c->fd;
+		sqe->user_data = (uintptr_t)c;
+		c->sending = 0;
+		if (c->isUnix) {
+			c->iov[0].iov_base = buf;
+			c->iov[0].iov_len = space;
+			memset(&c->msg, 0, sizeof(c->msg));
+			c->msg.msg_iov = c->iov;
+			c->msg.msg_iovlen = 1;
+			c->msg.msg_control = c->control.buf;
+			c->msg.msg_controllen = sizeof(c->control.buf);
+			sqe->opcode = IORING_OP_RECVMSG;
+			sqe->addr = (uintptr_t)&c->msg;
+			sqe->len = 1;
+			sqe->msg_flags = MSG_CMSG_CLOEXEC;
+		} else if (ring.fixed && buf >= (char *)arena && buf < (char *)(arena + URING_CONNS)) {
+			sqe->opcode = IORING_OP_READ_FIXED;	// Header bytes land in the registered arena
+			sqe->addr = (uintptr_t)buf;
+			sqe->len = space;
+			sqe->buf_index = 0;
+		} else {
+			sqe->opcode = IORING_OP_RECV;
+			sqe->addr = (uintptr_t)buf;
+			sqe->len = space;
+		}
+		return;
+	}
+	closeConn(c);
+}
+
+static void connDone(struct uringConn *c, int res) {
+	struct cmsghdr *cmsg;
+	int passed;
+
+	if (res == -EINTR || res == -EAGAIN || res == -ECANCELED) {
+		advance(c);		// Try the same thing again, or whatever an expired session wants now
+		return;
+	}
+	if (res < 0) {
+		closeConn(c);
+		return;
+	}
+	if (c->sending) {
+		sessionSent(&c->s, res);
+	} else {
+		if (c->isUnix && res > 0) {
+			cmsg = CMSG_FIRSTHDR(&c->msg);
+			if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+				memcpy(&passed, CMSG_DATA(cmsg), sizeof(passed));
+				sessionReceivedFD(&c->s, passed);
+			}
+		}
+		if (res == 0) sessionEOF(&c->s);
+		else sessionReceived(&c->s, res);
+	}
+	advance(c);
+}
+
+static void acceptDone(int i, int res) {
+	struct uringConn *c;
+
+	acceptArmed[i] = 0;
+	if (res < 0) {
+		if (res != -EINTR && res != -EAGAIN && res != -ECONNABORTED && res != -ECANCELED) {
+			fprintf(stderr, "ERROR on accept\n");
+			OTP_STAT_ADD(acceptErrors, 1);
+		}
+	} else {
+		OTP_STAT_ADD(accepted, 1);
+		otpStatsConnOpen();
+		c = freeConns;		// Accepts are only armed while a slot is free
+		freeConns = c->nextFree;
+		c->fd = res;
+		c->isUnix = (i == 1);	// The second listener is always the unix socket
+		c->inUse = 1;
+		live++;
+		sessionInit(&c->s, service);
+		if (draining) sessionDrain(&c->s);	// Taken as the drain began
+		advance(c);
+	}
+	if (freeConns != NULL && !draining) armAccept(i);
+}
+
+static void armTimer(void) {
+	struct io_uring_sqe *sqe = getSqe();
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->addr = (uintptr_t)&sweepEvery;
+	sqe->len = 1;
+	sqe->user_data = URING_TIMER;
+}
+
+// Expire the connections whose time is up. Each has an operation in flight; cancelling it brings
+// the connection back through connDone, where the session sends its refusal or is closed.
+static void sweep(void) {
+	struct io_uring_sqe *sqe;
+	uint64_t now = otpNowUsec();
+	int i;
+
+	for (i = 0; i < URING_CONNS; i++) {
+		if (!arena[i].inUse || sessionTimeout(&arena[i].s, now) != 0) continue;
+		sessionExpired(&arena[i].s);
+		sqe = getSqe();
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->addr = (uintptr_t)&arena[i];
+		sqe->user_data = URING_CANCEL;
+	}
+	armTimer();
+}
+
+static void cancel(uint64_t userData) {
+	struct io_uring_sqe *sqe = getSqe();
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = userData;
+	sqe->user_data = URING_CANCEL;
+}
+
+// Handing over: stop accepting, and close every connection that is between requests by
+// cancelling its read, which brings it back through connDone to be closed. The sweep, every
+// OTP_DRAIN_SWEEP_MS from now on, closes new ones that don't start a request, and the loop stops
+// waiting for the rest after OTP_DRAIN_MAX_MS.
+static void drain(void) {
+	int armed = sweepEvery.tv_sec > 0 || sweepEvery.tv_nsec > 0;
+	int i;
+
+	draining = 1;
+	drainUntil = otpNowUsec() + OTP_DRAIN_MAX_MS * 1000ULL;
+	if (!armed || sweepEvery.tv_sec * 1000 + sweepEvery.tv_nsec / 1000000 > OTP_DRAIN_SWEEP_MS) {
+		sweepEvery.tv_sec = 0;
+		sweepEvery.tv_nsec = OTP_DRAIN_SWEEP_MS * 1000000L;
+		if (!armed) armTimer();		// Otherwise it takes the new interval when it next fires
+	}
+	for (i = 0; i < numListeners; i++) {
+		if (acceptArmed[i]) cancel(i + 1);
+	}
+	for (i = 0; i < URING_CONNS; i++) {
+		if (!arena[i].inUse) continue;
+		sessionDrain(&arena[i].s);
+		if (sessionDone(&arena[i].s)) cancel((uintptr_t)&arena[i]);
+	}
+}
+
+// Serve from this thread until drained, or forever. Returns -1 at once if io_uring can't be used here.
+int otpRunUring(const int *listenFDs, int count, int drainFD, const struct otpService *svc) {
+	struct io_uring_cqe *cqe;
+	struct io_uring_sqe *sqe;
+	struct iovec whole;
+	unsigned head, tail;
+	int i;
+
+	if (ringInit() < 0) return -1;
+	service = svc;
+	listeners = listenFDs;
+	numListeners = count < URING_LISTENERS ? count : URING_LISTENERS;
+	arena = mmap(NULL, URING_CONNS * sizeof(*arena), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (arena == MAP_FAILED) return -1;
+	for (i = URING_CONNS - 1; i >= 0; i--) {
+		arena[i].nextFree = freeConns;
+		freeConns = &arena[i];
+	}
+	// Fixed buffers are only an optimisation; a low RLIMIT_MEMLOCK just means plain reads
+	whole.iov_base = arena;
+	whole.iov_len = URING_CONNS * sizeof(*arena);
+	ring.fixed = uringRegister(IORING_REGISTER_BUFFERS, &whole, 1) == 0;
+
+	for (i = 0; i < numListeners; i++) armAccept(i);
+	if (drainFD >= 0) {
+		sqe = getSqe();
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = drainFD;
+		sqe->poll32_events = POLLIN;
+		sqe->user_data = URING_DRAIN;
+	}
+	if ((i = sessionSweepMs()) >= 0) {
+		sweepEvery.tv_sec = i / 1000;
+		sweepEvery.tv_nsec = i % 1000 * 1000000L;
+		armTimer();
+	}
+	while (!draining || (live > 0 && otpNowUsec() < drainUntil)) {
+		// Everything queued since the last pass goes to the kernel in one call
+		if (submit(1) < 0 && errno != EBUSY) {
+			perror("ERROR on io_uring_enter");
+			exit(1);
+		}
+		head = *ring.cqHead;
+		tail = __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++) {
+			cqe = &ring.cqes[head & *ring.cqMask];
+			if (cqe->user_data <= URING_LISTENERS) acceptDone(cqe->user_data - 1, cqe->res);
+			else if (cqe->user_data == URING_TIMER) sweep();
+			else if (cqe->user_data == URING_DRAIN) drain();
+			else if (cqe->user_data != URING_CANCEL) connDone((struct uringConn *)(uintptr_t)cqe->user_data, cqe->res);
+		}
+		__atomic_store_n(ring.cqHead, head, __ATOMIC_RELEASE);
+	}
+	for (i = 0; i < URING_CONNS; i++) {	// Out of time; the ring is not used again
+		if (arena[i].inUse) closeConn(&arena[i]);
+	}
+	return 0;
+}
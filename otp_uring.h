@@ -0,0 +1,25 @@
+/* Author: Brad Powell
+ * Date: 6/26/2019
+ * otp_uring: io_uring serving engine (-e uring)
+ * Like the epoll engine, one thread serves every connection, but instead of asking which sockets
+ * are ready and then making a recv or send call for each, it queues the accepts, receives and
+ * sends themselves on an io_uring and hands all of them to the kernel in one io_uring_enter per
+ * pass, which also collects whatever finished. Connection state lives in one arena registered with
+ * the ring, so request headers are read into registered buffers. Unix socket connections read with
+ * recvmsg to pick up memfd descriptors. At most 1024 connections are served at once; further
+ * ones wait in the listen queue until a slot frees up. With timeouts set (daemon -i, -d) a ring
+ * timeout wakes the loop to expire connections, cancelling whatever operation each has out.
+ * Kernels without io_uring (or with it disabled) make otpRunUring return -1, and the daemon runs
+ * the epoll engine instead. Once 'drainFD' (an eventfd, or -1) is readable the engine stops
+ * accepting, drains its sessions (sessionDrain) and returns 0 when the last connection closes, or
+ * after OTP_DRAIN_MAX_MS with the rest closed.
+ */
+
+#ifndef OTP_URING_H
+#define OTP_URING_H
+
+#include "otp_session.h"
+
+int otpRunUring(const int *listenFDs, int count, int drainFD, const struct otpService *svc);
+
+#endif